@@ -22,10 +22,30 @@ include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := kdzwriter
-LOCAL_SRC_FILES := kdzwriter.c kdz.c md5.c gpt.c
+LOCAL_SRC_FILES := kdzwriter.c kdz.c kdzio.c discard.c journal.c undo.c ext4.c md5.c gpt.c
 LOCAL_CFLAGS := -Wall
 LOCAL_LDFLAGS := -Wl,-dynamic-linker,/sbin/linker64
-LOCAL_LDLIBS := -lz
+LOCAL_LDLIBS := -lz -lm
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+include $(BUILD_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := kdzmount
+LOCAL_SRC_FILES := kdzmount.c kdz.c kdzio.c discard.c journal.c undo.c ext4.c md5.c gpt.c
+LOCAL_CFLAGS := -Wall
+LOCAL_LDFLAGS := -Wl,-dynamic-linker,/sbin/linker64
+LOCAL_LDLIBS := -lz -lm
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+include $(BUILD_EXECUTABLE)
+
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := kdzextract
+LOCAL_SRC_FILES := kdzextract.c kdz.c kdzio.c discard.c journal.c undo.c ext4.c md5.c gpt.c
+LOCAL_CFLAGS := -Wall
+LOCAL_LDFLAGS := -Wl,-dynamic-linker,/sbin/linker64
+LOCAL_LDLIBS := -lz -lm
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
 include $(BUILD_EXECUTABLE)
 
@@ -40,7 +60,7 @@ include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := rmOP
-LOCAL_SRC_FILES := rmOP.c gpt.c
+LOCAL_SRC_FILES := rmOP.c gpt.c discard.c
 LOCAL_CFLAGS := -Wall
 LOCAL_LDFLAGS := -Wl,-dynamic-linker,/sbin/linker64
 LOCAL_LDLIBS := -lz
@@ -0,0 +1,297 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "discard.h"
+
+
+/* from the program */
+extern int verbose;
+
+/* largest single request, even if the device would take more */
+#define DISCARD_PIECE (64<<20)
+
+struct discard_range {
+	uint64_t off, len;
+};
+
+struct discard {
+	int fd;
+	uint64_t gran;		/* discard_granularity */
+	uint64_t piece;		/* largest request, multiple of gran */
+	uint64_t start;		/* partition's offset on the device */
+	bool punch;		/* an image file, punch holes instead */
+
+	struct discard_range pend;	/* still being merged into */
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* everything below is protected by lock */
+	struct discard_range *q;
+	unsigned qhead, qcount, qsz;
+	uint64_t queued, done;
+	bool closing, failed;
+};
+
+
+static void *discard_thread(void *opaque);
+
+
+/* one value from the device's sysfs directory, or its parent's */
+static uint64_t discard_sysfs(dev_t rdev, const char *file)
+{
+	const char *const fmt[]={
+		"/sys/dev/block/%u:%u/%s",
+		"/sys/dev/block/%u:%u/../%s",
+	};
+	unsigned long long val;
+	char name[128];
+	unsigned i;
+	FILE *f;
+
+	for(i=0; i<sizeof(fmt)/sizeof(fmt[0]); ++i) {
+		snprintf(name, sizeof(name), fmt[i], major(rdev), minor(rdev),
+file);
+		if(!(f=fopen(name, "r"))) continue;
+		if(fscanf(f, "%llu", &val)!=1) val=0;
+		fclose(f);
+		return val;
+	}
+
+	return 0;
+}
+
+struct discard *discard_open(int fd)
+{
+	struct discard *d;
+	struct stat st;
+	uint64_t max=0;
+	int err;
+
+	if(!(d=malloc(sizeof(struct discard)))) return NULL;
+	memset(d, 0, sizeof(struct discard));
+	d->fd=fd;
+	d->gran=1;
+
+	if(fstat(fd, &st)>=0&&S_ISBLK(st.st_mode)) {
+		uint64_t gran;
+
+		if((gran=discard_sysfs(st.st_rdev, "queue/discard_granularity")))
+			d->gran=gran;
+		max=discard_sysfs(st.st_rdev, "queue/discard_max_bytes");
+		/* "start" only exists for partitions, in 512 byte sectors */
+		d->start=discard_sysfs(st.st_rdev, "start")*512;
+	} else if(S_ISREG(st.st_mode)) d->punch=true;
+
+	if(!max||max>DISCARD_PIECE) max=DISCARD_PIECE;
+	if((d->piece=max/d->gran*d->gran)<d->gran) d->piece=d->gran;
+
+	if(verbose>=3) fprintf(stderr,
+"DEBUG: discard granularity %"PRIu64", requests of up to %"PRIu64" bytes\n",
+d->gran, d->piece);
+
+	if(pthread_mutex_init(&d->lock, NULL)) goto abort;
+	if(pthread_cond_init(&d->cond, NULL)) goto abort_lock;
+	if((err=pthread_create(&d->thread, NULL, discard_thread, d))) {
+		errno=err;
+		goto abort_cond;
+	}
+
+	return d;
+
+abort_cond:
+	pthread_cond_destroy(&d->cond);
+abort_lock:
+	pthread_mutex_destroy(&d->lock);
+abort:
+	free(d);
+	return NULL;
+}
+
+
+/* move the merged range onto the queue, trimmed to whole granules */
+static bool discard_flush(struct discard *d)
+{
+	const uint64_t lo=(d->start+d->pend.off+d->gran-1)/d->gran*d->gran;
+	const uint64_t hi=(d->start+d->pend.off+d->pend.len)/d->gran*d->gran;
+	bool ret=true;
+
+	d->pend.len=0;
+	if(hi<=lo) return true;
+
+	pthread_mutex_lock(&d->lock);
+
+	if(d->qhead==d->qcount) d->qhead=d->qcount=0;
+
+	if(d->qcount==d->qsz) {
+		const unsigned qsz=d->qsz?d->qsz*2:16;
+		void *const tmp=realloc(d->q, sizeof(d->q[0])*qsz);
+
+		if(!tmp) {
+			ret=false;
+			goto out;
+		}
+		d->q=tmp;
+		d->qsz=qsz;
+	}
+
+	d->q[d->qcount].off=lo-d->start;
+	d->q[d->qcount].len=hi-lo;
+	++d->qcount;
+	d->queued+=hi-lo;
+	pthread_cond_broadcast(&d->cond);
+
+out:
+	pthread_mutex_unlock(&d->lock);
+
+	return ret;
+}
+
+bool discard_add(struct discard *d, uint64_t off, uint64_t len)
+{
+	if(!len) return true;
+
+	/* adjacent, keep merging */
+	if(d->pend.len&&d->pend.off+d->pend.len==off) {
+		d->pend.len+=len;
+		return true;
+	}
+
+	if(d->pend.len&&!discard_flush(d)) return false;
+
+	d->pend.off=off;
+	d->pend.len=len;
+
+	return true;
+}
+
+
+void discard_progress(struct discard *d, uint64_t *queued, uint64_t *done)
+{
+	pthread_mutex_lock(&d->lock);
+	*queued=d->queued;
+	*done=d->done;
+	pthread_mutex_unlock(&d->lock);
+}
+
+
+bool discard_close(struct discard *d, const char *label)
+{
+	bool ret;
+
+	if(!d) return true;
+
+	ret=discard_flush(d);
+
+	pthread_mutex_lock(&d->lock);
+	d->closing=true;
+	pthread_cond_broadcast(&d->cond);
+
+	while(d->done<d->queued) {
+		if(label&&verbose>=0) {
+			printf("\rDiscarding %s: %3u%%", label,
+(unsigned)(d->done*100/d->queued));
+			fflush(stdout);
+		}
+		pthread_cond_wait(&d->cond, &d->lock);
+	}
+	if(label&&verbose>=0&&d->queued) printf("\rDiscarding %s: 100%%\n",
+label);
+
+	if(d->failed) ret=false;
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_join(d->thread, NULL);
+
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	free(d->q);
+	free(d);
+
+	return ret;
+}
+
+
+static void *discard_thread(void *opaque)
+{
+	struct discard *const d=opaque;
+	bool unsupported=false;
+
+	pthread_mutex_lock(&d->lock);
+
+	for(;;) {
+		uint64_t range[2];
+
+		if(d->qhead==d->qcount) {
+			if(d->closing) break;
+			pthread_cond_wait(&d->cond, &d->lock);
+			continue;
+		}
+
+		/* pieces start on granule boundaries, as does the range */
+		range[0]=d->q[d->qhead].off;
+		range[1]=d->q[d->qhead].len;
+		if(range[1]>d->piece) range[1]=d->piece;
+		if((d->q[d->qhead].len-=range[1])) d->q[d->qhead].off+=range[1];
+		else ++d->qhead;
+
+		pthread_mutex_unlock(&d->lock);
+
+		if(!unsupported&&(d->punch?fallocate(d->fd,
+FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, range[0], range[1]):
+ioctl(d->fd, BLKDISCARD, range))<0) {
+			if(verbose>=1) fprintf(stderr, "Discard failed: %s\n",
+strerror(errno));
+
+			/* no point in trying the rest */
+			if(errno==EOPNOTSUPP||errno==ENOTTY) unsupported=true;
+
+			pthread_mutex_lock(&d->lock);
+			d->failed=true;
+			pthread_mutex_unlock(&d->lock);
+		}
+
+		pthread_mutex_lock(&d->lock);
+		d->done+=range[1];
+		pthread_cond_broadcast(&d->cond);
+	}
+
+	pthread_mutex_unlock(&d->lock);
+
+	return NULL;
+}
+
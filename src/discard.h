@@ -0,0 +1,48 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+#ifndef __DISCARD_H__
+#define __DISCARD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Discards (TRIM) done by a background thread.  Adjacent ranges are merged,
+** then the result is split into pieces aligned to the device's
+** discard_granularity and no larger than discard_max_bytes, so no single
+** request stalls the device for long.  On an image file holes are punched
+** instead. */
+struct discard;
+
+/* fd must remain open until discard_close() */
+extern struct discard *discard_open(int fd);
+
+/* queue bytes [off, off+len) of fd for discarding */
+extern bool discard_add(struct discard *, uint64_t off, uint64_t len);
+
+/* bytes queued and bytes finished so far */
+extern void discard_progress(struct discard *, uint64_t *queued,
+uint64_t *done);
+
+/* wait for everything queued, showing progress if label is non-NULL; false
+** if anything failed (discards are advisory, so it is only worth a note) */
+extern bool discard_close(struct discard *, const char *label);
+
+#endif
+
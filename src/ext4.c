@@ -0,0 +1,671 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <endian.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "ext4.h"
+
+
+/* NOTE: All of these values are little-endian on storage media! */
+struct ext4_super {
+	uint32_t inodes_count;		/* 0x00 */
+	uint32_t blocks_count_lo;
+	uint32_t r_blocks_count_lo;
+	uint32_t free_blocks_count_lo;
+	uint32_t free_inodes_count;	/* 0x10 */
+	uint32_t first_data_block;
+	uint32_t log_block_size;
+	uint32_t log_cluster_size;
+	uint32_t blocks_per_group;	/* 0x20 */
+	uint32_t clusters_per_group;
+	uint32_t inodes_per_group;
+	uint32_t mtime;
+	uint32_t wtime;			/* 0x30 */
+	uint16_t mnt_count;
+	uint16_t max_mnt_count;
+	uint16_t magic;			/* 0xEF53 */
+	uint16_t state;
+	uint16_t errors;
+	uint16_t minor_rev_level;
+	uint32_t lastcheck;		/* 0x40 */
+	uint32_t checkinterval;
+	uint32_t creator_os;
+	uint32_t rev_level;
+	uint16_t def_resuid;		/* 0x50 */
+	uint16_t def_resgid;
+	uint32_t first_ino;
+	uint16_t inode_size;
+	uint16_t block_group_nr;
+	uint32_t feature_compat;
+	uint32_t feature_incompat;	/* 0x60 */
+	uint32_t feature_ro_compat;
+	char pad0[150];		/* 0x68 */
+	uint16_t desc_size;		/* 0xFE */
+	char pad1[80];		/* 0x100 */
+	uint32_t blocks_count_hi;	/* 0x150 */
+};
+
+struct ext4_group {
+	uint32_t block_bitmap_lo;	/* 0x00 */
+	uint32_t inode_bitmap_lo;
+	uint32_t inode_table_lo;
+	uint16_t free_blocks_count_lo;
+	uint16_t free_inodes_count_lo;
+	uint16_t used_dirs_count_lo;	/* 0x10 */
+	uint16_t flags;
+	uint32_t exclude_bitmap_lo;
+	uint16_t block_bitmap_csum_lo;
+	uint16_t inode_bitmap_csum_lo;
+	uint16_t itable_unused_lo;
+	uint16_t checksum;
+	/* only present with the 64-bit feature */
+	uint32_t block_bitmap_hi;	/* 0x20 */
+	uint32_t inode_bitmap_hi;
+	uint32_t inode_table_hi;
+};
+
+struct ext4_rawinode {
+	uint16_t mode;			/* 0x00 */
+	uint16_t uid;
+	uint32_t size_lo;
+	uint32_t atime;
+	uint32_t ctime;
+	uint32_t mtime;			/* 0x10 */
+	uint32_t dtime;
+	uint16_t gid;
+	uint16_t links_count;
+	uint32_t blocks_lo;
+	uint32_t flags;			/* 0x20 */
+	uint32_t osd1;
+	uint32_t block[15];		/* 0x28 */
+	uint32_t generation;		/* 0x64 */
+	uint32_t file_acl_lo;
+	uint32_t size_high;
+};
+
+struct ext4_extent_header {
+	uint16_t magic;			/* 0xF30A */
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;			/* 0 for leaves */
+	uint32_t generation;
+};
+
+struct ext4_extent_idx {
+	uint32_t block;			/* first logical block covered */
+	uint32_t leaf_lo;
+	uint16_t leaf_hi;
+	uint16_t unused;
+};
+
+struct ext4_extent {
+	uint32_t block;			/* first logical block */
+	uint16_t len;			/* over 32768 means unwritten */
+	uint16_t start_hi;
+	uint32_t start_lo;
+};
+
+struct ext4_dirent {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+};
+
+
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_EXT_MAGIC 0xF30A
+
+#define EXT4_INCOMPAT_FILETYPE 0x0002
+#define EXT4_INCOMPAT_64BIT 0x0080
+/* features which don't change how we read things */
+#define EXT4_INCOMPAT_SUPP (0x0002|0x0004|0x0040|0x0080|0x0100|0x0200|0x2000|\
+0x4000|0x8000)
+
+#define EXT4_RO_COMPAT_BIGALLOC 0x0200
+
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+#define EXT4_EXTENTS_FL 0x00080000
+#define EXT4_INLINE_DATA_FL 0x10000000
+
+/* extent trees deeper than this are corrupt */
+#define EXT4_MAX_DEPTH 5
+
+/* longest name a directory entry may hold */
+#define EXT4_NAME_LEN 255
+
+
+struct ext4_fs {
+	ext4preadfunc pread;
+	void *opaque;
+	uint32_t blksz;
+	uint64_t blocks;
+	uint32_t first_data_block;
+	uint32_t blocks_per_group;
+	uint32_t inodes_per_group;
+	uint32_t inodes_count;
+	uint16_t inode_size;
+	uint32_t incompat;
+	uint32_t ro_compat;
+	uint32_t groups;
+	char *blkbuf;		/* scratch for extent tree and block map walks */
+	struct {
+		uint64_t block_bitmap;
+		uint64_t inode_table;
+		uint16_t flags;
+	} group[];
+};
+
+
+static int ext4_map(struct ext4_fs *fs, const struct ext4_inode *inode,
+uint32_t lblk, uint64_t *pblk, uint64_t *len);
+
+
+
+struct ext4_fs *ext4_open(ext4preadfunc preadfunc, void *opaque)
+{
+	struct ext4_super super;
+	struct ext4_fs *fs;
+	uint64_t blocks;
+	uint32_t groups, descsz, i;
+	char *gdt=NULL;
+
+	if(sizeof(struct ext4_super)!=0x154) {
+		fprintf(stderr, "%s(): ext4 panic, superblock improper packing!\n",
+__func__);
+		return NULL;
+	}
+
+	if(preadfunc(opaque, &super, sizeof(super), 1024)!=sizeof(super))
+		return NULL;
+
+	if(le16toh(super.magic)!=EXT4_SUPER_MAGIC) return NULL;
+
+	if(le32toh(super.feature_incompat)&~EXT4_INCOMPAT_SUPP) {
+		fprintf(stderr, "ext4 filesystem uses unsupported features 0x%X\n",
+le32toh(super.feature_incompat)&~EXT4_INCOMPAT_SUPP);
+		return NULL;
+	}
+
+	blocks=le32toh(super.blocks_count_lo);
+	descsz=32;
+	if(le32toh(super.feature_incompat)&EXT4_INCOMPAT_64BIT) {
+		blocks|=(uint64_t)le32toh(super.blocks_count_hi)<<32;
+		descsz=le16toh(super.desc_size);
+		if(descsz<32||descsz&(descsz-1)) return NULL;
+	}
+
+	if(le32toh(super.log_block_size)>6||!le32toh(super.blocks_per_group)||
+!le32toh(super.inodes_per_group)) return NULL;
+
+	groups=(blocks-le32toh(super.first_data_block)+
+le32toh(super.blocks_per_group)-1)/le32toh(super.blocks_per_group);
+
+	if(!(fs=malloc(sizeof(struct ext4_fs)+sizeof(fs->group[0])*groups)))
+		return NULL;
+
+	fs->pread=preadfunc;
+	fs->opaque=opaque;
+	fs->blksz=1024<<le32toh(super.log_block_size);
+	fs->blocks=blocks;
+	fs->first_data_block=le32toh(super.first_data_block);
+	fs->blocks_per_group=le32toh(super.blocks_per_group);
+	fs->inodes_per_group=le32toh(super.inodes_per_group);
+	fs->inodes_count=le32toh(super.inodes_count);
+	fs->inode_size=le32toh(super.rev_level)?le16toh(super.inode_size):128;
+	fs->incompat=le32toh(super.feature_incompat);
+	fs->ro_compat=le32toh(super.feature_ro_compat);
+	fs->groups=groups;
+	fs->blkbuf=NULL;
+
+	if(fs->inode_size<sizeof(struct ext4_rawinode)) goto abort;
+
+	if(!(fs->blkbuf=malloc(fs->blksz*EXT4_MAX_DEPTH))) goto abort;
+
+	/* descriptor table follows the superblock's block */
+	if(!(gdt=malloc(descsz*groups))) goto abort;
+	if(preadfunc(opaque, gdt, descsz*groups,
+(off64_t)(fs->first_data_block+1)*fs->blksz)!=descsz*groups) goto abort;
+
+	for(i=0; i<groups; ++i) {
+		const struct ext4_group *const g=(struct ext4_group *)(gdt+descsz*i);
+
+		fs->group[i].block_bitmap=le32toh(g->block_bitmap_lo);
+		fs->group[i].inode_table=le32toh(g->inode_table_lo);
+		fs->group[i].flags=le16toh(g->flags);
+		if(descsz>=sizeof(struct ext4_group)) {
+			fs->group[i].block_bitmap|=
+(uint64_t)le32toh(g->block_bitmap_hi)<<32;
+			fs->group[i].inode_table|=
+(uint64_t)le32toh(g->inode_table_hi)<<32;
+		}
+	}
+
+	free(gdt);
+
+	return fs;
+
+abort:
+	if(gdt) free(gdt);
+	ext4_close(fs);
+	return NULL;
+}
+
+void ext4_close(struct ext4_fs *fs)
+{
+	if(!fs) return;
+	if(fs->blkbuf) free(fs->blkbuf);
+	free(fs);
+}
+
+
+uint32_t ext4_blksz(const struct ext4_fs *fs)
+{
+	return fs->blksz;
+}
+
+uint64_t ext4_blocks(const struct ext4_fs *fs)
+{
+	return fs->blocks;
+}
+
+
+uint8_t *ext4_bitmap(struct ext4_fs *fs)
+{
+	const size_t bytes=(fs->blocks+7)/8;
+	uint8_t *map, *bits;
+	uint32_t g;
+
+	/* bitmaps would be per cluster */
+	if(fs->ro_compat&EXT4_RO_COMPAT_BIGALLOC) {
+		errno=EOPNOTSUPP;
+		return NULL;
+	}
+
+	if(fs->blocks_per_group>fs->blksz*8) {
+		errno=EUCLEAN;
+		return NULL;
+	}
+
+	if(!(map=malloc(bytes))) return NULL;
+	if(!(bits=malloc(fs->blksz))) {
+		free(map);
+		return NULL;
+	}
+
+	/* anything not covered below stays in use */
+	memset(map, 0xFF, bytes);
+
+	for(g=0; g<fs->groups; ++g) {
+		const uint64_t base=fs->first_data_block+
+(uint64_t)g*fs->blocks_per_group;
+		uint32_t i, n=fs->blocks_per_group;
+
+		if(fs->group[g].flags&EXT4_BG_BLOCK_UNINIT) continue;
+
+		if(fs->pread(fs->opaque, bits, fs->blksz,
+(off64_t)fs->group[g].block_bitmap*fs->blksz)!=fs->blksz) {
+			free(bits);
+			free(map);
+			return NULL;
+		}
+
+		if(n>fs->blocks-base) n=fs->blocks-base;
+
+		for(i=0; i<n; ++i) if(!(bits[i>>3]&1<<(i&7)))
+			map[(base+i)>>3]&=~(1<<((base+i)&7));
+	}
+
+	free(bits);
+
+	return map;
+}
+
+
+bool ext4_inode(struct ext4_fs *fs, uint32_t ino, struct ext4_inode *inode)
+{
+	struct ext4_rawinode raw;
+	uint32_t group, idx;
+
+	if(!ino||ino>fs->inodes_count) return false;
+
+	group=(ino-1)/fs->inodes_per_group;
+	idx=(ino-1)%fs->inodes_per_group;
+	if(group>=fs->groups) return false;
+
+	if(fs->pread(fs->opaque, &raw, sizeof(raw),
+(off64_t)fs->group[group].inode_table*fs->blksz+(off64_t)idx*fs->inode_size)
+!=sizeof(raw)) return false;
+
+	inode->ino=ino;
+	inode->mode=le16toh(raw.mode);
+	inode->uid=le16toh(raw.uid);
+	inode->gid=le16toh(raw.gid);
+	inode->mtime=le32toh(raw.mtime);
+	inode->flags=le32toh(raw.flags);
+	inode->size=le32toh(raw.size_lo)|(uint64_t)le32toh(raw.size_high)<<32;
+	memcpy(inode->block, raw.block, sizeof(inode->block));
+
+	return true;
+}
+
+
+/* is the data stored in the inode itself? */
+static bool ext4_inline(const struct ext4_inode *inode)
+{
+	if(inode->flags&EXT4_INLINE_DATA_FL) return true;
+
+	/* "fast" symlinks */
+	return S_ISLNK(inode->mode)&&inode->size<sizeof(inode->block)&&
+!(inode->flags&EXT4_EXTENTS_FL);
+}
+
+
+ssize_t ext4_pread(struct ext4_fs *fs, const struct ext4_inode *inode,
+void *_buf, size_t count, off64_t offset)
+{
+	char *buf=_buf;
+	size_t done=0;
+
+	if(offset<0) return -1;
+	if((uint64_t)offset>=inode->size) return 0;
+	if(count>inode->size-offset) count=inode->size-offset;
+
+	if(ext4_inline(inode)) {
+		/* the remainder lives in an extended attribute */
+		if(inode->size>sizeof(inode->block)) {
+			errno=EOPNOTSUPP;
+			return -1;
+		}
+		memcpy(buf, (char *)inode->block+offset, count);
+		return count;
+	}
+
+	while(done<count) {
+		const uint32_t lblk=(offset+done)/fs->blksz;
+		const uint32_t boff=(offset+done)%fs->blksz;
+		uint64_t pblk, len, n;
+		int ret;
+
+		if((ret=ext4_map(fs, inode, lblk, &pblk, &len))<0) return -1;
+
+		n=len*fs->blksz-boff;
+		if(n>count-done) n=count-done;
+
+		if(!ret) memset(buf+done, 0, n);
+		else if(fs->pread(fs->opaque, buf+done, n,
+(off64_t)pblk*fs->blksz+boff)!=n) return -1;
+
+		done+=n;
+	}
+
+	return done;
+}
+
+
+/* find lblk in an extent tree node; 1 if mapped, 0 for a hole of *len */
+static int ext4_extmap(struct ext4_fs *fs, const void *node, unsigned level,
+uint32_t lblk, uint64_t *pblk, uint64_t *len)
+{
+	const struct ext4_extent_header *const head=node;
+	const unsigned entries=le16toh(head->entries);
+	/* the root lives in the inode's block[], the rest take a block */
+	const uint32_t nodesz=level?fs->blksz:
+sizeof(((struct ext4_inode *)0)->block);
+	uint64_t next=1ULL<<32; /* start of the following entry */
+	unsigned i;
+
+	if(le16toh(head->magic)!=EXT4_EXT_MAGIC) return -1;
+
+	/* entries are all 12 bytes, as is the header */
+	if(entries>le16toh(head->max)||
+le16toh(head->max)>(nodesz-sizeof(*head))/sizeof(struct ext4_extent)) {
+		errno=EUCLEAN;
+		return -1;
+	}
+
+	if(!le16toh(head->depth)) {
+		const struct ext4_extent *const ext=(void *)(head+1);
+
+		for(i=0; i<entries; ++i) {
+			const uint64_t start=le32toh(ext[i].block);
+			uint32_t elen=le16toh(ext[i].len);
+			bool unwritten=false;
+
+			if(elen>32768) {
+				elen-=32768;
+				unwritten=true;
+			}
+
+			if(lblk<start) {
+				next=start;
+				break;
+			}
+			if(lblk<start+elen) {
+				*len=start+elen-lblk;
+				if(unwritten) return 0;
+				*pblk=((uint64_t)le16toh(ext[i].start_hi)<<32|
+le32toh(ext[i].start_lo))+lblk-start;
+				return 1;
+			}
+		}
+
+		*len=next-lblk;
+		return 0;
+	} else {
+		const struct ext4_extent_idx *const idx=(void *)(head+1);
+		char *const child=fs->blkbuf+fs->blksz*level;
+		int ret;
+
+		if(level>=EXT4_MAX_DEPTH) return -1;
+
+		for(i=0; i<entries&&le32toh(idx[i].block)<=lblk; ++i);
+
+		if(i<entries) next=le32toh(idx[i].block);
+
+		/* before the first entry */
+		if(!i) {
+			*len=next-lblk;
+			return 0;
+		}
+		--i;
+
+		if(fs->pread(fs->opaque, child, fs->blksz,
+(off64_t)((uint64_t)le16toh(idx[i].leaf_hi)<<32|le32toh(idx[i].leaf_lo))*
+fs->blksz)!=fs->blksz) return -1;
+
+		if((ret=ext4_extmap(fs, child, level+1, lblk, pblk, len))<0)
+			return ret;
+
+		if(*len>next-lblk) *len=next-lblk;
+		return ret;
+	}
+}
+
+/* map a logical block, returns 1 if mapped, 0 for a hole, -1 on error */
+static int ext4_map(struct ext4_fs *fs, const struct ext4_inode *inode,
+uint32_t lblk, uint64_t *pblk, uint64_t *len)
+{
+	const uint32_t per=fs->blksz/4;
+	uint32_t ptr;
+	unsigned levels, i;
+
+	if(inode->flags&EXT4_EXTENTS_FL)
+		return ext4_extmap(fs, inode->block, 0, lblk, pblk, len);
+
+	/* old-style block map, direct then 1-3 levels of indirection */
+	*len=1;
+	if(lblk<12) {
+		ptr=le32toh(inode->block[lblk]);
+		levels=0;
+	} else if((lblk-=12)<per) {
+		ptr=le32toh(inode->block[12]);
+		levels=1;
+	} else if((lblk-=per)<per*per) {
+		ptr=le32toh(inode->block[13]);
+		levels=2;
+	} else {
+		lblk-=per*per;
+		ptr=le32toh(inode->block[14]);
+		levels=3;
+	}
+
+	for(i=levels; ptr&&i>0; --i) {
+		uint32_t div=1;
+		unsigned j;
+
+		for(j=1; j<i; ++j) div*=per;
+
+		if(fs->pread(fs->opaque, fs->blkbuf, fs->blksz,
+(off64_t)ptr*fs->blksz)!=fs->blksz) return -1;
+		ptr=le32toh(((uint32_t *)fs->blkbuf)[lblk/div%per]);
+	}
+
+	if(!ptr) return 0;
+
+	*pblk=ptr;
+	return 1;
+}
+
+
+bool ext4_readdir(struct ext4_fs *fs, const struct ext4_inode *dir,
+ext4dirfunc func, void *opaque)
+{
+	char *buf;
+	char name[EXT4_NAME_LEN+1];
+	uint64_t off;
+	bool ret=false;
+
+	if(!S_ISDIR(dir->mode)) {
+		errno=ENOTDIR;
+		return false;
+	}
+
+	/* inline directories have a different layout */
+	if(dir->flags&EXT4_INLINE_DATA_FL) {
+		errno=EOPNOTSUPP;
+		return false;
+	}
+
+	if(!(buf=malloc(fs->blksz))) return false;
+
+	for(off=0; off<dir->size; off+=fs->blksz) {
+		uint32_t pos=0;
+
+		if(ext4_pread(fs, dir, buf, fs->blksz, off)!=fs->blksz) goto abort;
+
+		while(pos+sizeof(struct ext4_dirent)<=fs->blksz) {
+			const struct ext4_dirent *const ent=(void *)(buf+pos);
+			const uint16_t rec_len=le16toh(ent->rec_len);
+			unsigned name_len=ent->name_len;
+
+			if(rec_len<sizeof(struct ext4_dirent)||
+pos+rec_len>fs->blksz) {
+				errno=EUCLEAN;
+				goto abort;
+			}
+
+			/* without the filetype feature, name_len is 16 bits */
+			if(!(fs->incompat&EXT4_INCOMPAT_FILETYPE))
+				name_len|=ent->file_type<<8;
+
+			if(name_len>EXT4_NAME_LEN||
+name_len+sizeof(struct ext4_dirent)>rec_len) {
+				errno=EUCLEAN;
+				goto abort;
+			}
+
+			if(le32toh(ent->inode)) {
+				memcpy(name, ent->name, name_len);
+				name[name_len]='\0';
+
+				if(!func(opaque, le32toh(ent->inode), name,
+fs->incompat&EXT4_INCOMPAT_FILETYPE?ent->file_type:0)) {
+					ret=true;
+					goto abort;
+				}
+			}
+
+			pos+=rec_len;
+		}
+	}
+
+	ret=true;
+
+abort:
+	free(buf);
+	return ret;
+}
+
+
+struct ext4_find {
+	const char *name;
+	size_t len;
+	uint32_t ino;
+};
+
+static bool ext4_lookup_func(void *opaque, uint32_t ino, const char *name,
+uint8_t type)
+{
+	struct ext4_find *const find=opaque;
+
+	if(strlen(name)!=find->len||memcmp(name, find->name, find->len))
+		return true;
+
+	find->ino=ino;
+	return false;
+}
+
+uint32_t ext4_lookup(struct ext4_fs *fs, const char *path)
+{
+	uint32_t ino=EXT4_ROOT_INO;
+
+	while(*path) {
+		struct ext4_inode dir;
+		struct ext4_find find={path, 0, 0};
+
+		if(*path=='/') {
+			++path;
+			continue;
+		}
+
+		find.len=strcspn(path, "/");
+		path+=find.len;
+
+		if(find.len==1&&find.name[0]=='.') continue;
+
+		if(!ext4_inode(fs, ino, &dir)) return 0;
+		if(!ext4_readdir(fs, &dir, ext4_lookup_func, &find)) return 0;
+		if(!(ino=find.ino)) return 0;
+	}
+
+	return ino;
+}
+
@@ -0,0 +1,93 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+#ifndef __EXT4_H__
+#define __EXT4_H__
+
+#if defined(_FILE_OFFSET_BITS) && _FILE_OFFSET_BITS==64
+#define EXT4_OFF_T off_t
+#elif defined(_LARGEFILE64_SOURCE)
+#define EXT4_OFF_T off64_t
+#else
+#error "ext4.h needs either _FILE_OFFSET_BITS=64 or _LARGEFILE64_SOURCE defined!"
+/* suppress other warnings/errors from compiler */
+#define EXT4_OFF_T long int
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+
+/* read-only access to an ext2/3/4 filesystem through a pread()-like function,
+** enough to find files and pull out their contents */
+
+/* the root directory's inode */
+#define EXT4_ROOT_INO 2
+
+/* the values needed from an inode, in host byte order except block[] */
+struct ext4_inode {
+	uint32_t ino;
+	uint16_t mode;		/* as st_mode */
+	uint16_t uid, gid;	/* low 16 bits only */
+	uint32_t mtime;
+	uint32_t flags;
+	uint64_t size;
+	uint32_t block[15];	/* as on disk: extents, block map or inline data */
+};
+
+struct ext4_fs;
+
+/* load data from somewhere */
+typedef ssize_t (*ext4preadfunc)(void *opaque, void *buf, size_t count,
+EXT4_OFF_T offset);
+
+/* check the superblock and load the group descriptors */
+extern struct ext4_fs *ext4_open(ext4preadfunc, void *opaque);
+extern void ext4_close(struct ext4_fs *);
+
+/* filesystem block size in bytes */
+extern uint32_t ext4_blksz(const struct ext4_fs *);
+/* number of filesystem blocks */
+extern uint64_t ext4_blocks(const struct ext4_fs *);
+
+/* load an inode */
+extern bool ext4_inode(struct ext4_fs *, uint32_t ino, struct ext4_inode *);
+
+/* find the inode of an absolute path, 0 if missing; symlinks aren't followed */
+extern uint32_t ext4_lookup(struct ext4_fs *, const char *path);
+
+/* read file data, holes and unwritten extents read as zeros */
+extern ssize_t ext4_pread(struct ext4_fs *, const struct ext4_inode *,
+void *buf, size_t count, EXT4_OFF_T offset);
+
+/* call func() for each entry of a directory, stopping if it returns false */
+typedef bool (*ext4dirfunc)(void *opaque, uint32_t ino, const char *name,
+uint8_t type);
+extern bool ext4_readdir(struct ext4_fs *, const struct ext4_inode *dir,
+ext4dirfunc func, void *opaque);
+
+/* allocation bitmap of the whole filesystem, one bit per block (LSB first)
+** set when in use; groups whose bitmap isn't initialized count as in use */
+extern uint8_t *ext4_bitmap(struct ext4_fs *);
+
+/* don't contaiminate others' namespace */
+#undef EXT4_OFF_T
+
+#endif
+
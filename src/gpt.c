@@ -40,8 +40,10 @@ typedef void *iconv_t;
 #include <errno.h>
 #include <stdlib.h>
 #include <linux/fs.h>
+#include <sys/syscall.h>
 
 #include "gpt.h"
+#include "syncrange.h"
 
 
 /* The magic number for the GPT */
@@ -421,6 +423,11 @@ size_t blksz)
 		}
 	}
 
+#ifndef DISABLE_WRITES
+	/* the backup must reach the media before the primary is touched */
+	if(sync_range(fd, off, cnt, SYNC_FILE_RANGE_ALL)<0) return false;
+#endif
+
 	return true;
 }
 
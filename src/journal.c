@@ -0,0 +1,273 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "journal.h"
+
+
+const char kdz_journal_magic[KDZ_JOURNAL_MAGIC_LEN]={'K', 'D', 'Z', 'j', 'n',
+0x00, 0x0D, 0x0A};
+
+struct kdz_journal {
+	int fd;
+	char *filename;
+	uint32_t count;		/* chunks in the KDZ file */
+	pthread_mutex_t lock;	/* write_kdzfiles() has several writers */
+	bool forgot;		/* the file lists chunks no longer done */
+	struct {
+		bool done;
+		uint32_t spot;
+		uint32_t crc32;	/* little-endian, as in the records */
+	} ent[];
+};
+
+
+/* load the records of an existing journal, false if it isn't usable */
+static bool kdz_journal_load(struct kdz_journal *j, const struct kdz_file *kdz)
+{
+	struct kdz_journal_head head;
+	struct kdz_journal_rec rec;
+	off64_t end=sizeof(head);
+	unsigned loaded=0;
+	ssize_t r;
+
+	if(read(j->fd, &head, sizeof(head))!=sizeof(head)||
+memcmp(head.magic, kdz_journal_magic, KDZ_JOURNAL_MAGIC_LEN)||
+le32toh(head.version)!=1) {
+		fprintf(stderr, "\"%s\" is not a usable journal\n", j->filename);
+		return false;
+	}
+
+	if(memcmp(head.md5, kdz->dz_file.md5, sizeof(head.md5))) {
+		fprintf(stderr, "Journal \"%s\" is for a different KDZ file\n",
+j->filename);
+		return false;
+	}
+
+	while((r=read(j->fd, &rec, sizeof(rec)))==sizeof(rec)) {
+		const uint32_t chunk=le32toh(rec.chunk);
+
+		if(chunk<1||chunk>j->count||
+rec.crc32!=kdz->chunks[chunk].dz.crc32) {
+			fprintf(stderr, "Journal \"%s\" is corrupt, ignoring\n",
+j->filename);
+			return false;
+		}
+
+		/* later records win, a chunk may have been redone */
+		if(!j->ent[chunk].done) ++loaded;
+		j->ent[chunk].done=true;
+		j->ent[chunk].spot=le32toh(rec.spot);
+		j->ent[chunk].crc32=rec.crc32;
+
+		end+=sizeof(rec);
+	}
+
+	/* an interrupted append leaves a partial record, drop it */
+	if(r<0||ftruncate64(j->fd, end)<0||lseek64(j->fd, end, SEEK_SET)!=end) {
+		fprintf(stderr, "Failed while reading \"%s\": %s\n", j->filename,
+strerror(errno));
+		return false;
+	}
+
+	if(verbose>=0) printf("Resuming from \"%s\", %u chunks already written\n",
+j->filename, loaded);
+
+	return true;
+}
+
+struct kdz_journal *kdz_journal_open(const struct kdz_file *kdz,
+const char *filename, bool resume)
+{
+	struct kdz_journal *j;
+	struct kdz_journal_head head;
+
+	if(!(j=calloc(1, sizeof(*j)+sizeof(j->ent[0])*
+(kdz->dz_file.chunk_count+1)))||!(j->filename=strdup(filename))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		free(j);
+		return NULL;
+	}
+	j->count=kdz->dz_file.chunk_count;
+	pthread_mutex_init(&j->lock, NULL);
+
+	if(resume) {
+		if((j->fd=open(filename, O_RDWR|O_LARGEFILE))>=0&&
+kdz_journal_load(j, kdz)) return j;
+
+		if(j->fd<0) fprintf(stderr, "Unable to open journal \"%s\": %s\n",
+filename, strerror(errno));
+		else close(j->fd);
+
+		if(verbose>=0) printf("Nothing to resume, writing everything\n");
+		memset(j->ent, 0, sizeof(j->ent[0])*(j->count+1));
+	}
+
+	if((j->fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, 0644))<0) {
+		fprintf(stderr, "Failed to create \"%s\": %s\n", filename,
+strerror(errno));
+		goto abort;
+	}
+
+	memcpy(head.magic, kdz_journal_magic, KDZ_JOURNAL_MAGIC_LEN);
+	head.version=htole32(1);
+	memcpy(head.md5, kdz->dz_file.md5, sizeof(head.md5));
+
+	if(write(j->fd, &head, sizeof(head))!=sizeof(head)||fdatasync(j->fd)<0) {
+		fprintf(stderr, "Failed while writing \"%s\": %s\n", filename,
+strerror(errno));
+		close(j->fd);
+		unlink(filename);
+		goto abort;
+	}
+
+	return j;
+
+abort:
+	pthread_mutex_destroy(&j->lock);
+	free(j->filename);
+	free(j);
+	return NULL;
+}
+
+/* rewrite the records, leaving out the forgotten chunks; a crash part way
+** only loses records, so more gets written next time */
+static bool kdz_journal_rewrite(struct kdz_journal *j)
+{
+	struct kdz_journal_rec *buf;
+	const off64_t start=sizeof(struct kdz_journal_head);
+	unsigned i, n=0;
+	bool ret=true;
+
+	if(!(buf=malloc(sizeof(buf[0])*j->count))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return false;
+	}
+
+	for(i=1; i<=j->count; ++i) if(j->ent[i].done) {
+		buf[n].chunk=htole32(i);
+		buf[n].crc32=j->ent[i].crc32;
+		buf[n].spot=htole32(j->ent[i].spot);
+		++n;
+	}
+
+	if(ftruncate64(j->fd, start)<0||lseek64(j->fd, start, SEEK_SET)!=start||
+write(j->fd, buf, sizeof(buf[0])*n)!=sizeof(buf[0])*n||fdatasync(j->fd)<0) {
+		fprintf(stderr, "Failed while writing \"%s\": %s\n", j->filename,
+strerror(errno));
+		ret=false;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+bool kdz_journal_close(struct kdz_journal *j, bool remove)
+{
+	bool ret=true;
+
+	if(!j) return true;
+
+	if(!remove&&j->forgot&&!kdz_journal_rewrite(j)) {
+		/* without it everything gets written again, which is safe */
+		remove=true;
+		ret=false;
+	}
+
+	if(close(j->fd)<0) ret=false;
+	if(remove&&unlink(j->filename)<0) ret=false;
+
+	pthread_mutex_destroy(&j->lock);
+	free(j->filename);
+	free(j);
+
+	return ret;
+}
+
+bool kdz_journal_done(const struct kdz_journal *j, unsigned chunk,
+uint32_t *spot)
+{
+	if(!j||chunk<1||chunk>j->count||!j->ent[chunk].done) return false;
+
+	if(spot) *spot=j->ent[chunk].spot;
+	return true;
+}
+
+void kdz_journal_forget(struct kdz_journal *j, unsigned chunk)
+{
+	if(!j||chunk<1||chunk>j->count) return;
+
+	pthread_mutex_lock(&j->lock);
+	if(j->ent[chunk].done) j->forgot=true;
+	j->ent[chunk].done=false;
+	pthread_mutex_unlock(&j->lock);
+}
+
+bool kdz_journal_add(struct kdz_journal *j, const struct kdz_journal_rec *rec,
+unsigned count)
+{
+	struct kdz_journal_rec *buf;
+	unsigned i;
+	bool ret=true;
+
+	if(!count) return true;
+
+	if(!(buf=malloc(sizeof(buf[0])*count))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return false;
+	}
+
+	for(i=0; i<count; ++i) {
+		buf[i].chunk=htole32(rec[i].chunk);
+		buf[i].crc32=rec[i].crc32; /* never converted from little-endian */
+		buf[i].spot=htole32(rec[i].spot);
+	}
+
+	/* one write, so a crash tears at most the final record */
+	pthread_mutex_lock(&j->lock);
+	if(write(j->fd, buf, sizeof(buf[0])*count)!=sizeof(buf[0])*count||
+fdatasync(j->fd)<0) {
+		fprintf(stderr, "Failed while writing \"%s\": %s\n", j->filename,
+strerror(errno));
+		ret=false;
+	} else for(i=0; i<count; ++i) {
+		const uint32_t chunk=rec[i].chunk;
+
+		if(chunk<1||chunk>j->count) continue;
+		j->ent[chunk].done=true;
+		j->ent[chunk].spot=rec[i].spot;
+		j->ent[chunk].crc32=rec[i].crc32;
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	free(buf);
+
+	return ret;
+}
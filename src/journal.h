@@ -0,0 +1,72 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kdz.h"
+
+
+/* Record of the chunks write_kdzfile() has finished, so an interrupted write
+** can be resumed.  Records are only appended once the chunks' data has been
+** flushed to the device, and a torn final record is ignored on loading. */
+struct kdz_journal;
+
+#define KDZ_JOURNAL_MAGIC_LEN 8
+
+extern const char kdz_journal_magic[KDZ_JOURNAL_MAGIC_LEN];
+
+/* journal file header, all values are little-endian */
+struct kdz_journal_head {
+	char magic[KDZ_JOURNAL_MAGIC_LEN];
+	uint32_t version;	/* format version */
+	char md5[16];		/* MD5 of chunk headers, from struct dz_file */
+};
+
+/* one per finished chunk */
+struct kdz_journal_rec {
+	uint32_t chunk;		/* index of chunk */
+	uint32_t crc32;		/* CRC32 of uncompressed data, as in the KDZ */
+	uint32_t spot;		/* CRC32 of the sampled blocks */
+};
+
+/* start a new journal, or with resume load the one already there (starting
+** a new one if it is missing or for another KDZ file) */
+extern struct kdz_journal *kdz_journal_open(const struct kdz_file *kdz,
+const char *filename, bool resume);
+
+/* with remove the journal is finished with and deleted */
+extern bool kdz_journal_close(struct kdz_journal *, bool remove);
+
+/* was the chunk recorded by a previous run? spot gets its sample CRC */
+extern bool kdz_journal_done(const struct kdz_journal *, unsigned chunk,
+uint32_t *spot);
+
+/* the chunk failed a check, it has to be written again; if the journal is
+** kept its record is dropped on closing */
+extern void kdz_journal_forget(struct kdz_journal *, unsigned chunk);
+
+/* append records, the chunks' data must already be on the device */
+extern bool kdz_journal_add(struct kdz_journal *,
+const struct kdz_journal_rec *rec, unsigned count);
+
+#endif
+
@@ -31,12 +31,24 @@
 #include <stdio.h>
 #include <zlib.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <linux/falloc.h>
 
 #include <uuid/uuid.h>
 
 #include "kdz.h"
 #include "md5.h"
 #include "gpt.h"
+#include "ext4.h"
+#include "kdzio.h"
+#include "discard.h"
+#include "journal.h"
+#include "undo.h"
+#include "syncrange.h"
 
 
 const char kdz_file_magic[KDZ_MAGIC_LEN]={0x28, 0x05, 0x00, 0x00,
@@ -46,6 +58,30 @@ const char dz_file_magic[DZ_MAGIC_LEN]={0x32, 0x96, 0x18, 0x74};
 
 const char dz_chunk_magic[DZ_MAGIC_LEN]={0x30, 0x12, 0x95, 0x78};
 
+const char kdz_fp_magic[KDZ_FP_MAGIC_LEN]={'K', 'D', 'Z', 'f', 'p', 0x00,
+0x0D, 0x0A};
+
+const char kdz_plan_magic[KDZ_PLAN_MAGIC_LEN]={'K', 'D', 'Z', 'p', 'l', 0x00,
+0x0D, 0x0A};
+
+uint64_t kdz_dirty_max=32<<20;
+
+unsigned kdz_io_depth=0;
+
+enum kdz_devread kdz_devread=KDZ_DEVREAD_MMAP;
+size_t kdz_devread_batch=4<<20;
+
+size_t kdz_readahead=8<<20;
+
+unsigned kdz_write_amp=4;
+size_t kdz_write_unit=0;
+
+struct kdz_journal *kdz_journal=NULL;
+
+struct undo *kdz_undo=NULL;
+
+const char *kdz_devices=NULL;
+
 /* the unpack context structure */
 struct unpackctx {
 	unsigned valid:1, z_finished:1, fail:1;
@@ -54,15 +90,41 @@ struct unpackctx {
 	MD5_CTX md5;
 	long crc;
 	z_stream zstr;
+	struct kdz_ring *ring;	/* input source, if not memory */
+	uint64_t ring_left;	/* compressed bytes not yet taken from ring */
+	bool ring_held;		/* holding a piece from ring */
 };
 
 
+/* load the KDZ structure, opening the devices too if devices */
+static struct kdz_file *_open_kdzfile(const char *filename, bool devices);
+
 /* open the appropriate device (flags=O_RDONLY or O_RDWR, most often) */
 static int open_device(const struct kdz_file *kdz, int dev, int flags);
+/* pattern with "%c" replaced by the device's letter (digit for eMMC) */
+static bool kdz_devname(const struct kdz_file *kdz, const char *pattern,
+int dev, char *name, size_t size);
+/* pattern with "%c" replaced by unit */
+static bool kdz_unitname(const char *pattern, char unit, char *name,
+size_t size);
+
+/* pwrite64() all of it */
+static bool kdz_pwrite(int fd, const char *buf, size_t len, off64_t off);
+/* which of enum kdz_slice_class the slice is */
+static enum kdz_slice_class kdz_slice_class(const struct kdz_file *kdz,
+const char *slice_name);
 
 /* initialize the unpacking context */
 static bool unpackchunk_alloc(struct unpackctx *ctx,
 const struct kdz_file *const kdz, const unsigned chunk);
+/* as unpackchunk_alloc(), but with the compressed data already in memory */
+static bool unpackchunk_alloc_in(struct unpackctx *ctx,
+const struct kdz_file *const kdz, const unsigned chunk, const char *in);
+
+/* as unpackchunk_alloc(), but with the compressed data coming from a
+** kdz_ring_add()ed extent of ring */
+static bool unpackchunk_alloc_ring(struct unpackctx *ctx,
+const struct kdz_file *const kdz, const unsigned chunk, struct kdz_ring *ring);
 
 /* retrieve uncompressed data from the chunk, returns bytes in buffer */
 static int unpackchunk(struct unpackctx *ctx, void *buf, size_t bufsz);
@@ -70,11 +132,24 @@ static int unpackchunk(struct unpackctx *ctx, void *buf, size_t bufsz);
 /* perform the chunk verification steps */
 static bool unpackchunk_free(struct unpackctx *const ctx, bool discard);
 
+/* release a loaded fingerprint */
+static void free_kdzfp(struct kdz_fp *fp);
+
 
 
 struct kdz_file *open_kdzfile(const char *filename)
 {
-	int fd=-1;
+	return _open_kdzfile(filename, true);
+}
+
+struct kdz_file *open_kdzfile_nodev(const char *filename)
+{
+	return _open_kdzfile(filename, false);
+}
+
+static struct kdz_file *_open_kdzfile(const char *filename, bool devices)
+{
+	int fd=-1, kfd=-1;
 	off_t len;
 	char *map=NULL;
 	struct kdz_file *ret=NULL;
@@ -110,8 +185,8 @@ struct kdz_file *open_kdzfile(const char *filename)
 		goto abort;
 	}
 
-	/* no need to keep it lying around, the mmap remains */
-	close(fd);
+	/* kept for reads which bypass the mmap */
+	kfd=fd;
 	fd=-1;
 
 	if(memcmp(kdz_file_magic, map, KDZ_MAGIC_LEN)) {
@@ -154,6 +229,14 @@ struct kdz_file *open_kdzfile(const char *filename)
 
 	ret->devs=NULL;
 	ret->map=NULL;
+	ret->fp=NULL;
+	ret->gpts=NULL;
+	ret->keep=0;
+
+	if(!(ret->kept=calloc(chunks+1, sizeof(ret->kept[0])))) {
+		perror("memory allocation failure");
+		goto abort;
+	}
 
 	ret->off=le64toh(kdz->off);
 
@@ -239,15 +322,34 @@ md5out[0xC], md5out[0xD], md5out[0xE], md5out[0xF]);
 
 	ret->max_device=devs;
 
+	if(!(ret->gpts=calloc((devs+1)*2, sizeof(ret->gpts[0])))) {
+		perror("memory allocation failure");
+		goto abort;
+	}
+
 	/* ensure these start cleared, so abort procedure won't munmap() */
 	for(i=0; i<=devs; ++i) ret->devs[i].map=NULL;
 
 	for(i=0; i<=devs; ++i) {
+		if(!devices) {
+			/* no way to ask, go by the usual for the media type */
+			ret->devs[i].blksz=(ret->dz_file.flag_ufs&256)==256?
+4096:512;
+			ret->devs[i].len=0;
+			continue;
+		}
+
 		if((fd=open_device(ret, i, O_RDONLY))<0) goto abort;
 
 		if(ioctl(fd, BLKSSZGET, &ret->devs[i].blksz)<0) {
-			perror("ioctl");
-			goto abort;
+			if(!kdz_devices) {
+				perror("ioctl");
+				goto abort;
+			}
+
+			/* image files have no sector size, go by the usual */
+			ret->devs[i].blksz=(ret->dz_file.flag_ufs&256)==256?
+4096:512;
 		}
 
 		if((len=lseek(fd, 0, SEEK_END))<0) {
@@ -268,11 +370,14 @@ md5out[0xC], md5out[0xD], md5out[0xE], md5out[0xF]);
 		close(fd);
 	}
 
+	ret->fd=kfd;
+
 	if(verbose>=9) fprintf(stderr, "DEBUG: KDZ file successfully opened\n");
 
 	return ret;
 
 abort:
+	if(kfd>=0) close(kfd);
 	if(fd>=0) close(fd);
 	if(map) munmap(map, len);
 	if(ret) {
@@ -280,6 +385,9 @@ abort:
 
 		if(ret->chunks) free(ret->chunks);
 
+		free(ret->kept);
+		free(ret->gpts);
+
 		if(ret->devs) {
 			for(i=0; i<=devs; ++i) if(ret->devs[i].map)
 				munmap(ret->devs[i].map, ret->devs[i].len);
@@ -301,15 +409,24 @@ void close_kdzfile(struct kdz_file *kdz)
 	if(!kdz) return;
 
 	munmap(kdz->map, kdz->len);
+	close(kdz->fd);
 
 	for(i=0; i<=kdz->max_device; ++i) {
-		munmap(kdz->devs[i].map, kdz->devs[i].len);
+		if(kdz->devs[i].map) munmap(kdz->devs[i].map, kdz->devs[i].len);
 	}
 
 	free(kdz->devs);
 
 	free(kdz->chunks);
 
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) free(kdz->kept[i]);
+	free(kdz->kept);
+
+	for(i=0; i<(kdz->max_device+1)*2; ++i) free(kdz->gpts[i]);
+	free(kdz->gpts);
+
+	free_kdzfp(kdz->fp);
+
 	free(kdz);
 }
 
@@ -328,788 +445,5311 @@ off64_t offset)
 	return count;
 }
 
-
-static int test_kdzfile_gpt_entry(int dev, int maxreturn,
-struct gpt_entry *kdzentry, struct gpt_entry *deventry);
-int test_kdzfile(struct kdz_file *kdz)
+/* a device's GPT, parsed once then kept until kdz_devgpt_forget(); GPT_ANY
+** prefers the primary as readgptb() does, NULL if there isn't one
+**
+** kdz is const to the KDZ's own contents, the caches it points to are
+** not: only dev's entries are touched, and write_kdzfiles() has one thread
+** per device, so whoever is working on dev owns them */
+static const struct gpt_data *kdz_devgpt(const struct kdz_file *kdz, int dev,
+enum gpt_type type)
 {
-	int i;
-	int dev=-1;
-	off64_t blksz;
-	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
-	char *map=NULL;
-	char *buf=NULL;
-	uint32_t bufsz=0;
-	int maxreturn=3;
+	struct gpt_data **const slot=kdz->gpts+dev*2+(type==GPT_BACKUP);
+	const struct gpt_data *ret;
 	struct gpt_buf gpt_buf;
 
-	for(i=1; i<=kdz->dz_file.chunk_count&&maxreturn>0; ++i) {
-		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
-		const char *const slice_name=dz->slice_name;
-		struct {
-			const char *name;
-			const short result;
-		} matches[]={
-			{"BackupGPT",		0x7}, /* special */
-			{"PrimaryGPT",		0x7}, /* special */
-			{"apdp",		0x2}, /* worthwhile??? */
-			{"cmnlib",		0x2},
-			{"cmnlib64",		0x2},
-			{"cmnlib64bak",		0x2},
-			{"cmnlibbak",		0x2},
-			{"devcfg",		0x2},
-			{"devcfgbak",		0x2},
-			{"factory",		0x2}, /* worthwhile??? */
-			{"hyp",			0x2},
-			{"hypbak",		0x2},
-			{"keymaster",		0x2},
-			{"keymasterbak",	0x2},
-			{"laf",			0x2},
-			{"lafbak",		0x2},
-			{"msadp",		0x2}, /* worthwhile??? */
-			{"pmic",		0x2},
-			{"pmicbak",		0x2},
-			{"raw_resources",	0x2}, /* required, mod cand */
-			{"raw_resourcesbak",	0x3}, /* required */
-			{"rpm",			0x2},
-			{"rpmbak",		0x2},
-			{"sec",			0x3}, /* required */
-			{"tz",			0x2},
-			{"tzbak",		0x2},
-			{"xbl",			0x2},
-			{"xbl2",		0x2},
-			{"xbl2bak",		0x2},
-			{"xblbak",		0x2},
-		};
-		unsigned char lo=0, hi=sizeof(matches)/sizeof(matches[0]);
-		uint32_t cur=0;
-		bool mismatch=false;
-		enum gpt_type gpt_type;
-		struct gpt_data *gptdev, *gptdev2, *gptkdz;
-		int res, mid;
-		int ii;
-
-		while(mid=(hi+lo)/2, res=strcmp(slice_name, matches[mid].name)) {
-			if(res<0) hi=mid;
-			else if(res>0) lo=mid+1;
-			if(lo==hi) goto notfound; /* unimportant, ignore */
-		}
-
-		/* going for a lower-quality match */
-		if(!(maxreturn&matches[mid].result)) continue;
-
+	if(type==GPT_ANY) {
+		if((ret=kdz_devgpt(kdz, dev, GPT_PRIMARY))) return ret;
+		return kdz_devgpt(kdz, dev, GPT_BACKUP);
+	}
 
-		if(dz->device!=dev) {
-			dev=dz->device;
+	if(*slot) return *slot;
 
-			blksz=kdz->devs[dev].blksz;
-			if(bufsz!=blksz*5) {
-				free(buf);
-				bufsz=blksz*5;
-				if(!(buf=malloc(bufsz))) {
-					fprintf(stderr,
-"Memory allocation error, cannot continue\n");
-					goto abort;
-				}
-			}
+	gpt_buf.bufsz=kdz->devs[dev].len;
+	gpt_buf.buf=kdz->devs[dev].map;
 
-			map=kdz->devs[dev].map;
-		}
+	return *slot=readgptb(gptbuffunc, &gpt_buf, kdz->devs[dev].blksz, type);
+}
 
-		if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+/* the device's GPTs were rewritten, parse them again when next needed, as
+** kdz_devgpt() only by whoever owns dev */
+static void kdz_devgpt_forget(const struct kdz_file *kdz, int dev)
+{
+	free(kdz->gpts[dev*2]);
+	free(kdz->gpts[dev*2+1]);
+	kdz->gpts[dev*2]=kdz->gpts[dev*2+1]=NULL;
+}
 
-		while(cur<dz->target_size) {
-			uint32_t cmp=dz->target_size-cur;
-			if(cmp>bufsz) cmp=bufsz;
+/* take over a chunk test_kdzfile() kept inflated, NULL if there isn't one;
+** as kdz_devgpt() only by whoever owns the chunk's device */
+static char *kdz_kept_take(const struct kdz_file *kdz, unsigned chunk)
+{
+	char *const ret=kdz->kept[chunk];
 
-			if(unpackchunk(ctx, buf, cmp)<=0) goto abort;
+	kdz->kept[chunk]=NULL;
 
-			/* keep going to verify the CRC and MD5 */
-			if(!mismatch&&
-memcmp(map+dz->target_addr*blksz+cur, buf, cmp)) mismatch=1;
+	return ret;
+}
 
-			cur+=cmp;
-		}
+/* inflate and check a whole chunk, NULL on failure */
+static char *kdz_inflate_chunk(const struct kdz_file *kdz, unsigned chunk)
+{
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	char *buf;
 
-		if(!unpackchunk_free(ctx, false)) goto abort;
+	if(!(buf=malloc(dz->target_size?dz->target_size:1))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		return NULL;
+	}
 
-		/* exact match, nothing to worry about */
-		if(!mismatch) continue;
+	if(!unpackchunk_alloc(ctx, kdz, chunk)||
+unpackchunk(ctx, buf, dz->target_size)!=dz->target_size||
+!unpackchunk_free(ctx, false)) {
+		unpackchunk_free(ctx, true);
+		fprintf(stderr, "Failed to decompress chunk %u\n", chunk);
+		free(buf);
+		return NULL;
+	}
 
+	return buf;
+}
 
-		/* nuke some maxreturn bits, unless special-case match */
-		if(matches[mid].result<4) {
-			maxreturn&=~matches[mid].result;
-			continue;
-		}
 
-/* special-case match for GPTs:
-** The type-UUIDs *must* match, but Id-UUIDs can differ.  For sda, the border
-** between OP and userdata normally differs due to varying amounts of LGE
-** bloatware.  A tool to remove OP exists, and LineageOS is likely to modify
-** system area.  For sdg, the types differ even for perfect match KDZ. */
+/* device contents for comparisons, from the mmap or read into buf */
+struct kdz_devbuf {
+	char *buf;
+	size_t bufsz;
+	int fd, dev;		/* device currently open for reads */
+	bool direct;
+};
+#define KDZ_DEVBUF_INIT {NULL, 0, -1, -1, false}
 
-		if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+/* throughput of each method */
+static struct {
+	uint64_t bytes, nsec, reads;
+} kdz_devstat[KDZ_DEVREAD_COUNT];
 
-		if(dz->target_addr<=3) gpt_type=GPT_PRIMARY;
-		else {
-			gpt_type=GPT_BACKUP;
-			cur=0;
-			/* chew off enough for the remainder to fill buffer */
-			while(dz->target_size-cur>bufsz) {
-				size_t next=dz->target_size-bufsz-cur;
-				if(next>bufsz) next=bufsz;
-
-				if(unpackchunk(ctx, buf, next)<=0)
-					goto abort;
+static bool kdz_devbuf_open(struct kdz_devbuf *db, const struct kdz_file *kdz,
+int dev)
+{
+	if(db->fd>=0) close(db->fd);
+	db->dev=-1;
+
+	db->direct=kdz_devread==KDZ_DEVREAD_DIRECT;
+	if((db->fd=open_device(kdz, dev, O_RDONLY|(db->direct?O_DIRECT:0)))<0&&
+db->direct&&errno==EINVAL) {
+		if(verbose>=0) fprintf(stderr,
+"O_DIRECT refused for sd%c, reading through the page cache\n", 'a'+dev);
+		db->direct=false;
+		db->fd=open_device(kdz, dev, O_RDONLY);
+	}
+	if(db->fd<0) return false;
 
-			}
-		}
+	db->dev=dev;
+	return true;
+}
 
-		if(unpackchunk(ctx, buf, bufsz)<=0) goto abort;
+/* device contents at off, valid until the next call */
+static const char *kdz_devget(struct kdz_devbuf *db,
+const struct kdz_file *kdz, int dev, off64_t off, size_t len)
+{
+	const enum kdz_devread method=kdz_devread;
+	struct timespec start, end;
+	const char *ret;
 
-		if(!unpackchunk_free(ctx, gpt_type==GPT_PRIMARY)) goto abort;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
+	if(method==KDZ_DEVREAD_MMAP) {
+		size_t i;
 
-		/* load the corresponding device GPT */
-		gpt_buf.bufsz=kdz->devs[dev].len;
-		gpt_buf.buf=kdz->devs[dev].map;
+		ret=kdz->devs[dev].map+off;
 
-		if(!(gptdev=readgptb(gptbuffunc, &gpt_buf, blksz, gpt_type))) {
-			fprintf(stderr, "Failed reading %s sd%c GPT\n",
-gpt_type==GPT_PRIMARY?"primary":"backup", 'a'+dev);
-			goto abort;
+		/* take the faults here, so they're counted */
+		for(i=0; i<len; i+=4096) (void)*(volatile const char *)(ret+i);
+	} else {
+		/* O_DIRECT needs whole blocks */
+		const uint32_t blksz=kdz->devs[dev].blksz;
+		const size_t rlen=(len+blksz-1)/blksz*blksz;
+		size_t cnt;
+
+		if(db->dev!=dev&&!kdz_devbuf_open(db, kdz, dev)) return NULL;
+
+		if(db->bufsz<rlen) {
+			free(db->buf);
+			db->bufsz=0;
+			if(posix_memalign((void **)&db->buf, 4096, rlen)) {
+				db->buf=NULL;
+				fprintf(stderr, "Memory allocation failure!\n");
+				return NULL;
+			}
+			db->bufsz=rlen;
 		}
 
+		for(cnt=0; cnt<rlen; ) {
+			const ssize_t r=pread64(db->fd, db->buf+cnt, rlen-cnt,
+off+cnt);
 
-		/* just in case, compare the other device GPT... */
-		gpt_buf.bufsz=kdz->devs[dev].len;
-		gpt_buf.buf=kdz->devs[dev].map;
+			if(r>0) {
+				cnt+=r;
+				continue;
+			}
+			if(r<0&&errno==EINTR) continue;
+
+			if(r<0&&errno==EINVAL&&db->direct) {
+				if(verbose>=0) fprintf(stderr,
+"O_DIRECT read refused, continuing through the page cache\n");
+				if(fcntl(db->fd, F_SETFL, fcntl(db->fd, F_GETFL)&~O_DIRECT)<0)
+					return NULL;
+				db->direct=false;
+				continue;
+			}
 
-		if(!(gptdev2=readgptb(gptbuffunc, &gpt_buf, blksz, gpt_type==GPT_BACKUP?GPT_PRIMARY:GPT_BACKUP))) {
-			fprintf(stderr, "Failed reading %s sd%c GPT\n",
-gpt_type==GPT_BACKUP?"primary":"backup", 'a'+dev);
-			free(gptdev);
-			goto abort;
+			fprintf(stderr, "Failed reading sd%c: %s\n", 'a'+dev,
+r<0?strerror(errno):"short read");
+			return NULL;
 		}
 
-		if(!comparegpt(gptdev, gptdev2)) {
-			free(gptdev);
-			free(gptdev2);
-			goto abort;
-		}
+		ret=db->buf;
+	}
 
-		free(gptdev2);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	/* write_kdzfiles() may have several threads here */
+	__atomic_add_fetch(&kdz_devstat[method].bytes, len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kdz_devstat[method].nsec, (end.tv_sec-start.tv_sec)*
+1000000000LL+end.tv_nsec-start.tv_nsec, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&kdz_devstat[method].reads, 1, __ATOMIC_RELAXED);
 
+	return ret;
+}
 
-		/* load the KDZ GPT */
-		gpt_buf.bufsz=bufsz;
-		gpt_buf.buf=buf;
+static void kdz_devbuf_free(struct kdz_devbuf *db)
+{
+	if(db->fd>=0) close(db->fd);
+	db->fd=-1;
+	db->dev=-1;
+	free(db->buf);
+	db->buf=NULL;
+	db->bufsz=0;
+}
 
-		if(!(gptkdz=readgptb(gptbuffunc, &gpt_buf, blksz, gpt_type))) {
-			fprintf(stderr, "Failed reading %s KDZ sd%c GPT\n",
-gpt_type==GPT_PRIMARY?"primary":"backup", 'a'+dev);
-			free(gptdev);
-			goto abort;
-		}
+/* size of each read of compressed data for kdz_readahead */
+#define KDZ_RING_PIECE (1<<20)
 
+/* read ahead for chunks first through last of slice_name (any if NULL),
+** passing over those in skip and, if kept, those test_kdzfile() kept */
+static struct kdz_ring *kdz_ring_chunks(const struct kdz_file *kdz,
+const char *slice_name, unsigned first, unsigned last,
+const struct kdz_journal *skip, bool kept)
+{
+	struct kdz_ring *ring;
+	unsigned i;
 
+	if(!kdz_readahead) return NULL;
 
-		/* check header fields, okay for the CRCs to differ */
-		if(memcmp(&gptdev->head, &gptkdz->head,
-(char *)&gptdev->head.headerCRC32-(char *)&gptdev->head.magic)||
-memcmp(&gptdev->head.reserved, &gptkdz->head.reserved,
-(char *)&gptdev->head.altLBA-(char *)&gptdev->head.reserved)||
-memcmp(&gptdev->head.dataStartLBA, &gptkdz->head.dataStartLBA,
-(char *)&gptdev->head.entryCRC32-(char *)&gptdev->head.dataStartLBA))
-			maxreturn=0; /* fail */
-		/* a device was encountered with the backup GPT's altLBA
-		** pointing at itself, rather than the primary GPT; this is
-		** apparently okay, but violates specifications... */
-		if(gptdev->head.altLBA!=gptkdz->head.altLBA&&
-gptkdz->head.altLBA!=1&&gptdev->head.altLBA!=gptkdz->head.myLBA)
-			maxreturn=0;
+	if(!(ring=kdz_ring_open(kdz->fd, KDZ_RING_PIECE,
+kdz_readahead/KDZ_RING_PIECE))) {
+		fprintf(stderr, "Memory allocation failure, not reading ahead\n");
+		return NULL;
+	}
 
+	for(i=first; i<=last; ++i) {
+		if(slice_name&&strcmp(slice_name, kdz->chunks[i].dz.slice_name))
+			continue;
+		if(kdz_journal_done(skip, i, NULL)||(kept&&kdz->kept[i])) continue;
+		if(!kdz_ring_add(ring, kdz->chunks[i].zoff,
+kdz->chunks[i].dz.data_size)) goto abort;
+	}
 
-		for(ii=0; ii<gptdev->head.entryCount-1&&maxreturn>0; ++ii)
-			maxreturn=test_kdzfile_gpt_entry(dev, maxreturn,
-gptkdz->entry+ii, gptdev->entry+ii);
+	if(kdz_ring_start(ring)) return ring;
 
-		free(gptdev);
-		free(gptkdz);
+abort:
+	fprintf(stderr, "Failed to start reading ahead: %s\n", strerror(errno));
+	kdz_ring_close(ring);
+	return NULL;
+}
 
+/* largest piece to compare at once */
+static size_t kdz_devread_piece(uint32_t blksz)
+{
+	size_t batch=kdz_devread_batch/blksz*blksz;
 
-	notfound:
-		/* basically a continue for this loop */
-		;
-	}
+	return batch?batch:blksz;
+}
 
-	free(buf);
+void kdz_devread_report(void)
+{
+	static const char *const name[KDZ_DEVREAD_COUNT]={
+		"mmap", "pread", "O_DIRECT pread"
+	};
+	unsigned i;
 
-	if(maxreturn>2) maxreturn=2;
+	for(i=0; i<KDZ_DEVREAD_COUNT; ++i) {
+		const double secs=kdz_devstat[i].nsec/1e9;
 
-	return maxreturn;
+		if(!kdz_devstat[i].reads) continue;
 
-abort:
-	/* map will only be non-NULL after mmap(), by which time mlen!=0 */
-	if(buf) free(buf);
+		fprintf(stderr,
+"Device reads (%s): %.1f MB in %llu reads, %.3f seconds, %.1f MB/s\n",
+name[i], kdz_devstat[i].bytes/1048576.0,
+(unsigned long long)kdz_devstat[i].reads, secs,
+secs>0?kdz_devstat[i].bytes/1048576.0/secs:0.0);
+	}
+}
 
-	unpackchunk_free(ctx, true);
 
-	return -1;
-}
+/* slices examined by test_kdzfile(), sorted for a binary search */
+static const struct {
+	const char *name;
+	const short result;
+} test_matches[]={
+	{"BackupGPT",		0x7}, /* special */
+	{"PrimaryGPT",		0x7}, /* special */
+	{"apdp",		0x2}, /* worthwhile??? */
+	{"cmnlib",		0x2},
+	{"cmnlib64",		0x2},
+	{"cmnlib64bak",		0x2},
+	{"cmnlibbak",		0x2},
+	{"devcfg",		0x2},
+	{"devcfgbak",		0x2},
+	{"factory",		0x2}, /* worthwhile??? */
+	{"hyp",			0x2},
+	{"hypbak",		0x2},
+	{"keymaster",		0x2},
+	{"keymasterbak",	0x2},
+	{"laf",			0x2},
+	{"lafbak",		0x2},
+	{"msadp",		0x2}, /* worthwhile??? */
+	{"pmic",		0x2},
+	{"pmicbak",		0x2},
+	{"raw_resources",	0x2}, /* required, mod cand */
+	{"raw_resourcesbak",	0x3}, /* required */
+	{"rpm",			0x2},
+	{"rpmbak",		0x2},
+	{"sec",			0x3}, /* required */
+	{"tz",			0x2},
+	{"tzbak",		0x2},
+	{"xbl",			0x2},
+	{"xbl2",		0x2},
+	{"xbl2bak",		0x2},
+	{"xblbak",		0x2},
+};
 
-static int test_kdzfile_gpt_entry(int dev, int maxreturn,
-struct gpt_entry *kdzentry, struct gpt_entry *deventry)
+/* index into test_matches[], -1 if test_kdzfile() ignores the slice */
+static int test_kdzfile_match(const char *slice_name)
 {
-	const char *const ignore[]={
-		"",
-		"OP",
-		"cache",
-		"cust",
-		"grow",
-		"grow2",
-		"grow3",
-		"grow4",
-		"grow5",
-		"grow6",
-		"grow7",
-		"system",
-		"userdata",
-	};
-	unsigned char lo=0, hi=sizeof(ignore)/sizeof(ignore[0]);
+	unsigned char lo=0, hi=sizeof(test_matches)/sizeof(test_matches[0]);
 	int res, mid;
 
-
-	while(mid=(hi+lo)/2, res=strcmp(kdzentry->name, ignore[mid])) {
+	while(mid=(hi+lo)/2, res=strcmp(slice_name, test_matches[mid].name)) {
 		if(res<0) hi=mid;
 		else if(res>0) lo=mid+1;
-		if(lo==hi) {
-			mid=-1; /* run all tests */
-			break;
-		}
+		if(lo==hi) return -1; /* unimportant, ignore */
 	}
 
-	/* ignore slices which are likely to be modified by LineageOS or LGE */
-	if(mid>=0) return maxreturn;
-
-	/* check name, flags, and type */
-	if(deventry->flags!=kdzentry->flags||
-uuid_compare(deventry->type, kdzentry->type)||
-strncmp(deventry->name, kdzentry->name, sizeof(deventry->name)))
-		return 0;
+	return mid;
+}
 
-	/* the Ids always differ on sdg */
-	if(maxreturn&2&&dev!=6&&
-uuid_compare(deventry->id, kdzentry->id)) maxreturn&=~2;
+/* fingerprint entry for chunk, NULL if none */
+static const struct kdz_fp_rec *test_kdzfile_fprec(const struct kdz_file *kdz,
+unsigned chunk, const char **gpt)
+{
+	uint32_t lo=0, hi, mid;
 
-	/* question is whether to try the above tests on non-empty entries? */
+	if(!kdz->fp) return NULL;
 
-	/* on-device border between OP and userdata differs */
-	if(deventry->startLBA!=kdzentry->startLBA||
-deventry->endLBA!=kdzentry->endLBA)
-		return 0;
+	/* records are sorted by chunk */
+	hi=kdz->fp->count;
+	while(lo<hi) {
+		mid=(lo+hi)/2;
+		if(kdz->fp->ent[mid].rec.chunk<chunk) lo=mid+1;
+		else if(kdz->fp->ent[mid].rec.chunk>chunk) hi=mid;
+		else {
+			if(gpt) *gpt=kdz->fp->ent[mid].gpt;
+			return &kdz->fp->ent[mid].rec;
+		}
+	}
 
-	return maxreturn;
+	return NULL;
 }
 
-
-int report_kdzfile(struct kdz_file *kdz)
+/* retrieve the GPT from chunk (they're small, so the whole chunk is loaded,
+** unless test_kdzfile_cmp() already kept it or the fingerprint has it) */
+static struct gpt_data *test_kdzfile_kdzgpt(const struct kdz_file *kdz,
+struct unpackctx *ctx, unsigned chunk)
 {
-	int i;
-	int dev=-1;
-	off64_t blksz;
-	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
-	char *map=NULL;
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	enum gpt_type gpt_type;
+	struct gpt_buf gpt_buf;
+	struct gpt_data *ret=NULL;
+	const char *data=NULL;
 	char *buf=NULL;
-	uint32_t bufsz=0;
-	uint32_t cur;
-	uint32_t mismatch;
-
-	if(verbose>=11) fprintf(stderr, "DEBUG: starting report code\n");
 
-	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
-		const char *fmt;
-		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
-
-		if(dz->device!=dev) {
-			dev=dz->device;
-
-			blksz=kdz->devs[dev].blksz;
-
-			if(bufsz!=blksz) {
-				free(buf);
-				bufsz=blksz;
-				if(!(buf=malloc(bufsz))) {
-					fprintf(stderr,
-"Memory allocation error, cannot continue\n");
-					goto abort;
-				}
-			}
+	gpt_type=dz->target_addr<=3?GPT_PRIMARY:GPT_BACKUP;
 
-			map=kdz->devs[dev].map;
+	if((data=kdz->kept[chunk]));
+	else if(test_kdzfile_fprec(kdz, chunk, &data)&&data);
+	else {
+		if(!(buf=malloc(dz->target_size))) {
+			fprintf(stderr, "Memory allocation error, cannot continue\n");
+			return NULL;
 		}
 
-		if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+		if(!unpackchunk_alloc(ctx, kdz, chunk)) goto abort;
+
+		if(unpackchunk(ctx, buf, dz->target_size)!=dz->target_size)
+			goto abort;
+
+		if(!unpackchunk_free(ctx, false)) goto abort;
+		data=buf;
+	}
+
+	/* negative offsets are relative to the end of the chunk, which is the
+	** end of the device for the backup GPT */
+	gpt_buf.bufsz=dz->target_size;
+	gpt_buf.buf=(char *)data;
+
+	if(!(ret=readgptb(gptbuffunc, &gpt_buf, blksz, gpt_type)))
+		fprintf(stderr, "Failed reading %s KDZ sd%c GPT\n",
+gpt_type==GPT_PRIMARY?"primary":"backup", 'a'+dz->device);
+
+abort:
+	free(buf);
+
+	return ret;
+}
+
+/* does the device area hash to the CRC32 and MD5 the fingerprint found
+** the chunk's data to have?  -1 on failure */
+static int test_kdzfile_fpmatch(const struct kdz_file *kdz,
+const struct kdz_fp_rec *rec, struct kdz_devbuf *db)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[rec->chunk].dz;
+	const uint32_t blksz=kdz->devs[rec->device].blksz;
+	const off64_t start=(off64_t)rec->target_addr*blksz;
+	const size_t piece=kdz_devread_piece(blksz);
+	uLong crc=crc32(0, Z_NULL, 0);
+	MD5_CTX md5;
+	char md5out[16];
+	uint32_t cur;
+
+	(*pMD5_Init)(&md5);
+
+	/* one pass for both, the reads cost more than the MD5 */
+	for(cur=0; cur<rec->target_size; cur+=piece) {
+		const size_t len=rec->target_size-cur<piece?
+rec->target_size-cur:piece;
+		const char *map;
+
+		if(!(map=kdz_devget(db, kdz, rec->device, start+cur, len)))
+			return -1;
+
+		crc=crc32(crc, (Bytef *)map, len);
+		(*pMD5_Update)(&md5, map, len);
+	}
+
+	(*pMD5_Final)((unsigned char *)md5out, &md5);
+
+	return crc==le32toh(dz->crc32)&&!memcmp(md5out, dz->md5, sizeof(md5out));
+}
+
+/* compare a chunk with the device, returns count of mismatched blocks (only
+** non-zero versus zero need be exact), or -1 on failure */
+typedef int64_t (*test_cmpfunc)(const struct kdz_file *kdz, unsigned chunk,
+struct unpackctx *ctx, void *opaque);
+
+/* scratch buffers for test_kdzfile_cmp() */
+struct test_buf {
+	char *buf;
+	uint32_t bufsz;
+	struct kdz_devbuf db;
+};
+
+/* the basic comparison, from fingerprint or by inflating */
+static int64_t test_kdzfile_cmp(const struct kdz_file *kdz, unsigned chunk,
+struct unpackctx *ctx, void *opaque)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	const off64_t start=(off64_t)dz->target_addr*blksz;
+	const size_t piece=kdz_devread_piece(blksz);
+	struct test_buf *const tbuf=opaque;
+	const struct kdz_fp_rec *rec;
+	const int mid=test_kdzfile_match(dz->slice_name);
+	bool mismatch=false;
+	uint32_t cur;
+
+	/* fingerprint available, zlib need not be involved */
+	if((rec=test_kdzfile_fprec(kdz, chunk, NULL))) {
+		const int res=test_kdzfile_fpmatch(kdz, rec, &tbuf->db);
+		return res<0?-1:!res;
+	}
+
+	/* inflated whole and kept, for the write which follows and for
+	** test_kdzfile_kdzgpt(); GPTs are small enough to always keep */
+	if(kdz->kept[chunk]||(mid>=0&&test_matches[mid].result>=4)||
+(kdz->keep&&kdz->keep&1<<kdz_slice_class(kdz, dz->slice_name))) {
+		char *const buf=kdz->kept[chunk]?kdz->kept[chunk]:
+kdz_inflate_chunk(kdz, chunk);
+
+		if(!buf) return -1;
+		kdz->kept[chunk]=buf;
+
+		for(cur=0; cur<dz->target_size&&!mismatch; cur+=piece) {
+			const uint32_t cmp=dz->target_size-cur<piece?
+dz->target_size-cur:piece;
+			const char *const map=kdz_devget(&tbuf->db, kdz,
+dz->device, start+cur, cmp);
+
+			if(!map) return -1;
+			if(memcmp(map, buf+cur, cmp)) mismatch=1;
+		}
+
+		return mismatch?1:0;
+	}
+
+	if(tbuf->bufsz<piece) {
+		free(tbuf->buf);
+		tbuf->bufsz=piece;
+		if(!(tbuf->buf=malloc(tbuf->bufsz))) {
+			tbuf->bufsz=0;
+			fprintf(stderr, "Memory allocation error, cannot continue\n");
+			return -1;
+		}
+	}
+
+	if(!unpackchunk_alloc(ctx, kdz, chunk)) return -1;
+
+	for(cur=0; cur<dz->target_size; cur+=tbuf->bufsz) {
+		uint32_t cmp=dz->target_size-cur;
+		if(cmp>tbuf->bufsz) cmp=tbuf->bufsz;
+
+		if(unpackchunk(ctx, tbuf->buf, cmp)<=0) return -1;
+
+		/* keep going to verify the CRC and MD5 */
+		if(!mismatch) {
+			const char *const map=kdz_devget(&tbuf->db, kdz,
+dz->device, start+cur, cmp);
+
+			if(!map) return -1;
+			if(memcmp(map, tbuf->buf, cmp)) mismatch=1;
+		}
+	}
+
+	if(!unpackchunk_free(ctx, false)) return -1;
+
+	return mismatch?1:0;
+}
+
+static int test_kdzfile_gpt_entry(int dev, int maxreturn,
+const struct gpt_entry *kdzentry, const struct gpt_entry *deventry);
+static int _test_kdzfile(const struct kdz_file *kdz, test_cmpfunc cmp,
+void *opaque, uint64_t *mismatched)
+{
+	int i;
+	int dev;
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	int maxreturn=3;
+
+	/* when counting mismatches, every slice needs examining */
+	for(i=1; i<=kdz->dz_file.chunk_count&&(maxreturn>0||mismatched); ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		enum gpt_type gpt_type;
+		const struct gpt_data *gptdev, *gptdev2;
+		struct gpt_data *gptkdz;
+		int64_t res;
+		int mid;
+		int ii;
+
+		if((mid=test_kdzfile_match(dz->slice_name))<0) continue;
+
+		/* going for a lower-quality match */
+		if(!(maxreturn&test_matches[mid].result)&&!mismatched) continue;
+
+		dev=dz->device;
+
+		if((res=cmp(kdz, i, ctx, opaque))<0) goto abort;
+
+		if(mismatched) *mismatched+=res;
+
+		/* exact match, nothing to worry about */
+		if(!res) continue;
+
+
+		/* nuke some maxreturn bits, unless special-case match */
+		if(test_matches[mid].result<4) {
+			maxreturn&=~test_matches[mid].result;
+			continue;
+		}
+
+		/* already failed, only here for the count */
+		if(maxreturn<=0) continue;
+
+/* special-case match for GPTs:
+** The type-UUIDs *must* match, but Id-UUIDs can differ.  For sda, the border
+** between OP and userdata normally differs due to varying amounts of LGE
+** bloatware.  A tool to remove OP exists, and LineageOS is likely to modify
+** system area.  For sdg, the types differ even for perfect match KDZ. */
+
+		gpt_type=dz->target_addr<=3?GPT_PRIMARY:GPT_BACKUP;
+
+		/* load the KDZ GPT */
+		if(!(gptkdz=test_kdzfile_kdzgpt(kdz, ctx, i))) goto abort;
+
+
+		/* load the corresponding device GPT */
+		if(!(gptdev=kdz_devgpt(kdz, dev, gpt_type))) {
+			fprintf(stderr, "Failed reading %s sd%c GPT\n",
+gpt_type==GPT_PRIMARY?"primary":"backup", 'a'+dev);
+			free(gptkdz);
+			goto abort;
+		}
+
+
+		/* just in case, compare the other device GPT... */
+		if(!(gptdev2=kdz_devgpt(kdz, dev, gpt_type==GPT_BACKUP?GPT_PRIMARY:GPT_BACKUP))) {
+			fprintf(stderr, "Failed reading %s sd%c GPT\n",
+gpt_type==GPT_BACKUP?"primary":"backup", 'a'+dev);
+			free(gptkdz);
+			goto abort;
+		}
+
+		if(!comparegpt(gptdev, gptdev2)) {
+			free(gptkdz);
+			goto abort;
+		}
+
+
+
+		/* check header fields, okay for the CRCs to differ */
+		if(memcmp(&gptdev->head, &gptkdz->head,
+(char *)&gptdev->head.headerCRC32-(char *)&gptdev->head.magic)||
+memcmp(&gptdev->head.reserved, &gptkdz->head.reserved,
+(char *)&gptdev->head.altLBA-(char *)&gptdev->head.reserved)||
+memcmp(&gptdev->head.dataStartLBA, &gptkdz->head.dataStartLBA,
+(char *)&gptdev->head.entryCRC32-(char *)&gptdev->head.dataStartLBA))
+			maxreturn=0; /* fail */
+		/* a device was encountered with the backup GPT's altLBA
+		** pointing at itself, rather than the primary GPT; this is
+		** apparently okay, but violates specifications... */
+		if(gptdev->head.altLBA!=gptkdz->head.altLBA&&
+gptkdz->head.altLBA!=1&&gptdev->head.altLBA!=gptkdz->head.myLBA)
+			maxreturn=0;
+
+
+		for(ii=0; ii<gptdev->head.entryCount-1&&maxreturn>0; ++ii)
+			maxreturn=test_kdzfile_gpt_entry(dev, maxreturn,
+gptkdz->entry+ii, gptdev->entry+ii);
+
+		free(gptkdz);
+	}
+
+	if(maxreturn>2) maxreturn=2;
+
+	return maxreturn;
+
+abort:
+	unpackchunk_free(ctx, true);
+
+	return -1;
+}
+
+int test_kdzfile(struct kdz_file *kdz)
+{
+	struct test_buf tbuf={NULL, 0, KDZ_DEVBUF_INIT};
+	int ret;
+
+	ret=_test_kdzfile(kdz, test_kdzfile_cmp, &tbuf, NULL);
+
+	if(tbuf.buf) free(tbuf.buf);
+	kdz_devbuf_free(&tbuf.db);
+
+	if(verbose>=1) kdz_devread_report();
+
+	return ret;
+}
+
+static int test_kdzfile_gpt_entry(int dev, int maxreturn,
+const struct gpt_entry *kdzentry, const struct gpt_entry *deventry)
+{
+	const char *const ignore[]={
+		"",
+		"OP",
+		"cache",
+		"cust",
+		"grow",
+		"grow2",
+		"grow3",
+		"grow4",
+		"grow5",
+		"grow6",
+		"grow7",
+		"system",
+		"userdata",
+	};
+	unsigned char lo=0, hi=sizeof(ignore)/sizeof(ignore[0]);
+	int res, mid;
+
+
+	while(mid=(hi+lo)/2, res=strcmp(kdzentry->name, ignore[mid])) {
+		if(res<0) hi=mid;
+		else if(res>0) lo=mid+1;
+		if(lo==hi) {
+			mid=-1; /* run all tests */
+			break;
+		}
+	}
+
+	/* ignore slices which are likely to be modified by LineageOS or LGE */
+	if(mid>=0) return maxreturn;
+
+	/* check name, flags, and type */
+	if(deventry->flags!=kdzentry->flags||
+uuid_compare(deventry->type, kdzentry->type)||
+strncmp(deventry->name, kdzentry->name, sizeof(deventry->name)))
+		return 0;
+
+	/* the Ids always differ on sdg */
+	if(maxreturn&2&&dev!=6&&
+uuid_compare(deventry->id, kdzentry->id)) maxreturn&=~2;
+
+	/* question is whether to try the above tests on non-empty entries? */
+
+	/* on-device border between OP and userdata differs */
+	if(deventry->startLBA!=kdzentry->startLBA||
+deventry->endLBA!=kdzentry->endLBA)
+		return 0;
+
+	return maxreturn;
+}
+
+
+static void free_kdzfp(struct kdz_fp *fp)
+{
+	uint32_t i;
+
+	if(!fp) return;
+
+	for(i=0; i<fp->count; ++i) if(fp->ent[i].gpt) free(fp->ent[i].gpt);
+
+	free(fp);
+}
+
+/* device area hashes shared by the candidates in rank_kdzfiles() */
+struct rank_area {
+	struct rank_area *next;
+	bool ufs;		/* sd? versus mmcblk? numbering */
+	uint32_t device;
+	uint32_t blksz;
+	uint32_t target_addr;
+	uint32_t target_size;
+	bool ready;
+	char md5[16];
+	uint32_t *crcs;		/* CRC32 of each block, NULL on failure */
+};
+
+struct rank_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct rank_area *areas;
+	struct kdz_rank *cand;
+	unsigned count, next;
+};
+
+/* retrieve the hashes of a device area, first caller does the reading */
+static const struct rank_area *rank_kdzfiles_area(struct rank_cache *cache,
+const struct kdz_file *kdz, unsigned chunk)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	const bool ufs=(kdz->dz_file.flag_ufs&256)==256;
+	const char *map;
+	struct rank_area *area;
+	MD5_CTX md5;
+	uint32_t i;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for(area=cache->areas; area; area=area->next)
+		if(area->ufs==ufs&&area->device==dz->device&&
+area->blksz==blksz&&area->target_addr==dz->target_addr&&
+area->target_size==dz->target_size) break;
+
+	if(area) {
+		while(!area->ready) pthread_cond_wait(&cache->ready, &cache->lock);
+		pthread_mutex_unlock(&cache->lock);
+		return area->crcs?area:NULL;
+	}
+
+	if(!(area=malloc(sizeof(*area)))) {
+		pthread_mutex_unlock(&cache->lock);
+		fprintf(stderr, "Memory allocation failure\n");
+		return NULL;
+	}
+
+	area->ufs=ufs;
+	area->device=dz->device;
+	area->blksz=blksz;
+	area->target_addr=dz->target_addr;
+	area->target_size=dz->target_size;
+	area->ready=false;
+	area->next=cache->areas;
+	cache->areas=area;
+
+	pthread_mutex_unlock(&cache->lock);
+
+
+	map=kdz->devs[dz->device].map+(off64_t)dz->target_addr*blksz;
+
+	if((area->crcs=malloc(sizeof(area->crcs[0])*(dz->target_size/blksz)))) {
+		(*pMD5_Init)(&md5);
+
+		for(i=0; i<dz->target_size/blksz; ++i) {
+			area->crcs[i]=crc32(crc32(0, Z_NULL, 0),
+(Bytef *)map+i*blksz, blksz);
+			(*pMD5_Update)(&md5, map+i*blksz, blksz);
+		}
+
+		(*pMD5_Final)((unsigned char *)area->md5, &md5);
+	} else fprintf(stderr, "Memory allocation failure\n");
+
+
+	pthread_mutex_lock(&cache->lock);
+	area->ready=true;
+	pthread_cond_broadcast(&cache->ready);
+	pthread_mutex_unlock(&cache->lock);
+
+	return area->crcs?area:NULL;
+}
+
+/* test_cmpfunc which counts each mismatched block */
+static int64_t rank_kdzfiles_cmp(const struct kdz_file *kdz, unsigned chunk,
+struct unpackctx *ctx, void *opaque)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	const struct rank_area *area;
+	int64_t ret=0;
+	char *buf;
+	uint32_t i;
+
+	if(!(area=rank_kdzfiles_area(opaque, kdz, chunk))) return -1;
+
+	/* the header MD5 vouches for the chunk's MD5 */
+	if(!memcmp(area->md5, dz->md5, sizeof(area->md5))) return 0;
+
+	/* differs, need to inflate to find out by how much */
+	if(!(buf=malloc(blksz))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return -1;
+	}
+
+	if(!unpackchunk_alloc(ctx, kdz, chunk)) goto abort;
+
+	for(i=0; i<dz->target_size/blksz; ++i) {
+		if(unpackchunk(ctx, buf, blksz)<=0) goto abort;
+
+		if(crc32(crc32(0, Z_NULL, 0), (Bytef *)buf, blksz)!=area->crcs[i])
+			++ret;
+	}
+
+	if(!unpackchunk_free(ctx, false)) goto abort;
+
+	free(buf);
+
+	/* the MD5s differed, so something did */
+	return ret?ret:1;
+
+abort:
+	free(buf);
+
+	return -1;
+}
+
+static void *rank_kdzfiles_thread(void *opaque)
+{
+	struct rank_cache *const cache=opaque;
+	struct kdz_rank *cand;
+
+	for(;;) {
+		pthread_mutex_lock(&cache->lock);
+		cand=cache->next<cache->count?cache->cand+cache->next++:NULL;
+		pthread_mutex_unlock(&cache->lock);
+
+		if(!cand) break;
+
+		cand->mismatched=0;
+		cand->result=_test_kdzfile(cand->kdz, rank_kdzfiles_cmp, cache,
+&cand->mismatched);
+
+		if(verbose>=2) fprintf(stderr, "Tested \"%s\": %d, %llu blocks\n",
+cand->name, cand->result, (unsigned long long)cand->mismatched);
+	}
+
+	return NULL;
+}
+
+static int rank_kdzfiles_order(const void *_a, const void *_b)
+{
+	const struct kdz_rank *const a=_a, *const b=_b;
+
+	if(a->result!=b->result) return b->result-a->result;
+
+	return a->mismatched<b->mismatched?-1:a->mismatched>b->mismatched;
+}
+
+bool rank_kdzfiles(struct kdz_rank *cand, unsigned count)
+{
+	struct rank_cache cache;
+	pthread_t *threads;
+	unsigned nthreads, i;
+	long ncpu;
+
+	if(!count) return true;
+
+	if((ncpu=sysconf(_SC_NPROCESSORS_ONLN))<1) ncpu=1;
+	/* the caller's thread is one of the workers */
+	nthreads=(count<ncpu?count:ncpu)-1;
+
+	if(!(threads=malloc(sizeof(threads[0])*(nthreads+1)))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return false;
+	}
+
+	pthread_mutex_init(&cache.lock, NULL);
+	pthread_cond_init(&cache.ready, NULL);
+	cache.areas=NULL;
+	cache.cand=cand;
+	cache.count=count;
+	cache.next=0;
+
+	for(i=0; i<nthreads; ++i)
+		if(pthread_create(threads+i, NULL, rank_kdzfiles_thread, &cache))
+			break;
+
+	/* also covers pthread_create() failure */
+	rank_kdzfiles_thread(&cache);
+
+	while(i>0) pthread_join(threads[--i], NULL);
+
+	free(threads);
+
+	while(cache.areas) {
+		struct rank_area *const area=cache.areas;
+		cache.areas=area->next;
+		if(area->crcs) free(area->crcs);
+		free(area);
+	}
+
+	pthread_cond_destroy(&cache.ready);
+	pthread_mutex_destroy(&cache.lock);
+
+	qsort(cand, count, sizeof(cand[0]), rank_kdzfiles_order);
+
+	return true;
+}
+
+
+/* GPT chunks are stored as inflated, so test_kdzfile_kdzgpt() can parse
+** them as from the KDZ */
+bool write_kdzfp(const struct kdz_file *kdz, const char *filename)
+{
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	struct kdz_fp_head head;
+	char *gpt=NULL;
+	char *buf=NULL;
+	uint32_t bufsz=0;
+	uint32_t count=0;
+	int fd;
+	int i;
+
+	if((fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, 0644))<0) {
+		fprintf(stderr, "Failed to create \"%s\": %s\n", filename,
+strerror(errno));
+		return false;
+	}
+
+	/* header is written last, once the record count is known */
+	if(lseek(fd, sizeof(head), SEEK_SET)!=sizeof(head)) goto abort_io;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		const uint32_t blksz=kdz->devs[dz->device].blksz;
+		struct kdz_fp_rec rec;
+		uint32_t cur;
+		int mid;
+
+		if((mid=test_kdzfile_match(dz->slice_name))<0) continue;
+
+		if(bufsz<blksz*5) {
+			free(buf);
+			bufsz=blksz*5;
+			if(!(buf=malloc(bufsz))) {
+				fprintf(stderr,
+"Memory allocation error, cannot continue\n");
+				goto abort;
+			}
+		}
+
+		rec.chunk=htole32(i);
+		rec.device=htole32(dz->device);
+		rec.target_addr=htole32(dz->target_addr);
+		rec.target_size=htole32(dz->target_size);
+		rec.gpt_len=0;
+
+		/* only a verified KDZ is worth fingerprinting; GPTs are kept
+		** whole, the rest only need checking */
+		if(test_matches[mid].result>=4) {
+			if(!(gpt=kdz_inflate_chunk(kdz, i))) goto abort;
+			rec.gpt_len=htole32(dz->target_size);
+		} else {
+			if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+
+			for(cur=0; cur<dz->target_size; cur+=bufsz) {
+				uint32_t len=dz->target_size-cur;
+				if(len>bufsz) len=bufsz;
+
+				if(unpackchunk(ctx, buf, len)<=0) goto abort;
+			}
+
+			if(!unpackchunk_free(ctx, false)) goto abort;
+		}
+
+		if(write(fd, &rec, sizeof(rec))!=sizeof(rec)) goto abort_io;
+
+		if(gpt) {
+			if(write(fd, gpt, le32toh(rec.gpt_len))!=le32toh(rec.gpt_len))
+				goto abort_io;
+			free(gpt);
+			gpt=NULL;
+		}
+
+		++count;
+	}
+
+	memcpy(head.magic, kdz_fp_magic, KDZ_FP_MAGIC_LEN);
+	head.version=htole32(2);
+	head.count=htole32(count);
+	memcpy(head.md5, kdz->dz_file.md5, sizeof(head.md5));
+
+	if(pwrite(fd, &head, sizeof(head), 0)!=sizeof(head)) goto abort_io;
+
+	if(close(fd)) {
+		fd=-1;
+		goto abort_io;
+	}
+
+	free(buf);
+
+	if(verbose>=1) fprintf(stderr, "Fingerprinted %u chunks into \"%s\"\n",
+count, filename);
+
+	return true;
+
+abort_io:
+	fprintf(stderr, "Failed while writing \"%s\": %s\n", filename,
+strerror(errno));
+abort:
+	unpackchunk_free(ctx, true);
+
+	if(fd>=0) close(fd);
+	unlink(filename);
+
+	if(gpt) free(gpt);
+	if(buf) free(buf);
+
+	return false;
+}
+
+
+bool load_kdzfp(struct kdz_file *kdz, const char *filename)
+{
+	struct kdz_fp_head head;
+	struct kdz_fp *fp=NULL;
+	MD5_CTX md5;
+	char md5out[16];
+	uint32_t count, i;
+	uint32_t last=0;
+	int fd;
+
+	if((fd=open(filename, O_RDONLY|O_LARGEFILE))<0) {
+		if(errno!=ENOENT||verbose>=2) fprintf(stderr,
+"Unable to open fingerprint \"%s\": %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	if(read(fd, &head, sizeof(head))!=sizeof(head)||
+memcmp(head.magic, kdz_fp_magic, KDZ_FP_MAGIC_LEN)||le32toh(head.version)!=2) {
+		fprintf(stderr, "\"%s\" is not a usable fingerprint\n", filename);
+		goto abort;
+	}
+
+	if(memcmp(head.md5, kdz->dz_file.md5, sizeof(head.md5))) {
+		fprintf(stderr, "Fingerprint \"%s\" is for a different KDZ file\n",
+filename);
+		goto abort;
+	}
+
+	if((count=le32toh(head.count))>kdz->dz_file.chunk_count) goto bad;
+
+	if(!(fp=malloc(sizeof(*fp)+sizeof(fp->ent[0])*count))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		goto abort;
+	}
+
+	fp->count=0;
+
+	for(i=0; i<count; ++i) {
+		struct kdz_fp_rec *const rec=&fp->ent[i].rec;
+		const struct dz_chunk *dz;
+
+		fp->ent[i].gpt=NULL;
+
+		if(read(fd, rec, sizeof(*rec))!=sizeof(*rec)) goto bad;
+
+		rec->chunk=le32toh(rec->chunk);
+		rec->device=le32toh(rec->device);
+		rec->target_addr=le32toh(rec->target_addr);
+		rec->target_size=le32toh(rec->target_size);
+		rec->gpt_len=le32toh(rec->gpt_len);
+
+		if(rec->chunk<=last||rec->chunk>kdz->dz_file.chunk_count) goto bad;
+		last=rec->chunk;
+
+		/* the header MD5 matched, but be paranoid about the records */
+		dz=&kdz->chunks[rec->chunk].dz;
+		if(rec->device!=dz->device||rec->target_addr!=dz->target_addr||
+rec->target_size!=dz->target_size) goto bad;
+
+		if((off64_t)rec->target_addr*kdz->devs[rec->device].blksz+
+rec->target_size>kdz->devs[rec->device].len) goto bad;
+
+		++fp->count;
+
+		if(!rec->gpt_len) continue;
+
+		if(rec->gpt_len!=dz->target_size||
+!(fp->ent[i].gpt=malloc(rec->gpt_len))) goto bad;
+
+		if(read(fd, fp->ent[i].gpt, rec->gpt_len)!=rec->gpt_len) goto bad;
+
+		/* it stands in for the chunk, so has to be the chunk */
+		(*pMD5_Init)(&md5);
+		(*pMD5_Update)(&md5, fp->ent[i].gpt, rec->gpt_len);
+		(*pMD5_Final)((unsigned char *)md5out, &md5);
+		if(memcmp(md5out, dz->md5, sizeof(md5out))) goto bad;
+	}
+
+	close(fd);
+
+	free_kdzfp(kdz->fp);
+	kdz->fp=fp;
+
+	if(verbose>=1) fprintf(stderr, "Using fingerprint \"%s\" (%u chunks)\n",
+filename, count);
+
+	return true;
+
+bad:
+	fprintf(stderr, "Fingerprint \"%s\" is corrupt, ignoring\n", filename);
+abort:
+	free_kdzfp(fp);
+
+	close(fd);
+
+	return false;
+}
+
+
+int report_kdzfile(struct kdz_file *kdz)
+{
+	int i;
+	int dev=-1;
+	off64_t blksz;
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	struct kdz_devbuf db=KDZ_DEVBUF_INIT;
+	struct kdz_ring *ring;
+	char *buf=NULL;
+	uint32_t bufsz=0;
+	uint32_t cur;
+	uint32_t mismatch;
+
+	if(verbose>=11) fprintf(stderr, "DEBUG: starting report code\n");
+
+	ring=kdz_ring_chunks(kdz, NULL, 1, kdz->dz_file.chunk_count, NULL,
+false);
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const char *fmt;
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+
+		if(dz->device!=dev) {
+			dev=dz->device;
+
+			blksz=kdz->devs[dev].blksz;
+
+			if(bufsz!=kdz_devread_piece(blksz)) {
+				free(buf);
+				bufsz=kdz_devread_piece(blksz);
+				if(!(buf=malloc(bufsz))) {
+					fprintf(stderr,
+"Memory allocation error, cannot continue\n");
+					goto abort;
+				}
+			}
+		}
+
+		if(!(ring?unpackchunk_alloc_ring(ctx, kdz, i, ring):
+unpackchunk_alloc(ctx, kdz, i))) goto abort;
 
 		mismatch=0;
 
 
 
-		if(dz->target_size%blksz) {
-			fprintf(stderr, "Block, not a multiple of block size!\n");
+		if(dz->target_size%blksz) {
+			fprintf(stderr, "Block, not a multiple of block size!\n");
+		}
+
+		cur=0;
+
+		while(cur<dz->target_size) {
+			const uint32_t len=dz->target_size-cur<bufsz?
+dz->target_size-cur:bufsz;
+			const char *map;
+			uint32_t j;
+
+			if(unpackchunk(ctx, buf, len)!=len)
+				goto abort_block;
+
+			if(!(map=kdz_devget(&db, kdz, dev,
+dz->target_addr*blksz+cur, len))) goto abort;
+
+			for(j=0; j<len; j+=blksz)
+				if(memcmp(map+j, buf+j, len-j<blksz?len-j:blksz))
+					++mismatch;
+
+			cur+=len;
+		}
+
+		if(!unpackchunk_free(ctx, false))
+			++mismatch; /* not exactly, but sort of */
+
+		if(mismatch)
+			fmt="Chunk %1$d(%2$s): %7$d of %3$ld blocks mismatched (%4$lu-%5$lu,trim=%6$lu)\n";
+		else
+			fmt="Chunk %d(%s): all %ld blocks matched (%lu-%lu,trim=%lu)\n";
+		printf(fmt, i, dz->slice_name, dz->target_size/blksz,
+dz->target_addr, dz->target_addr+dz->trim_count, dz->trim_count, mismatch);
+
+	abort_block:
+		unpackchunk_free(ctx, true);
+	}
+
+	free(buf);
+	kdz_devbuf_free(&db);
+	kdz_ring_close(ring);
+
+	if(verbose>=1) kdz_devread_report();
+
+	return 0;
+
+abort:
+	if(buf) free(buf);
+	kdz_devbuf_free(&db);
+
+	unpackchunk_free(ctx, true);
+	kdz_ring_close(ring);
+
+	return 128;
+}
+
+
+
+bool fix_gpts(const struct kdz_file *kdz, const bool simulate)
+{
+	int i, j;
+	int dev=-1;
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	size_t bufsz=4096;
+	char *buf=NULL;
+	struct gpt_data *gptkdz=NULL;
+	int fd;
+	unsigned long long opsz;
+	bool ret=true;
+
+	if(!(buf=malloc(bufsz))) return false;
+
+	if(access("/dev/block/bootdevice/by-name/cust", F_OK)<0) {
+		fprintf(stderr,
+"Cannot access /dev/block/bootdevice/by-name, assuming OP size of 0.\n");
+		opsz=0;
+	} else {
+		if(mkdir("/cust", 0777)<0) {
+			struct stat buf;
+			if(errno!=EEXIST) {
+				fprintf(stderr,
+"Failed to create /cust mount point: %s\n", strerror(errno));
+				goto abort;
+			}
+			if(stat("/cust", &buf)<0||!S_ISDIR(buf.st_mode)) {
+				fprintf(stderr,
+"Failed when creating /cust mount point, unable to continue\n");
+				goto abort;
+			}
+			/* this could mean we were run recently... */
+			umount("/cust");
+		}
+
+		if(mount("/dev/block/bootdevice/by-name/cust", "/cust",
+"ext4", MS_RDONLY, "discard")) {
+			fprintf(stderr,
+"Failed OP resize data retrieval: %s\n", strerror(errno));
+			goto abort;
+		}
+
+		if((fd=open("/cust/official_op_resize.cfg",
+O_RDONLY|MS_NOATIME))<0) {
+			fprintf(stderr,
+"Unable to open official_op_resize.cfg: %s\n", strerror(errno));
+			umount("/cust");
+			goto abort;
+		}
+
+		if(read(fd, buf, bufsz)<0) {
+			fprintf(stderr,
+"Failed during read of official_op_resize.cfg: %s\n", strerror(errno));
+			opsz=0;
+		} else {
+			buf[bufsz-1]='\0';
+
+			i=strchr(buf, '=')-buf+1;
+
+			opsz=strtoull(buf+i, NULL, 0);
+		}
+
+		if(verbose>=1) fprintf(stderr,
+"official_op_resize.cfg makes /OP %llu bytes\n", opsz);
+
+		close(fd);
+		umount("/cust");
+	}
+
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		uint32_t blksz;
+		struct gpt_buf gpt_buf;
+		char *kept;
+
+		if(strcmp(dz->slice_name, "PrimaryGPT")) continue;
+
+		if((dev=open_device(kdz, dz->device, O_RDWR))<0) goto abort;
+
+		blksz=kdz->devs[dz->device].blksz;
+
+
+		/* test_kdzfile() normally inflated it already */
+		if((kept=kdz_kept_take(kdz, i))) {
+			free(buf);
+			buf=kept;
+			bufsz=dz->target_size;
+		} else {
+			if(dz->target_size>bufsz) {
+				free(buf);
+				bufsz=dz->target_size;
+				if(!(buf=malloc(bufsz))) {
+					fprintf(stderr, "Memory allocation failure.\n");
+					goto abort;
+				}
+			}
+
+			if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+
+			if(unpackchunk(ctx, buf, dz->target_size)!=dz->target_size)
+				goto abort;
+
+			if(!unpackchunk_free(ctx, false)) goto abort;
+		}
+
+		gpt_buf.bufsz=dz->target_size;
+		gpt_buf.buf=buf;
+		if(!(gptkdz=readgptb(gptbuffunc, &gpt_buf, blksz, GPT_PRIMARY))) {
+			fprintf(stderr,
+"Failed to load GPT from primary image in KDZ, aborting.\n");
+			goto abort;
+		}
+
+
+		for(j=0; j<gptkdz->head.entryCount; ++j) {
+			int64_t delta;
+			uint32_t start, end;
+			struct gpt_entry *const kdzentr=gptkdz->entry+j;
+
+			if(!strcmp("persistent", kdzentr->name)) {
+				const struct gpt_data *const gptdev=kdz_devgpt(kdz,
+dz->device, GPT_ANY);
+
+				if(gptdev&&!uuid_is_null(gptdev->entry[j].id))
+					uuid_copy(kdzentr->id, gptdev->entry[j].id);
+
+				else {
+					int urandom;
+					urandom=open("/dev/urandom", O_RDONLY);
+
+					/* I'm guessing this is appropriate */
+					/* if this fails, well can't do much */
+					if(urandom>=0) {
+						read(urandom, &kdzentr->id, sizeof(kdzentr->id));
+						close(urandom);
+					}
+				}
+			}
+
+			if(strcmp("OP", kdzentr->name)) continue;
+
+			/* convert to block count */
+			delta=opsz/blksz;
+
+			/* oddly OP in KDZ files is non-zero size */
+			delta-=(kdzentr->endLBA-kdzentr->startLBA+1);
+
+			start=end=j;
+			if(!strcmp("userdata", gptkdz->entry[j-1].name)) {
+				if(verbose>=7) fprintf(stderr,
+"DEBUG: userdata before OP, userdata end=%lu, OP begin=%lu\n",
+gptkdz->entry[j-1].endLBA, kdzentr->startLBA);
+				if(gptkdz->entry[j-1].endLBA+1!=kdzentr->startLBA) continue;
+				--end;
+				delta=-delta;
+			} else if(!strcmp("userdata", gptkdz->entry[j+1].name)) {
+				if(verbose>=7) fprintf(stderr,
+"DEBUG: OP before userdata, userdata begin=%lu, OP end=%lu\n",
+gptkdz->entry[j+1].startLBA, kdzentr->endLBA);
+				if(gptkdz->entry[j+1].startLBA!=kdzentr->endLBA+1) continue;
+				++start;
+			} else continue;
+			if(verbose>=4) fprintf(stderr,
+"DEBUG: OP: start idx %u end idx %u, delta=%+ld\n", start, end, delta);
+			gptkdz->entry[start].startLBA+=delta;
+			gptkdz->entry[end].endLBA+=delta;
+			if(verbose>=4) fprintf(stderr,
+"DEBUG: OP: new start %lu, new end %lu\n", gptkdz->entry[start].startLBA,
+gptkdz->entry[end].endLBA);
+
+			/* Yes, they ARE this perverse; adjust userdata first */
+			if(opsz<=0)
+				memset(kdzentr, 0, sizeof(struct gpt_entry));
+		}
+
+		if(!simulate) {
+			/* whatever happens, the parsed GPTs are stale */
+			kdz_devgpt_forget(kdz, dz->device);
+
+			if(!writegpt(dev, gptkdz)) {
+				fprintf(stderr, "\bGPT write operation failed!\n");
+				goto abort;
+			}
+
+			/* the GPT code ignores the first block */
+			if(memcmp(buf, kdz->devs[dz->device].map, 512)&&
+(!kdz_pwrite(dev, buf, 512, 0)||sync_range(dev, 0, 512,
+SYNC_FILE_RANGE_ALL)<0)) {
+				fprintf(stderr, "\bMBR write operation failed: %s\n",
+strerror(errno));
+				goto abort;
+			}
+		} else close(dev);
+
+		free(gptkdz);
+		gptkdz=NULL;
+
+		if(!simulate) {
+			/* failure indicates kernel may be using old table */
+#ifndef DEBUG
+			if(ioctl(dev, BLKRRPART, NULL)) {
+				if(verbose>=7) fprintf(stderr,
+"ioctl(BLKRRPART) failed, kernel still uses old GPT\n");
+				ret=false;
+			}
+#endif
+		}
+	}
+
+	return ret;
+
+abort:
+	if(buf) free(buf);
+
+	if(gptkdz) free(gptkdz);
+
+	if(dev>=0) close(dev);
+
+	unpackchunk_free(ctx, true);
+
+	return false;
+}
+
+
+/* compilers turn operations on these into NEON/SSE instructions */
+typedef uint64_t kdz_vec __attribute__((vector_size(16), aligned(1), may_alias));
+
+/* do two blocks differ?  sz must be a multiple of 128 */
+static inline bool kdz_blkdiff(const void *a, const void *b, size_t sz)
+{
+	const kdz_vec *va=a, *vb=b;
+	size_t i;
+
+	for(i=0; i<sz/sizeof(kdz_vec); i+=8) {
+		const kdz_vec acc=(va[i]^vb[i])|(va[i+1]^vb[i+1])|
+(va[i+2]^vb[i+2])|(va[i+3]^vb[i+3])|(va[i+4]^vb[i+4])|(va[i+5]^vb[i+5])|
+(va[i+6]^vb[i+6])|(va[i+7]^vb[i+7]);
+
+		if(acc[0]|acc[1]) return true;
+	}
+
+	return false;
+}
+
+static bool kdz_blkdiff512(const void *a, const void *b, size_t sz)
+{
+	return kdz_blkdiff(a, b, 512);
+}
+
+static bool kdz_blkdiff4096(const void *a, const void *b, size_t sz)
+{
+	return kdz_blkdiff(a, b, 4096);
+}
+
+static bool kdz_blkdiffany(const void *a, const void *b, size_t sz)
+{
+	return memcmp(a, b, sz);
+}
+
+typedef bool (*kdz_blkdifffunc)(const void *a, const void *b, size_t sz);
+
+static kdz_blkdifffunc kdz_blkdiffsel(uint32_t blksz)
+{
+	if(blksz==512) return kdz_blkdiff512;
+	if(blksz==4096) return kdz_blkdiff4096;
+	return kdz_blkdiffany;
+}
+
+/* find the first block at or after *off where a and b differ, returns the
+** length of the run of differing blocks found there (0 if none) */
+static size_t kdz_dirtyrun(kdz_blkdifffunc diff, const char *a, const char *b,
+size_t *off, size_t len, uint32_t blksz)
+{
+	size_t pos=*off;
+
+	while(pos<len&&!diff(a+pos, b+pos, blksz)) pos+=blksz;
+	*off=pos;
+
+	while(pos<len&&diff(a+pos, b+pos, blksz)) pos+=blksz;
+
+	return pos-*off;
+}
+
+/* differing blocks in [lo, hi) */
+static size_t kdz_dirtycount(kdz_blkdifffunc diff, const char *a,
+const char *b, size_t lo, size_t hi, uint32_t blksz)
+{
+	size_t cnt=0;
+
+	for(; lo<hi; lo+=blksz) if(diff(a+lo, b+lo, blksz)) ++cnt;
+
+	return cnt;
+}
+
+/* Widen the run [*start, *end) to the boundaries of the unit sized units
+** (aligned relative to base) at either end, when at least 1/amp of the
+** unit differs anyway; a partially written unit costs the device a
+** read-modify-write of the whole thing.  Never reaches below floor. */
+static void kdz_widen(kdz_blkdifffunc diff, const char *a, const char *b,
+size_t len, uint32_t blksz, uint64_t base, size_t unit, unsigned amp,
+size_t floor, size_t *start, size_t *end)
+{
+	uint64_t ulo, uhi;
+	size_t lo, hi;
+
+	/* the unit holding the first block */
+	ulo=(base+*start)/unit*unit;
+	lo=ulo>base+floor?ulo-base:floor;
+	hi=ulo+unit-base<len?ulo+unit-base:len;
+	if(lo<*start&&kdz_dirtycount(diff, a, b, lo, hi, blksz)*blksz*amp>=
+hi-lo) *start=lo;
+
+	/* the unit holding the last block */
+	uhi=(base+*end+unit-1)/unit*unit;
+	hi=uhi-base<len?uhi-base:len;
+	lo=uhi-unit>base+*start?uhi-unit-base:*start;
+	if(hi>*end&&kdz_dirtycount(diff, a, b, lo, hi, blksz)*blksz*amp>=
+hi-lo) *end=hi;
+}
+
+/* largest unit worth widening to */
+#define KDZ_UNIT_MAX (1<<20)
+
+/* the device's write unit from its queue limits, 0 if no larger than blksz */
+static size_t kdz_queue_unit(const struct kdz_file *kdz, int dev,
+uint32_t blksz)
+{
+	static const char *const limit[]={
+		"optimal_io_size",
+		"minimum_io_size",
+		"discard_granularity",
+	};
+	const bool ufs=(kdz->dz_file.flag_ufs&256)==256;
+	size_t unit=0;
+	unsigned i;
+
+	if(kdz_write_unit) return kdz_write_unit>blksz&&!(kdz_write_unit%blksz)?
+kdz_write_unit:0;
+
+	/* image files have no queue limits */
+	if(kdz_devices) return 0;
+
+	for(i=0; i<sizeof(limit)/sizeof(limit[0]); ++i) {
+		unsigned long long val;
+		char name[64];
+		FILE *f;
+
+		snprintf(name, sizeof(name), "/sys/block/%s%c/queue/%s",
+ufs?"sd":"mmcblk", (ufs?'a':'0')+dev, limit[i]);
+
+		if(!(f=fopen(name, "r"))) continue;
+		if(fscanf(f, "%llu", &val)==1&&val>unit&&val<=KDZ_UNIT_MAX&&
+!(val%blksz)) unit=val;
+		fclose(f);
+	}
+
+	return unit>blksz?unit:0;
+}
+
+/* is the block all zeros? */
+static bool kdz_blkzero(const char *p, size_t sz)
+{
+	const kdz_vec *const v=(const kdz_vec *)p;
+	size_t i;
+
+	if(sz%128) {
+		for(i=0; i<sz; ++i) if(p[i]) return false;
+		return true;
+	}
+
+	for(i=0; i<sz/sizeof(kdz_vec); i+=8) {
+		const kdz_vec acc=v[i]|v[i+1]|v[i+2]|v[i+3]|v[i+4]|v[i+5]|v[i+6]|
+v[i+7];
+
+		if(acc[0]|acc[1]) return false;
+	}
+
+	return true;
+}
+
+/* zero runs shorter than this are simply written */
+#define KDZ_ZERO_MIN (64<<10)
+
+/* length of the segment at off, up to len: either a run of at least
+** KDZ_ZERO_MIN zeros (*zero set), or data up to the next such run */
+static size_t kdz_zeroseg(const char *buf, size_t off, size_t len,
+uint32_t blksz, bool *zero)
+{
+	const size_t min=KDZ_ZERO_MIN>blksz?KDZ_ZERO_MIN:blksz;
+	size_t pos, streak=off;
+
+	for(pos=off; pos<len; pos+=blksz) {
+		if(!kdz_blkzero(buf+pos, blksz)) {
+			/* a long enough run is a segment of its own */
+			if(pos-streak>=min) break;
+			streak=pos+blksz;
+			continue;
+		}
+
+		if(streak>off&&pos+blksz-streak>=min) {
+			*zero=false;
+			return streak-off;
+		}
+	}
+
+	*zero=pos-streak>=min;
+	return *zero?pos-off:len-off;
+}
+
+/* pwrite64() all of it; false with errno set on failure */
+static bool kdz_pwrite(int fd, const char *buf, size_t len, off64_t off)
+{
+	while(len) {
+		const ssize_t cnt=pwrite64(fd, buf, len, off);
+
+		if(cnt<0) {
+			if(errno==EINTR) continue;
+			return false;
+		}
+
+		/* nothing written, at the end of the device */
+		if(!cnt) {
+			errno=ENOSPC;
+			return false;
+		}
+
+		buf+=cnt;
+		len-=cnt;
+		off+=cnt;
+	}
+
+	return true;
+}
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+
+/* how write_kdzfile() gets zeros onto the device */
+enum kdz_zero {
+	KDZ_ZERO_WRITE,		/* same as any other data */
+	KDZ_ZERO_OUT,		/* BLKZEROOUT */
+	KDZ_ZERO_DISCARD,	/* BLKDISCARD, discarded blocks read as zeros */
+	KDZ_ZERO_PUNCH,		/* image file, punch a hole */
+};
+
+static enum kdz_zero kdz_zerosel(int fd, bool simulate)
+{
+	unsigned int zeroes=0;
+	struct stat st;
+
+	if(fstat(fd, &st)>=0&&S_ISREG(st.st_mode)) {
+		if(verbose>=2) fprintf(stderr,
+"Writing an image file, punching holes for zero runs\n");
+		return KDZ_ZERO_PUNCH;
+	}
+
+	if(!simulate&&ioctl(fd, BLKDISCARDZEROES, &zeroes)>=0&&zeroes) {
+		if(verbose>=2) fprintf(stderr,
+"Discarded blocks read as zeros, discarding zero runs\n");
+		return KDZ_ZERO_DISCARD;
+	}
+
+	return KDZ_ZERO_OUT;
+}
+
+/* zero len bytes at off as kdz_zerosel() chose */
+static bool kdz_zeroout(int fd, enum kdz_zero zero, uint64_t off,
+uint64_t len)
+{
+	uint64_t range[2]={off, len};
+
+	if(zero==KDZ_ZERO_PUNCH) return fallocate(fd,
+FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len)>=0;
+
+	return ioctl(fd, zero==KDZ_ZERO_DISCARD?BLKDISCARD:BLKZEROOUT, range)>=0;
+}
+
+/* discard synchronously, image files get a hole punched */
+static bool kdz_discard(int fd, uint64_t off, uint64_t len)
+{
+	uint64_t range[2]={off, len};
+
+	if(ioctl(fd, BLKDISCARD, range)>=0) return true;
+	if(errno!=ENOTTY) return false;
+
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off,
+len)>=0;
+}
+
+/* O_DIRECT request size if the device doesn't suggest one */
+#define KDZ_DIRECT_IOSZ (1<<20)
+
+/* switch fd to O_DIRECT, if the device can take blksz aligned requests */
+static bool kdz_setdirect(int fd, uint32_t blksz, size_t *iosz)
+{
+	int lbs=0;
+	unsigned int opt=0;
+	int flags;
+
+	if(ioctl(fd, BLKSSZGET, &lbs)<0||lbs<=0||blksz%lbs) {
+		if(verbose>=0) fprintf(stderr,
+"Device can't take %u byte aligned writes, not using O_DIRECT\n", blksz);
+		return false;
+	}
+
+	if(ioctl(fd, BLKIOOPT, &opt)<0||!opt||opt%blksz) opt=KDZ_DIRECT_IOSZ;
+	*iosz=opt;
+
+	if((flags=fcntl(fd, F_GETFL))<0||fcntl(fd, F_SETFL, flags|O_DIRECT)<0) {
+		if(verbose>=0) fprintf(stderr,
+"Failed to enable O_DIRECT: %s\n", strerror(errno));
+		return false;
+	}
+
+	if(verbose>=2) fprintf(stderr, "Writing with O_DIRECT, %zu byte requests\n",
+*iosz);
+
+	return true;
+}
+
+/* write in iosz pieces, dropping O_DIRECT if the kernel refuses it */
+static bool kdz_pwrite_direct(int fd, bool *direct, const char *buf,
+size_t len, off64_t off, size_t iosz)
+{
+	while(len) {
+		const size_t n=len>iosz?iosz:len;
+
+		if(!kdz_pwrite(fd, buf, n, off)) {
+			if(errno!=EINVAL||!*direct) return false;
+
+			if(verbose>=0) fprintf(stderr,
+"O_DIRECT write refused, continuing buffered\n");
+			if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)&~O_DIRECT)<0)
+				return false;
+			*direct=false;
+			continue;
+		}
+
+		buf+=n;
+		len-=n;
+		off+=n;
+	}
+
+	return true;
+}
+
+/* the undo log must reach the disk before what it protects does */
+static int kdz_fsync(int fd)
+{
+	if(kdz_undo&&!undo_sync(kdz_undo)) {
+		errno=EIO;
+		return -1;
+	}
+
+	return fsync(fd);
+}
+
+/* writeback pacing, starts writeback on each window as it fills and waits
+** on the oldest once kdz_dirty_max bytes are in flight */
+struct kdz_pace {
+	int fd;
+	uint64_t window;	/* dirty bytes per window */
+	uint64_t dirty;		/* dirty bytes in the window being filled */
+	off64_t lo, hi;		/* extent of the window being filled */
+	unsigned slots;		/* windows allowed in flight */
+	unsigned count, next;	/* windows in flight, oldest */
+	int error;		/* first failure, as an errno value */
+	struct {
+		off64_t lo, hi;
+	} *ring;
+};
+
+static bool kdz_pace_init(struct kdz_pace *p, int fd)
+{
+	memset(p, 0, sizeof(*p));
+	p->fd=fd;
+
+	if(!kdz_dirty_max) return true;
+
+	/* four windows, unless they'd be tiny */
+	p->slots=4;
+	if((p->window=kdz_dirty_max/p->slots)<(1<<20)) {
+		p->window=1<<20;
+		p->slots=kdz_dirty_max>p->window?kdz_dirty_max/p->window:1;
+	}
+
+	if(!(p->ring=malloc(sizeof(p->ring[0])*p->slots))) return false;
+
+	return true;
+}
+
+static void kdz_pace_wait(struct kdz_pace *p)
+{
+	const unsigned i=p->next;
+
+	if(sync_range(p->fd, p->ring[i].lo, p->ring[i].hi-p->ring[i].lo,
+SYNC_FILE_RANGE_ALL)<0&&!p->error) p->error=errno;
+
+	p->next=(p->next+1)%p->slots;
+	--p->count;
+}
+
+/* close the window being filled, starting its writeback */
+static void kdz_pace_flush(struct kdz_pace *p)
+{
+	unsigned i;
+
+	if(!p->dirty) return;
+
+	if(p->count==p->slots) kdz_pace_wait(p);
+
+	/* failures mark the log, so the next undo_add() stops the write */
+	if(kdz_undo) undo_sync(kdz_undo);
+
+	if(sync_range(p->fd, p->lo, p->hi-p->lo, SYNC_FILE_RANGE_WRITE)<0&&
+!p->error) p->error=errno;
+
+	i=(p->next+p->count++)%p->slots;
+	p->ring[i].lo=p->lo;
+	p->ring[i].hi=p->hi;
+	p->dirty=0;
+}
+
+/* false once writeback of anything written has failed, errno is set */
+static bool kdz_pace_wrote(struct kdz_pace *p, off64_t off, size_t len)
+{
+	if(!p->ring) return true;
+
+	if(!p->dirty||off<p->lo) p->lo=off;
+	if(!p->dirty||off+(off64_t)len>p->hi) p->hi=off+len;
+	p->dirty+=len;
+
+	if(p->dirty>=p->window) kdz_pace_flush(p);
+
+	errno=p->error;
+	return !p->error;
+}
+
+/* wait for everything written so far, 0 or the first failure's errno */
+static int kdz_pace_finish(struct kdz_pace *p)
+{
+	if(!p->ring) return p->error;
+
+	kdz_pace_flush(p);
+	while(p->count) kdz_pace_wait(p);
+
+	free(p->ring);
+	p->ring=NULL;
+
+	return p->error;
+}
+
+
+/* one character for every 512 blocks */
+static void write_kdzfile_progress(unsigned *cnt, size_t blocks, char c)
+{
+	if(verbose>=3) return;
+
+	for(*cnt+=blocks; *cnt>=512; *cnt-=512) putchar(c);
+	fflush(stdout);
+}
+
+static ssize_t write_kdzfile_pread(void *opaque, void *buf, size_t count,
+off64_t offset)
+{
+	return pread_kdzslice(opaque, buf, count, offset);
+}
+
+/* which blocks of the KDZ's filesystem are in use, NULL if not ext4 */
+static uint8_t *write_kdzfile_ext4(const struct kdz_file *kdz, uint32_t dev,
+const char *slice_name, uint64_t *fsblocks, uint32_t *fsblksz)
+{
+	struct kdz_slice *slice;
+	struct ext4_fs *fs;
+	uint8_t *map=NULL;
+
+	/* the bitmaps are needed before the blocks they describe */
+	if(!(slice=open_kdzslice(kdz, dev, slice_name, 4<<20))) return NULL;
+
+	if((fs=ext4_open(write_kdzfile_pread, slice))) {
+		if(!(map=ext4_bitmap(fs))) fprintf(stderr,
+"Failed to load ext4 bitmaps of \"%s\": %s\n", slice_name, strerror(errno));
+		*fsblocks=ext4_blocks(fs);
+		*fsblksz=ext4_blksz(fs);
+		ext4_close(fs);
+	} else if(verbose>=1) fprintf(stderr,
+"\"%s\" isn't ext4, writing every block\n", slice_name);
+
+	close_kdzslice(slice);
+
+	return map;
+}
+
+/* is all of the given slice area free in the filesystem? */
+static bool write_kdzfile_free(const uint8_t *map, uint64_t fsblocks,
+uint32_t fsblksz, uint64_t off, uint64_t len)
+{
+	uint64_t b;
+
+	for(b=off/fsblksz; b<(off+len+fsblksz-1)/fsblksz; ++b)
+		if(b>=fsblocks||map[b>>3]&1<<(b&7)) return false;
+
+	return true;
+}
+
+/* While write_kdzfiles() runs, the decoders its threads share: no more
+** chunks than this are inflated at once.  Unlimited otherwise. */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned avail;
+	bool limited;
+} kdz_decode={PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, false};
+
+static void kdz_decode_get(void)
+{
+	pthread_mutex_lock(&kdz_decode.lock);
+	if(kdz_decode.limited) {
+		while(!kdz_decode.avail) pthread_cond_wait(&kdz_decode.cond,
+&kdz_decode.lock);
+		--kdz_decode.avail;
+	}
+	pthread_mutex_unlock(&kdz_decode.lock);
+}
+
+static void kdz_decode_put(void)
+{
+	pthread_mutex_lock(&kdz_decode.lock);
+	if(kdz_decode.limited) {
+		++kdz_decode.avail;
+		pthread_cond_signal(&kdz_decode.cond);
+	}
+	pthread_mutex_unlock(&kdz_decode.lock);
+}
+
+/* A chunk's buffers.  With io_uring doing the work its compressed data and
+** device contents are read while the previous chunk inflates, and its output
+** has to stay put until the writes complete, so two of these alternate. */
+struct write_kdzfile_buf {
+	char *out, *in, *dev;
+	size_t outsz, insz, devsz;
+	struct kdz_iogroup rd, wr;
+};
+
+static bool write_kdzfile_grow(char **buf, size_t *bufsz, size_t len)
+{
+	if(*bufsz>=len) return true;
+
+	free(*buf);
+	*bufsz=0;
+	/* O_DIRECT needs aligned buffers */
+	if(posix_memalign((void **)buf, 4096, len)) {
+		*buf=NULL;
+		fprintf(stderr, "Memory allocation failure!\n");
+		return false;
+	}
+	*bufsz=len;
+
+	return true;
+}
+
+/* next chunk of the same slice, passing over those already journaled */
+static unsigned write_kdzfile_next(const struct kdz_file *kdz,
+const char *slice_name, unsigned chunk)
+{
+	while(++chunk<=kdz->dz_file.chunk_count&&
+(strcmp(slice_name, kdz->chunks[chunk].dz.slice_name)||
+kdz_journal_done(kdz_journal, chunk, NULL)));
+
+	return chunk;
+}
+
+/* bytes of chunk data written between journal updates */
+#define KDZ_JOURNAL_BATCH (64<<20)
+
+/* blocks sampled for the journal's spot check: first, last and middle */
+static unsigned write_kdzfile_samples(uint32_t size, uint32_t blksz,
+uint32_t off[3])
+{
+	unsigned n=0;
+
+	if(!size) return 0;
+
+	off[n++]=0;
+	if(size>blksz) off[n++]=(size-1)/blksz*blksz;
+	if(size>blksz*2) off[n++]=size/blksz/2*blksz;
+
+	return n;
+}
+
+/* the sampled blocks as the write leaves them: the KDZ's data, except
+** blocks -e left alone as free in the filesystem, which keep what devmap
+** has; slicepos is the chunk's position in the slice */
+static uint32_t write_kdzfile_spot(const char *buf, const char *devmap,
+uint32_t size, uint32_t blksz, const uint8_t *fsmap, uint64_t fsblocks,
+uint32_t fsblksz, off64_t slicepos)
+{
+	uLong crc=crc32(0, Z_NULL, 0);
+	uint32_t off[3];
+	unsigned i, n=write_kdzfile_samples(size, blksz, off);
+
+	for(i=0; i<n; ++i) {
+		const uint32_t len=size-off[i]<blksz?size-off[i]:blksz;
+		const bool left=fsmap&&write_kdzfile_free(fsmap, fsblocks, fsblksz,
+slicepos+off[i], len);
+
+		crc=crc32(crc, (Bytef *)(left?devmap:buf)+off[i], len);
+	}
+
+	return crc;
+}
+
+/* does the device still hold a journaled chunk's sampled blocks? */
+static bool write_kdzfile_spotcheck(const struct kdz_file *kdz,
+struct kdz_devbuf *db, unsigned chunk, uint32_t spot)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	uLong crc=crc32(0, Z_NULL, 0);
+	uint32_t off[3];
+	unsigned i, n=write_kdzfile_samples(dz->target_size, blksz, off);
+
+	for(i=0; i<n; ++i) {
+		const uint32_t len=dz->target_size-off[i]<blksz?
+dz->target_size-off[i]:blksz;
+		const char *p;
+
+		if(!(p=kdz_devget(db, kdz, dz->device,
+(off64_t)dz->target_addr*blksz+off[i], len))) return false;
+		crc=crc32(crc, (Bytef *)p, len);
+	}
+
+	return crc==spot;
+}
+
+/* add a slice area to the undo log, straight from the device */
+static bool write_kdzfile_save(const struct kdz_file *kdz,
+struct kdz_devbuf *db, int dev, const char *slice_name, off64_t start,
+uint64_t off, uint64_t len)
+{
+	const size_t piece=kdz_devread_piece(kdz->devs[dev].blksz);
+
+	while(len) {
+		const size_t n=len>piece?piece:len;
+		const char *p;
+
+		if(!(p=kdz_devget(db, kdz, dev, start+off, n))||
+!undo_add(kdz_undo, slice_name, off, p, n)) {
+			fprintf(stderr, "Saving old contents of \"%s\" failed\n",
+slice_name);
+			return false;
+		}
+
+		off+=n;
+		len-=n;
+	}
+
+	return true;
+}
+
+/* journal the chunks once their writes have reached the device, false only
+** if the writes failed */
+static bool write_kdzfile_commit(struct kdz_io *io,
+struct write_kdzfile_buf wb[2], int fd, struct kdz_journal_rec *rec,
+unsigned *count)
+{
+	unsigned n;
+
+	if(!*count) return true;
+
+	if(io) for(n=0; n<2; ++n) if(!kdz_io_wait(io, &wb[n].wr)) return false;
+
+	if(kdz_fsync(fd)<0) return false;
+
+	/* losing records only costs a resume some work */
+	n=*count;
+	*count=0;
+	kdz_journal_add(kdz_journal, rec, n);
+
+	return true;
+}
+
+static bool write_kdzfile_prefetch(const struct kdz_file *kdz,
+struct kdz_io *io, int rfd, unsigned chunk, struct write_kdzfile_buf *b)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+
+	if(!write_kdzfile_grow(&b->in, &b->insz, dz->data_size)||
+!write_kdzfile_grow(&b->dev, &b->devsz, dz->target_size)) return false;
+
+	/* kept chunks needn't be read, they're already inflated */
+	if((!kdz->kept[chunk]&&!kdz_io_pread(io, kdz->fd, b->in, dz->data_size,
+kdz->chunks[chunk].zoff, &b->rd))||!kdz_io_pread(io, rfd, b->dev,
+dz->target_size, (off64_t)dz->target_addr*blksz, &b->rd)) {
+		fprintf(stderr, "Failed to queue reads: %s\n", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/* queue in pieces, so the device sees several requests at once */
+static bool write_kdzfile_queue(struct kdz_io *io, int fd, const char *buf,
+size_t len, off64_t off, size_t iosz, struct kdz_iogroup *grp)
+{
+	if(iosz>KDZ_DIRECT_IOSZ) iosz=KDZ_DIRECT_IOSZ;
+
+	while(len) {
+		const size_t n=len>iosz?iosz:len;
+
+		if(!kdz_io_pwrite(io, fd, buf, n, off, grp)) return false;
+
+		buf+=n;
+		len-=n;
+		off+=n;
+	}
+
+	return true;
+}
+
+/* bytes past a chunk's data to discard, stopping short of any other
+** chunk's area on the device: discards run in the background, so one
+** reaching into the next chunk could land after that chunk's data */
+static uint64_t kdz_trim_len(const struct kdz_file *kdz, unsigned chunk)
+{
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	const uint64_t start=(uint64_t)dz->target_addr*blksz;
+	const uint64_t data=start+dz->target_size;
+	uint64_t end=start+(uint64_t)dz->trim_count*blksz;
+	unsigned i;
+
+	if(end<=data) return 0;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const o=&kdz->chunks[i].dz;
+		const uint64_t ostart=(uint64_t)o->target_addr*blksz;
+
+		if(i==chunk||o->device!=dz->device||ostart<=start||ostart>=end)
+			continue;
+
+		end=ostart<data?data:ostart;
+	}
+
+	return end-data;
+}
+
+/* a slice, or a whole device for fanout_kdzfiles(), being brought in line
+** with the KDZ; every writer saves, zeroes, writes and discards through
+** this, positions are relative to the slice */
+struct kdz_wr {
+	const struct kdz_file *kdz;
+	struct kdz_devbuf *db;	/* for saving what isn't at hand */
+	const char *name;	/* slice, for the undo log and messages */
+	int dev, fd;
+	off64_t offset;		/* of the slice on the device */
+	off64_t base;		/* of the slice in what fd has open */
+	uint32_t blksz;
+	bool simulate;
+	bool undo;		/* save to kdz_undo before overwriting */
+	enum kdz_zero zero;
+	bool direct;		/* fd is O_DIRECT */
+	size_t iosz;		/* largest request */
+	struct discard *dsc;	/* NULL to discard synchronously */
+	struct kdz_io *io;	/* NULL to write synchronously */
+	struct kdz_iogroup *grp;
+	struct kdz_pace *pace;	/* NULL for no pacing */
+	uint64_t (*held)[2];	/* trims waiting for the undo log to sync */
+	unsigned nheld, heldsz;
+	uint64_t wrote, zeroed, same, trimmed;	/* bytes */
+};
+
+static void kdz_wr_init(struct kdz_wr *w, const struct kdz_file *kdz,
+struct kdz_devbuf *db, int dev, const char *name, int fd, off64_t offset,
+off64_t base, bool simulate)
+{
+	memset(w, 0, sizeof(*w));
+	w->kdz=kdz;
+	w->db=db;
+	w->name=name;
+	w->dev=dev;
+	w->fd=fd;
+	w->offset=offset;
+	w->base=base;
+	w->blksz=kdz->devs[dev].blksz;
+	w->simulate=simulate;
+	w->undo=kdz_undo&&!simulate;
+	w->zero=kdz_zerosel(fd, simulate);
+	w->iosz=~(size_t)0;
+}
+
+/* keep what is about to be overwritten or trimmed, old is NULL to take it
+** from the device */
+static bool kdz_wr_save(struct kdz_wr *w, const char *old, off64_t pos,
+uint64_t len)
+{
+	if(!w->undo||!len) return true;
+
+	if(!old) return write_kdzfile_save(w->kdz, w->db, w->dev, w->name,
+w->offset, pos, len);
+
+	if(undo_add(kdz_undo, w->name, pos, old, len)) return true;
+
+	fprintf(stderr, "Saving old contents of \"%s\" failed\n", w->name);
+	return false;
+}
+
+/* zero without writing, false if it has to be written after all */
+static bool kdz_wr_zero(struct kdz_wr *w, off64_t pos, size_t len)
+{
+	if(w->zero==KDZ_ZERO_WRITE) return false;
+
+	if(w->simulate||kdz_zeroout(w->fd, w->zero, w->base+pos, len)) {
+		w->zeroed+=len;
+		return true;
+	}
+
+	if(verbose>=1) fprintf(stderr,
+"Zeroing failed (%s), writing zeros instead\n", strerror(errno));
+	w->zero=KDZ_ZERO_WRITE;
+
+	return false;
+}
+
+static bool kdz_wr_write(struct kdz_wr *w, const char *buf, off64_t pos,
+size_t len)
+{
+	const off64_t off=w->base+pos;
+
+	w->wrote+=len;
+	if(w->simulate) return true;
+
+	if(w->io?!write_kdzfile_queue(w->io, w->fd, buf, len, off, w->iosz,
+w->grp):!kdz_pwrite_direct(w->fd, &w->direct, buf, len, off, w->iosz)) {
+		fprintf(stderr, "Write to \"%s\" failed: %s\n", w->name,
+strerror(errno));
+		return false;
+	}
+
+	/* O_DIRECT writes leave nothing dirty */
+	if(w->pace&&!w->direct&&!kdz_pace_wrote(w->pace, off, len)) {
+		fprintf(stderr, "Writeback of \"%s\" failed: %s\n", w->name,
+strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static void kdz_wr_discard(struct kdz_wr *w, off64_t pos, uint64_t len)
+{
+	w->trimmed+=len;
+	if(w->simulate) return;
+
+	/* discards are advisory, failures are only noted */
+	if(w->dsc) {
+		if(!discard_add(w->dsc, w->base+pos, len)&&verbose>=1)
+fprintf(stderr, "Failed to queue discard: %s\n", strerror(errno));
+	} else if(!kdz_discard(w->fd, w->base+pos, len)&&verbose>=1)
+fprintf(stderr, "Discard on \"%s\" failed: %s\n", w->name, strerror(errno));
+}
+
+/* discard the area past a chunk's data, len is sanity checked; with an
+** undo log the discard waits for kdz_wr_release() */
+static bool kdz_wr_trim(struct kdz_wr *w, off64_t pos, uint64_t len)
+{
+	const size_t piece=kdz_devread_piece(w->blksz);
+	uint64_t cur, n;
+
+	if(!len||len>=(uint64_t)1<<40) return true;
+
+	if(!w->undo) {
+		kdz_wr_discard(w, pos, len);
+		return true;
+	}
+
+	/* trimmed blocks are lost too, so the undo log needs them; what
+	** already reads as zeros needs neither saving nor discarding */
+	for(cur=0; cur<len; cur+=n) {
+		const char *p;
+
+		n=len-cur>piece?piece:len-cur;
+
+		if(!(p=kdz_devget(w->db, w->kdz, w->dev, w->offset+pos+cur, n)))
+			return false;
+		if(kdz_blkzero(p, n)) continue;
+
+		if(!kdz_wr_save(w, p, pos+cur, n)) return false;
+
+		if(w->nheld&&w->held[w->nheld-1][0]+w->held[w->nheld-1][1]==
+(uint64_t)pos+cur) {
+			w->held[w->nheld-1][1]+=n;
+			continue;
+		}
+
+		if(w->nheld==w->heldsz) {
+			const unsigned sz=w->heldsz?w->heldsz*2:64;
+			void *const tmp=realloc(w->held, sizeof(w->held[0])*sz);
+
+			if(!tmp) {
+				fprintf(stderr, "Memory allocation failure!\n");
+				return false;
+			}
+			w->held=tmp;
+			w->heldsz=sz;
+		}
+
+		w->held[w->nheld][0]=pos+cur;
+		w->held[w->nheld][1]=n;
+		++w->nheld;
+	}
+
+	return true;
+}
+
+/* issue the held discards, once the undo log has reached the disk */
+static bool kdz_wr_release(struct kdz_wr *w)
+{
+	unsigned i;
+
+	if(!w->nheld) return true;
+
+	if(!undo_sync(kdz_undo)) {
+		fprintf(stderr, "Saving old contents of \"%s\" failed\n", w->name);
+		return false;
+	}
+
+	for(i=0; i<w->nheld; ++i) kdz_wr_discard(w, w->held[i][0], w->held[i][1]);
+	w->nheld=0;
+
+	return true;
+}
+
+/* discards still held are dropped */
+static void kdz_wr_free(struct kdz_wr *w)
+{
+	free(w->held);
+	w->held=NULL;
+	w->nheld=w->heldsz=0;
+}
+
+/* bring len bytes at pos in line with buf, devmap has what is there now */
+static bool kdz_wr_range(struct kdz_wr *w, const char *buf,
+const char *devmap, off64_t pos, size_t len)
+{
+	const kdz_blkdifffunc diff=kdz_blkdiffsel(w->blksz);
+	size_t j, k, n;
+
+	for(j=0; j<len; ) {
+		size_t start=j;
+		const size_t run=kdz_dirtyrun(diff, buf, devmap, &start, len,
+w->blksz);
+
+		w->same+=start-j;
+
+		for(k=start; k<start+run; k+=n) {
+			bool iszero=false;
+
+			n=w->zero==KDZ_ZERO_WRITE?start+run-k:
+kdz_zeroseg(buf, k, start+run, w->blksz, &iszero);
+
+			if(!kdz_wr_save(w, devmap+k, pos+k, n)) return false;
+			if(iszero&&kdz_wr_zero(w, pos+k, n)) continue;
+			if(!kdz_wr_write(w, buf+k, pos+k, n)) return false;
+		}
+
+		j=start+run;
+	}
+
+	return true;
+}
+
+/* a chunk's part of a plan, in host byte order */
+struct kdz_planent {
+	struct kdz_plan_chunk rec;
+	struct kdz_plan_run *runs;
+};
+
+/* what write_kdzfile() did while simulating for plan_kdzfiles() */
+static struct {
+	pthread_mutex_t lock;
+	bool active;
+	unsigned count;
+	struct kdz_planent *ent;
+} kdz_planrec={PTHREAD_MUTEX_INITIALIZER, false, 0, NULL};
+
+/* add a run to the chunk's plan, extending the previous one if possible */
+static bool write_kdzfile_planrun(struct kdz_planent *pe, uint64_t off,
+uint32_t len, bool zero)
+{
+	struct kdz_plan_run *r;
+
+	if(pe->rec.nruns) {
+		r=pe->runs+pe->rec.nruns-1;
+		if(r->zero==zero&&r->off+r->len==off) {
+			r->len+=len;
+			return true;
+		}
+	}
+
+	if(!(pe->rec.nruns&0xF)) {
+		if(!(r=realloc(pe->runs, sizeof(r[0])*(pe->rec.nruns+0x10)))) {
+			fprintf(stderr, "Memory allocation failure!\n");
+			return false;
+		}
+		pe->runs=r;
+	}
+
+	r=pe->runs+pe->rec.nruns++;
+	r->off=off;
+	r->len=len;
+	r->zero=zero;
+
+	return true;
+}
+
+/* hand the chunk's plan over to kdz_planrec */
+static bool write_kdzfile_plan(struct kdz_planent *pe)
+{
+	struct kdz_planent *tmp;
+
+	pthread_mutex_lock(&kdz_planrec.lock);
+	if(!(tmp=realloc(kdz_planrec.ent, sizeof(tmp[0])*(kdz_planrec.count+1)))) {
+		pthread_mutex_unlock(&kdz_planrec.lock);
+		fprintf(stderr, "Memory allocation failure!\n");
+		return false;
+	}
+	kdz_planrec.ent=tmp;
+	kdz_planrec.ent[kdz_planrec.count++]=*pe;
+	pthread_mutex_unlock(&kdz_planrec.lock);
+
+	pe->runs=NULL;
+	pe->rec.nruns=0;
+
+	return true;
+}
+
+/* offset of slice_name in gptdev, 0 if missing */
+static off64_t kdz_slice_offset_gpt(const struct gpt_data *gptdev,
+uint32_t blksz, const char *slice_name)
+{
+	int j;
+
+	for(j=0; j<gptdev->head.entryCount-1; ++j) {
+		/* not the one */
+		if(strcmp(slice_name, gptdev->entry[j].name)) continue;
+
+		return gptdev->entry[j].startLBA*blksz;
+	}
+
+	return 0;
+}
+
+/* offset of slice_name from the GPT at the start of map, 0 if missing */
+static off64_t kdz_slice_offset_map(char *map, off64_t len, uint32_t blksz,
+const char *devname, const char *slice_name)
+{
+	struct gpt_data *gptdev;
+	struct gpt_buf gpt_buf;
+	off64_t ret;
+
+	gpt_buf.bufsz=len;
+	gpt_buf.buf=map;
+
+	if(!(gptdev=readgptb(gptbuffunc, &gpt_buf, blksz, GPT_ANY))) {
+		fprintf(stderr, "Failed to read GPT from %s\n", devname);
+		return 0;
+	}
+
+	ret=kdz_slice_offset_gpt(gptdev, blksz, slice_name);
+
+	free(gptdev);
+
+	return ret;
+}
+
+/* offset of slice_name on device dev from the device's GPT, 0 if missing;
+** the GPT is only parsed once per run */
+static off64_t kdz_slice_offset(const struct kdz_file *kdz, int dev,
+const char *slice_name)
+{
+	const struct gpt_data *gptdev;
+	char name[PATH_MAX];
+
+	if(!(gptdev=kdz_devgpt(kdz, dev, GPT_ANY))) {
+		if(!kdz_devices||!kdz_devname(kdz, kdz_devices, dev, name,
+sizeof(name))) snprintf(name, sizeof(name), "/dev/block/sd%c", 'a'+dev);
+		fprintf(stderr, "Failed to read GPT from %s\n", name);
+		return 0;
+	}
+
+	return kdz_slice_offset_gpt(gptdev, kdz->devs[dev].blksz, slice_name);
+}
+
+static enum kdz_slice_class kdz_slice_class(const struct kdz_file *kdz,
+const char *slice_name)
+{
+	const size_t len=strlen(slice_name);
+	unsigned i;
+
+	if(!strcmp(slice_name, "PrimaryGPT")||!strcmp(slice_name, "BackupGPT"))
+		return KDZ_SLICE_GPT;
+
+	if(len>3&&!strcmp(slice_name+len-3, "bak")) return KDZ_SLICE_BACKUP;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const char *const name=kdz->chunks[i].dz.slice_name;
+
+		if(!strncmp(name, slice_name, len)&&!strcmp(name+len, "bak"))
+			return KDZ_SLICE_BOOT;
+	}
+
+	return KDZ_SLICE_BULK;
+}
+
+/* open a slice for writing (reading when simulating), *base gets its offset
+** in what was opened: 0 for the slice's own node, offset within an image */
+static int kdz_open_slice(const struct kdz_file *kdz, int dev,
+const char *slice_name, off64_t offset, bool simulate, off64_t *base)
+{
+	if(kdz_devices) {
+		*base=offset;
+		return open_device(kdz, dev, simulate?O_RDONLY:O_WRONLY);
+	}
+
+	return kdz_open_named(slice_name, simulate, base);
+}
+
+/* without a KDZ saying which device is which, any image holding a slice of
+** that name will do, so long as only one does */
+static int kdz_open_image(const char *slice_name, bool simulate,
+off64_t *base)
+{
+	static const char units[]="0123456789abcdefghijklmnopqrstuvwxyz";
+	char name[PATH_MAX], found[PATH_MAX]="", prev[PATH_MAX]="";
+	const char *unit;
+	int fd;
+
+	for(unit=units; *unit; ++unit) {
+		struct gpt_data *gptdev;
+		off64_t offset;
+
+		if(!kdz_unitname(kdz_devices, *unit, name, sizeof(name))) {
+			errno=EINVAL;
+			return -1;
+		}
+
+		/* no "%c", or all the same */
+		if(!strcmp(name, prev)) continue;
+		strcpy(prev, name);
+
+		if((fd=open(name, O_RDONLY|O_LARGEFILE))<0) {
+			if(errno==ENOENT) continue;
+			fprintf(stderr, "Failed to open \"%s\": %s\n", name,
+strerror(errno));
+			return -1;
+		}
+
+		gptdev=readgpt(fd, GPT_ANY);
+		close(fd);
+		if(!gptdev) continue;
+
+		offset=kdz_slice_offset_gpt(gptdev, gptdev->blocksz, slice_name);
+		free(gptdev);
+		if(!offset) continue;
+
+		if(found[0]) {
+			fprintf(stderr,
+"Slice \"%s\" is in both \"%s\" and \"%s\", refusing to guess\n",
+slice_name, found, name);
+			return -1;
+		}
+		strcpy(found, name);
+		*base=offset;
+	}
+
+	if(!found[0]) {
+		fprintf(stderr, "Slice \"%s\" isn't in any of \"%s\"\n",
+slice_name, kdz_devices);
+		return -1;
+	}
+
+	if((fd=open(found, O_LARGEFILE|(simulate?O_RDONLY:O_WRONLY)))<0)
+		fprintf(stderr, "Failed to open \"%s\": %s\n", found,
+strerror(errno));
+
+	return fd;
+}
+
+int kdz_open_named(const char *slice_name, bool simulate, off64_t *base)
+{
+	int flags=O_LARGEFILE;
+	char name[64];
+	int fd;
+
+	if(kdz_devices) return kdz_open_image(slice_name, simulate, base);
+
+	*base=0;
+
+	/* on Linux O_EXCL refuses if mounted */
+	if(!simulate) flags|=O_EXCL|O_WRONLY;
+	snprintf(name, sizeof(name), "/dev/block/bootdevice/by-name/%s",
+slice_name);
+
+	if((fd=open(name, flags))<0) {
+		const char *fmt;
+		if(errno==EBUSY) fmt="\"%s\" mounted, refusing to continue\n";
+		else fmt="Failed to open \"%s\": %s\n";
+
+		fprintf(stderr, fmt, name, strerror(errno));
+	}
+
+	return fd;
+}
+
+int write_kdzfile(const struct kdz_file *const kdz,
+const char *const slice_name, const unsigned wflags)
+{
+	const bool simulate=wflags&KDZ_WRITE_SIMULATE;
+	int i, j;
+	int dev;
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	struct write_kdzfile_buf wb[2];
+	struct kdz_io *io=NULL;
+	int rfd=-1;
+	struct kdz_devbuf db=KDZ_DEVBUF_INIT;
+	struct kdz_ring *ring=NULL;
+	struct discard *dsc=NULL;
+	unsigned next, n;
+	off64_t offset, base;
+	int fd=-1;
+	uint64_t blksz;
+	unsigned wrote=0, skip=0;
+	kdz_blkdifffunc diff;
+	struct kdz_wr w;
+	struct kdz_pace pace={-1,};
+	uint8_t *fsmap=NULL;
+	uint64_t fsblocks=0, unused=0;
+	uint32_t fsblksz=0;
+	unsigned zeroed=0, zeroops=0;
+	uint64_t zeroblks=0;
+	size_t unit, astart=0, arun=0;
+	bool ahead;
+	uint64_t rawbytes=0, widebytes=0;
+	unsigned rawruns=0, wideruns=0;
+	struct kdz_journal_rec *jpend=NULL;
+	unsigned jcount=0;
+	uint64_t jbytes=0;
+	const bool planning=simulate&&kdz_planrec.active;
+	struct kdz_planent pe;
+
+	memset(wb, 0, sizeof(wb));
+	memset(&pe, 0, sizeof(pe));
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(!strcmp(slice_name, kdz->chunks[i].dz.slice_name)) break;
+
+	/* fail */
+	if(i>kdz->dz_file.chunk_count) return 0;
+
+	dev=kdz->chunks[i].dz.device;
+	blksz=kdz->devs[dev].blksz;
+
+	/* fail */
+	if(!(offset=kdz_slice_offset(kdz, dev, slice_name))) return 0;
+
+
+	if((fd=kdz_open_slice(kdz, dev, slice_name, offset, simulate, &base))<0)
+		return 0;
+
+	if(wflags&KDZ_WRITE_EXT4)
+		fsmap=write_kdzfile_ext4(kdz, dev, slice_name, &fsblocks, &fsblksz);
+
+	diff=kdz_blkdiffsel(blksz);
+
+	kdz_wr_init(&w, kdz, &db, dev, slice_name, fd, offset, base, simulate);
+
+	if((unit=kdz_queue_unit(kdz, dev, blksz))&&verbose>=2) fprintf(stderr,
+"Widening differing runs to %zu byte units at %u times amplification\n",
+unit, kdz_write_amp);
+
+	if(!simulate&&!(dsc=discard_open(fd))&&verbose>=1) fprintf(stderr,
+"Unable to discard in the background, discarding synchronously\n");
+
+	/* a resumed write passes over what the journal has, if it checks out */
+	if(kdz_journal&&!simulate) {
+		unsigned k, kept=0, redo=0;
+		uint32_t spot;
+
+		for(k=i; k<=kdz->dz_file.chunk_count; ++k) {
+			if(strcmp(slice_name, kdz->chunks[k].dz.slice_name)||
+!kdz_journal_done(kdz_journal, k, &spot)) continue;
+
+			if(write_kdzfile_spotcheck(kdz, &db, k, spot)) ++kept;
+			else {
+				kdz_journal_forget(kdz_journal, k);
+				++redo;
+			}
+		}
+
+		if(kept&&verbose>=0) printf(
+"Passing over %u chunks of \"%s\" already written\n", kept, slice_name);
+		if(redo&&verbose>=0) printf(
+"%u journaled chunks of \"%s\" failed their spot check, rewriting them\n",
+redo, slice_name);
+
+		if(kdz_journal_done(kdz_journal, i, NULL))
+			i=write_kdzfile_next(kdz, slice_name, i);
+
+		if(!(jpend=malloc(sizeof(jpend[0])*kdz->dz_file.chunk_count))) {
+			fprintf(stderr, "Memory allocation failure!\n");
+			goto abort;
+		}
+	}
+
+	if(wflags&KDZ_WRITE_DIRECT&&!simulate)
+		w.direct=kdz_setdirect(fd, blksz, &w.iosz);
+
+	if(!simulate&&!kdz_pace_init(&pace, fd)) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		goto abort;
+	}
+	w.dsc=dsc;
+	w.pace=&pace;
+
+	if(kdz_io_depth) {
+		if(!(io=kdz_io_open(kdz_io_depth))) {
+			fprintf(stderr, "Memory allocation failure!\n");
+			goto abort;
+		}
+
+		if(!kdz_io_async(io)) {
+			kdz_io_close(io);
+			io=NULL;
+		} else if((rfd=open_device(kdz, dev, O_RDONLY))<0) {
+			fprintf(stderr, "Failed to open device for reading: %s\n",
+strerror(errno));
+			goto abort;
+		} else if(i<=kdz->dz_file.chunk_count&&
+!write_kdzfile_prefetch(kdz, io, rfd, i, wb)) goto abort;
+	}
+
+	w.io=io;
+
+	/* io_uring reads ahead by itself */
+	if(!io) ring=kdz_ring_chunks(kdz, slice_name, i,
+kdz->dz_file.chunk_count, kdz_journal, true);
+
+
+	for(n=0; i<=kdz->dz_file.chunk_count; i=next, ++n) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		struct write_kdzfile_buf *const b=wb+(io?n&1:0);
+		const char *devmap;
+		char *kept;
+		uint64_t range[2];
+
+		next=write_kdzfile_next(kdz, slice_name, i);
+
+		if(dev!=dz->device) { /* trouble! */
+			fprintf(stderr, "PANIC: \"%s\"'s chunks cross multiple devices?!\n", slice_name);
+			goto abort;
+		}
+
+		if(io) {
+			/* start on the next chunk while this one inflates */
+			if(next<=kdz->dz_file.chunk_count&&
+kdz->chunks[next].dz.device==dev&&
+!write_kdzfile_prefetch(kdz, io, rfd, next, wb+((n+1)&1))) goto abort;
+
+			/* writes from two chunks back are still using the buffer */
+			if(!kdz_io_wait(io, &b->wr)) {
+				fprintf(stderr, "Write to \"%s\" failed: %s\n",
+slice_name, strerror(errno));
+				goto abort;
+			}
+
+			if(!kdz_io_wait(io, &b->rd)) {
+				fprintf(stderr, "Reading for chunk %u failed: %s\n", i,
+strerror(errno));
+				goto abort;
+			}
+		}
+
+		/* test_kdzfile() may have inflated it already */
+		if((kept=kdz_kept_take(kdz, i))) {
+			free(b->out);
+			b->out=kept;
+			b->outsz=dz->target_size;
+		} else {
+			if(!write_kdzfile_grow(&b->out, &b->outsz, dz->target_size))
+				goto abort;
+
+			kdz_decode_get();
+
+			if(!(io?unpackchunk_alloc_in(ctx, kdz, i, b->in):
+ring?unpackchunk_alloc_ring(ctx, kdz, i, ring):
+unpackchunk_alloc(ctx, kdz, i))||
+unpackchunk(ctx, b->out, dz->target_size)!=dz->target_size||
+!unpackchunk_free(ctx, false)) {
+				kdz_decode_put();
+				goto abort;
+			}
+
+			kdz_decode_put();
+		}
+
+		if(io) devmap=b->dev;
+		else if(!(devmap=kdz_devget(&db, kdz, dev, dz->target_addr*blksz,
+dz->target_size))) goto abort;
+
+
+		if(verbose>=3) fprintf(stderr, "DEBUG: chunk %u\n", i);
+
+		if(planning) {
+			pe.rec.chunk=i;
+			pe.rec.devcrc=crc32(crc32(0, Z_NULL, 0), (Bytef *)devmap,
+dz->target_size);
+			pe.rec.start=offset;
+		}
+
+		/* write the device while trying to keep wear to a minimum */
+		ahead=false;
+		for(j=0; j<dz->target_size; ) {
+			const off64_t slicepos=dz->target_addr*blksz-offset;
+			size_t start=j, run, k;
+
+			/* already found while widening the previous run? */
+			if(ahead) {
+				start=astart;
+				run=arun;
+				ahead=false;
+			} else run=kdz_dirtyrun(diff, b->out, devmap, &start,
+dz->target_size, blksz);
+
+			if(run&&unit&&kdz_write_amp) {
+				size_t end=start+run;
+				bool prev=false;
+
+				/* fewer, larger, aligned writes may be cheaper */
+				kdz_widen(diff, b->out, devmap, dz->target_size, blksz,
+dz->target_addr*blksz, unit, kdz_write_amp, j, &start, &end);
+
+				/* keep merging while the next widened run adjoins */
+				for(;;) {
+					size_t ns, ne;
+
+					astart=end;
+					if(!(arun=kdz_dirtyrun(diff, b->out, devmap, &astart,
+dz->target_size, blksz))) break;
+
+					ns=astart;
+					ne=astart+arun;
+					kdz_widen(diff, b->out, devmap, dz->target_size,
+blksz, dz->target_addr*blksz, unit, kdz_write_amp, end, &ns, &ne);
+					if(ns>end) break;
+					end=ne;
+				}
+				ahead=true;
+				run=end-start;
+
+				for(k=start; k<end; k+=blksz) {
+					const bool d=diff(b->out+k, devmap+k, blksz);
+
+					if(d) rawbytes+=blksz;
+					if(d&&!prev) ++rawruns;
+					prev=d;
+				}
+			} else if(run) {
+				rawbytes+=run;
+				++rawruns;
+			}
+
+			if(run) {
+				widebytes+=run;
+				++wideruns;
+			}
+
+			if(start>j) {
+				if(verbose>=3) fprintf(stderr,
+"DEBUG: skipping %lu bytes at %lu (block %lu)\n", start-j, slicepos+j,
+(slicepos+j)/blksz);
+				write_kdzfile_progress(&skip, (start-j)/blksz, '.');
+			}
+
+			/* free blocks within the run can stay as they are */
+			for(k=start; k<start+run; ) {
+				size_t n;
+				bool iszero;
+
+				if(fsmap&&write_kdzfile_free(fsmap, fsblocks, fsblksz,
+slicepos+k, blksz)) {
+					++unused;
+
+					if(verbose>=3) fprintf(stderr,
+"DEBUG: leaving free %lu bytes at %lu (block %lu)\n", blksz, slicepos+k,
+(slicepos+k)/blksz);
+					write_kdzfile_progress(&skip, 1, '.');
+					k+=blksz;
+					continue;
+				}
+
+				for(n=blksz; k+n<start+run&&!(fsmap&&
+write_kdzfile_free(fsmap, fsblocks, fsblksz, slicepos+k+n, blksz));
+n+=blksz);
+
+				/* zero runs take an ioctl() rather than a write */
+				iszero=false;
+				if(w.zero!=KDZ_ZERO_WRITE)
+					n=kdz_zeroseg(b->out, k, k+n, blksz, &iszero);
+
+				if(!kdz_wr_save(&w, devmap+k, slicepos+k, n)) goto abort;
+
+				if(iszero) {
+					if(verbose>=3) fprintf(stderr,
+"DEBUG: zeroing %lu bytes at %lu (block %lu)\n", n, slicepos+k,
+(slicepos+k)/blksz);
+
+					if(planning&&!write_kdzfile_planrun(&pe, slicepos+k, n,
+true)) goto abort;
+
+					if(kdz_wr_zero(&w, slicepos+k, n)) {
+						write_kdzfile_progress(&zeroed, n/blksz, '0');
+						zeroblks+=n/blksz;
+						++zeroops;
+						k+=n;
+						continue;
+					}
+				}
+
+				if(verbose>=3) fprintf(stderr,
+"DEBUG: writing %lu bytes at %lu (block %lu)\n", n, slicepos+k,
+(slicepos+k)/blksz);
+				write_kdzfile_progress(&wrote, n/blksz, 'o');
+
+				if(planning&&!write_kdzfile_planrun(&pe, slicepos+k, n,
+false)) goto abort;
+
+				w.grp=&b->wr;
+				if(!kdz_wr_write(&w, b->out+k, slicepos+k, n)) goto abort;
+
+				k+=n;
+			}
+
+			j=start+run;
+		}
+
+		if(jpend) {
+			jpend[jcount].chunk=i;
+			jpend[jcount].crc32=dz->crc32;
+			jpend[jcount].spot=write_kdzfile_spot(b->out, devmap,
+dz->target_size, blksz, fsmap, fsblocks, fsblksz,
+(off64_t)dz->target_addr*blksz-offset);
+			++jcount;
+
+			if((jbytes+=dz->target_size)>=KDZ_JOURNAL_BATCH) {
+				jbytes=0;
+				if(!write_kdzfile_commit(io, wb, fd, jpend, &jcount)) {
+					fprintf(stderr, "Write to \"%s\" failed: %s\n",
+slice_name, strerror(errno));
+					goto abort;
+				}
+
+				/* the commit synced the undo log */
+				if(!kdz_wr_release(&w)) goto abort;
+			}
+		}
+
+
+		/* Discard (TRIM) all possible space */
+		/* Note, this is being done on the slice, so slice-relative */
+
+		/* start byte */
+		range[0]=dz->target_addr*blksz-offset+dz->target_size;
+
+		range[1]=kdz_trim_len(kdz, i);
+
+
+		if(verbose>=3) fprintf(stderr,
+"DEBUG: discarding %lu bytes (%lu blocks) at %lu (block %lu)\n", range[1],
+range[1]/blksz, range[0], range[0]/blksz);
+		else {
+			putchar('*');
+			fflush(stdout);
+		}
+
+		if(planning) {
+			if(range[1]>0&&range[1]<((uint64_t)1<<40)) {
+				pe.rec.trim_off=range[0];
+				pe.rec.trim_len=range[1];
+			} else pe.rec.trim_off=pe.rec.trim_len=0;
+
+			if(!write_kdzfile_plan(&pe)) goto abort;
+		}
+
+		/* do the deed, in the background if possible */
+		if(!kdz_wr_trim(&w, range[0], range[1])) goto abort;
+	}
+
+	if(!kdz_wr_release(&w)) goto abort;
+	kdz_wr_free(&w);
+
+	/* discards are advisory, failures were already noted */
+	discard_close(dsc, verbose>=1?slice_name:NULL);
+	dsc=NULL;
+
+	if(io) for(n=0; n<2; ++n) if(!kdz_io_wait(io, &wb[n].wr)) {
+		fprintf(stderr, "Write to \"%s\" failed: %s\n", slice_name,
+strerror(errno));
+		goto abort;
+	}
+
+	if((errno=kdz_pace_finish(&pace))) {
+		fprintf(stderr, "Writeback of \"%s\" failed: %s\n", slice_name,
+strerror(errno));
+		goto abort;
+	}
+
+	/* O_DIRECT only skipped the page cache, the device may still cache */
+	if(wflags&(KDZ_WRITE_DIRECT|KDZ_WRITE_SYNC)&&!simulate&&
+kdz_fsync(fd)<0) {
+		fprintf(stderr, "Flushing \"%s\" failed: %s\n", slice_name,
+strerror(errno));
+		goto abort;
+	}
+
+	if(jpend&&!write_kdzfile_commit(io, wb, fd, jpend, &jcount)) {
+		fprintf(stderr, "Flushing \"%s\" failed: %s\n", slice_name,
+strerror(errno));
+		goto abort;
+	}
+	free(jpend);
+
+	kdz_io_close(io);
+	kdz_ring_close(ring);
+	if(rfd>=0) close(rfd);
+	if(fd>=0) close(fd);
+	for(n=0; n<2; ++n) {
+		free(wb[n].out);
+		free(wb[n].in);
+		free(wb[n].dev);
+	}
+	kdz_devbuf_free(&db);
+
+	/* later slices on the device must see the new GPT */
+	if(!simulate&&kdz_slice_class(kdz, slice_name)==KDZ_SLICE_GPT)
+		kdz_devgpt_forget(kdz, dev);
+
+	if(verbose<3) putchar('\n');
+
+	if(verbose>=1) kdz_devread_report();
+
+	if(fsmap) {
+		if(verbose>=1) printf(
+"Left %llu differing blocks alone, free in the filesystem\n", (unsigned long long)unused);
+		free(fsmap);
+	}
+
+	if(unit&&kdz_write_amp&&verbose>=1) printf(
+"Differing: %llu bytes in %u runs, widened to %zu byte units: %llu bytes in %u runs\n",
+(unsigned long long)rawbytes, rawruns, unit, (unsigned long long)widebytes,
+wideruns);
+
+	if(zeroops&&verbose>=1) printf("Zeroed %llu blocks with %u %s\n",
+(unsigned long long)zeroblks, zeroops, w.zero==KDZ_ZERO_DISCARD?"discards":
+w.zero==KDZ_ZERO_PUNCH?"punched holes":"BLKZEROOUTs");
+
+	return 1;
+
+abort:
+	unpackchunk_free(ctx, true);
+
+	kdz_pace_finish(&pace);
+
+	kdz_wr_free(&w);
+	discard_close(dsc, NULL);
+
+	/* nothing may still be using the buffers */
+	kdz_io_close(io);
+	kdz_ring_close(ring);
+	if(rfd>=0) close(rfd);
+	if(fd>=0) close(fd);
+	for(n=0; n<2; ++n) {
+		free(wb[n].out);
+		free(wb[n].in);
+		free(wb[n].dev);
+	}
+	kdz_devbuf_free(&db);
+	if(fsmap) free(fsmap);
+	free(jpend);
+	free(pe.runs);
+
+	if(!simulate&&kdz_slice_class(kdz, slice_name)==KDZ_SLICE_GPT)
+		kdz_devgpt_forget(kdz, dev);
+
+	if(verbose<3) putchar('\n');
+
+	return 0;
+}
+
+
+/* one device's queue for write_kdzfiles() */
+struct write_kdzfiles_dev {
+	const struct kdz_file *kdz;
+	const char *const *slice_names;
+	int *results;
+	unsigned *order;	/* indices of this device's slices, by address */
+	unsigned count;
+	unsigned flags;
+	pthread_t thread;
+};
+
+/* first device address of the slice's data, for ordering */
+static uint64_t write_kdzfiles_addr(const struct kdz_file *kdz,
+const char *slice_name, int *dev)
+{
+	unsigned i;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(!strcmp(slice_name, kdz->chunks[i].dz.slice_name)) {
+			*dev=kdz->chunks[i].dz.device;
+			return kdz->chunks[i].dz.target_addr;
+		}
+
+	*dev=-1;
+	return 0;
+}
+
+static void *write_kdzfiles_thread(void *opaque)
+{
+	struct write_kdzfiles_dev *const q=opaque;
+	unsigned i;
+
+	for(i=0; i<q->count; ++i) q->results[q->order[i]]=
+write_kdzfile(q->kdz, q->slice_names[q->order[i]], q->flags);
+
+	return NULL;
+}
+
+bool write_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], int results[], unsigned count,
+unsigned flags)
+{
+	struct write_kdzfiles_dev *q;
+	uint64_t *addr=NULL;
+	int *devs=NULL;
+	unsigned *order=NULL;
+	unsigned i, j, nq=0;
+	long cpus;
+	bool ret=true;
+
+	if(!(q=calloc(kdz->max_device+1, sizeof(q[0])))||
+!(addr=malloc(sizeof(addr[0])*count))||!(devs=malloc(sizeof(devs[0])*count))||
+!(order=malloc(sizeof(order[0])*count))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		free(q);
+		free(addr);
+		free(devs);
+		free(order);
+		return false;
+	}
+
+	for(i=0; i<count; ++i) {
+		addr[i]=write_kdzfiles_addr(kdz, slice_names[i], devs+i);
+		results[i]=0;
+	}
+
+	/* group by device, ordered by address within each */
+	for(j=0; j<=kdz->max_device; ++j) {
+		q[j].kdz=kdz;
+		q[j].slice_names=slice_names;
+		q[j].results=results;
+		q[j].order=order+nq;
+		q[j].flags=flags;
+
+		for(i=0; i<count; ++i) if(devs[i]==(int)j) {
+			unsigned k=q[j].count++;
+
+			for(; k>0&&addr[q[j].order[k-1]]>addr[i]; --k)
+				q[j].order[k]=q[j].order[k-1];
+			q[j].order[k]=i;
+		}
+		nq+=q[j].count;
+	}
+
+	for(i=0; i<count; ++i) if(devs[i]<0)
+		fprintf(stderr, "Slice \"%s\" not found in KDZ file\n",
+slice_names[i]);
+
+	/* the decode pool, each thread needs one to get anywhere */
+	if((cpus=sysconf(_SC_NPROCESSORS_ONLN))<1) cpus=1;
+	pthread_mutex_lock(&kdz_decode.lock);
+	kdz_decode.avail=cpus;
+	kdz_decode.limited=true;
+	pthread_mutex_unlock(&kdz_decode.lock);
+
+	for(j=0; j<=kdz->max_device; ++j) {
+		int err;
+
+		if(!q[j].count) continue;
+
+		if((err=pthread_create(&q[j].thread, NULL, write_kdzfiles_thread,
+q+j))) {
+			if(verbose>=1) fprintf(stderr,
+"Failed to start thread for sd%c (%s), writing it directly\n", 'a'+j,
+strerror(err));
+			write_kdzfiles_thread(q+j);
+			q[j].count=0;
+		}
+	}
+
+	for(j=0; j<=kdz->max_device; ++j)
+		if(q[j].count) pthread_join(q[j].thread, NULL);
+
+	pthread_mutex_lock(&kdz_decode.lock);
+	kdz_decode.limited=false;
+	pthread_mutex_unlock(&kdz_decode.lock);
+
+	/* read back only once everything is written, all devices together */
+	if(flags&KDZ_WRITE_VERIFY&&!(flags&KDZ_WRITE_SIMULATE))
+		verify_kdzfiles(kdz, slice_names, results, count);
+
+	for(i=0; i<count; ++i) if(!results[i]) ret=false;
+
+	free(q);
+	free(addr);
+	free(devs);
+	free(order);
+
+	return ret;
+}
+
+
+/* each slice of the KDZ once, those of the wanted classes (a bitmask of
+** 1<<class), in order of first appearance */
+static unsigned kdz_slice_list(const struct kdz_file *kdz, unsigned classes,
+const char *names[])
+{
+	unsigned i, j, count=0;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const char *const name=kdz->chunks[i].dz.slice_name;
+
+		for(j=1; j<i&&strcmp(name, kdz->chunks[j].dz.slice_name); ++j);
+		if(j<i||!(classes&1<<kdz_slice_class(kdz, name))) continue;
+
+		names[count++]=name;
+	}
+
+	return count;
+}
+
+bool restore_kdzfiles(const struct kdz_file *kdz, unsigned flags)
+{
+	const char **names;
+	int *results;
+	unsigned first, second, i;
+	bool ret, bakfail=false;
+
+	if(!(names=malloc(sizeof(names[0])*kdz->dz_file.chunk_count))||
+!(results=malloc(sizeof(results[0])*kdz->dz_file.chunk_count))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		free(names);
+		return false;
+	}
+
+	/* backups go first, so an interruption leaves the old or the new
+	** bootloader whole; bulk slices keep the other devices busy meanwhile */
+	first=kdz_slice_list(kdz, 1<<KDZ_SLICE_BACKUP|1<<KDZ_SLICE_BULK, names);
+	second=kdz_slice_list(kdz, 1<<KDZ_SLICE_BOOT, names+first);
+
+	if(verbose>=0) printf(
+"Restoring %u slices, then %u bootloader slices once their backups are done\n",
+first, second);
+
+	/* each slice is flushed as it finishes, so the order holds */
+	ret=!first||write_kdzfiles(kdz, names, results, first, flags|KDZ_WRITE_SYNC);
+
+	for(i=0; i<first; ++i) if(!results[i]) {
+		fprintf(stderr, "Failed while writing \"%s\"\n", names[i]);
+		if(kdz_slice_class(kdz, names[i])==KDZ_SLICE_BACKUP) bakfail=true;
+	}
+
+	if(bakfail) {
+		fprintf(stderr,
+"Backup bootloader slices failed, leaving the bootloader alone\n");
+		goto out;
+	}
+
+	if(second&&!write_kdzfiles(kdz, names+first, results+first, second,
+flags|KDZ_WRITE_SYNC)) {
+		for(i=first; i<first+second; ++i) if(!results[i])
+			fprintf(stderr, "Failed while writing \"%s\"\n", names[i]);
+		ret=false;
+	}
+
+out:
+	free(names);
+	free(results);
+
+	return ret;
+}
+
+/* indices of the slice's chunks, in order, returns how many */
+static unsigned kdz_slice_chunks(const struct kdz_file *kdz,
+const char *slice_name, unsigned chunks[])
+{
+	unsigned i, count=0;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(!strcmp(slice_name, kdz->chunks[i].dz.slice_name))
+			chunks[count++]=i;
+
+	return count;
+}
+
+/* bring the slice in line with the inflated chunks, flushing at the end */
+static bool bootloader_write(const struct kdz_file *kdz,
+struct kdz_devbuf *db, const char *slice_name, off64_t offset,
+const unsigned chunks[], char *const bufs[], unsigned count, bool simulate)
+{
+	const int dev=kdz->chunks[chunks[0]].dz.device;
+	const uint32_t blksz=kdz->devs[dev].blksz;
+	struct kdz_wr w;
+	off64_t base;
+	unsigned i;
+	int fd;
+
+	if((fd=kdz_open_slice(kdz, dev, slice_name, offset, simulate, &base))<0)
+		return false;
+
+	kdz_wr_init(&w, kdz, db, dev, slice_name, fd, offset, base, simulate);
+
+	for(i=0; i<count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[chunks[i]].dz;
+		const off64_t slicepos=(off64_t)dz->target_addr*blksz-offset;
+		const uint64_t tlen=kdz_trim_len(kdz, chunks[i]);
+		const char *devmap;
+
+		if(!(devmap=kdz_devget(db, kdz, dev, (off64_t)dz->target_addr*blksz,
+dz->target_size))||
+!kdz_wr_range(&w, bufs[i], devmap, slicepos, dz->target_size)) goto abort;
+
+		/* the rest of the range gets discarded, unless it is zeros already */
+		if(!tlen||tlen>=(uint64_t)1<<40) continue;
+
+		if(!(devmap=kdz_devget(db, kdz, dev, (off64_t)dz->target_addr*blksz+
+dz->target_size, tlen))) goto abort;
+		if(kdz_blkzero(devmap, tlen)) continue;
+
+		if(!kdz_wr_trim(&w, slicepos+dz->target_size, tlen)) goto abort;
+	}
+
+	if(!kdz_wr_release(&w)) goto abort;
+	kdz_wr_free(&w);
+
+	/* nothing else happens until this is on the media */
+	if(!simulate&&kdz_fsync(fd)<0) {
+		fprintf(stderr, "Flushing \"%s\" failed: %s\n", slice_name,
+strerror(errno));
+		goto abort;
+	}
+	close(fd);
+
+	if(verbose>=0) printf(
+"%s: wrote %llu bytes, zeroed %llu, %llu already matched, discarded %llu%s\n",
+slice_name, (unsigned long long)w.wrote, (unsigned long long)w.zeroed,
+(unsigned long long)w.same, (unsigned long long)w.trimmed,
+simulate?" (simulated)":"");
+
+	return true;
+
+abort:
+	kdz_wr_free(&w);
+	close(fd);
+
+	return false;
+}
+
+bool bootloader_kdzfiles(const struct kdz_file *kdz, unsigned flags)
+{
+	const bool simulate=flags&KDZ_WRITE_SIMULATE;
+	struct kdz_devbuf db=KDZ_DEVBUF_INIT;
+	const char **names;
+	const char **done=NULL;
+	unsigned *pchunks=NULL, *bchunks=NULL;
+	char **pbufs=NULL, **bbufs=NULL;
+	int *results=NULL;
+	unsigned count, ndone=0, np=0, nb=0, i, k;
+	bool ret=false;
+
+	if(!(names=malloc(sizeof(names[0])*kdz->dz_file.chunk_count))||
+!(done=malloc(sizeof(done[0])*kdz->dz_file.chunk_count))||
+!(pchunks=malloc(sizeof(pchunks[0])*kdz->dz_file.chunk_count))||
+!(bchunks=malloc(sizeof(bchunks[0])*kdz->dz_file.chunk_count))||
+!(pbufs=calloc(kdz->dz_file.chunk_count, sizeof(pbufs[0])))||
+!(bbufs=calloc(kdz->dz_file.chunk_count, sizeof(bbufs[0])))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		goto abort;
+	}
+
+	count=kdz_slice_list(kdz, 1<<KDZ_SLICE_BOOT|1<<KDZ_SLICE_BACKUP, names);
+
+	for(i=0; i<count; ++i) {
+		const char *const name=names[i];
+		const size_t len=strlen(name);
+		char bak[sizeof(kdz->chunks[0].dz.slice_name)+4];
+		const char *primary=NULL;
+		off64_t poff=0, boff;
+		bool shared;
+
+		/* a backup with its primary present goes with the primary */
+		if(kdz_slice_class(kdz, name)==KDZ_SLICE_BACKUP) {
+			for(k=0; k<count; ++k) if(strlen(names[k])==len-3&&
+!strncmp(names[k], name, len-3)) break;
+			if(k<count) continue;
+			snprintf(bak, sizeof(bak), "%s", name);
+		} else {
+			snprintf(bak, sizeof(bak), "%sbak", name);
+			primary=name;
+		}
+
+		nb=kdz_slice_chunks(kdz, bak, bchunks);
+		np=primary?kdz_slice_chunks(kdz, primary, pchunks):0;
+
+		if(!(boff=kdz_slice_offset(kdz, kdz->chunks[bchunks[0]].dz.device,
+bak))||(primary&&!(poff=kdz_slice_offset(kdz,
+kdz->chunks[pchunks[0]].dz.device, primary)))) {
+			fprintf(stderr, "\"%s\" isn't on the device, leaving it alone\n",
+primary?primary:bak);
+			goto abort;
+		}
+
+		/* the copies are normally the same image, which is inflated once */
+		shared=np==nb;
+		for(k=0; shared&&k<nb; ++k) {
+			const struct dz_chunk *const p=&kdz->chunks[pchunks[k]].dz;
+			const struct dz_chunk *const b=&kdz->chunks[bchunks[k]].dz;
+			const uint32_t blksz=kdz->devs[p->device].blksz;
+
+			shared=p->target_size==b->target_size&&p->crc32==b->crc32&&
+!memcmp(p->md5, b->md5, sizeof(p->md5))&&p->trim_count==b->trim_count&&
+(off64_t)p->target_addr*blksz-poff==(off64_t)b->target_addr*blksz-boff;
+		}
+
+		/* test_kdzfile() may have inflated them already */
+		for(k=0; k<nb; ++k) if(!(bbufs[k]=kdz_kept_take(kdz, bchunks[k]))&&
+!(bbufs[k]=kdz_inflate_chunk(kdz, bchunks[k]))) goto abort;
+		for(k=0; k<np; ++k) {
+			pbufs[k]=kdz_kept_take(kdz, pchunks[k]);
+			if(shared) {
+				free(pbufs[k]);
+				pbufs[k]=bbufs[k];
+			} else if(!pbufs[k]&&
+!(pbufs[k]=kdz_inflate_chunk(kdz, pchunks[k]))) goto abort;
+		}
+
+		if(verbose>=1&&primary) printf("Writing \"%s\" then \"%s\"%s\n", bak,
+primary, shared?" from one image":"");
+
+		/* backup first, so there's always one whole copy */
+		if(!bootloader_write(kdz, &db, bak, boff, bchunks, bbufs, nb,
+simulate)) {
+			fprintf(stderr, "Failed while writing \"%s\"%s\n", bak,
+primary?", its primary is untouched":"");
+			goto abort;
+		}
+		done[ndone++]=kdz->chunks[bchunks[0]].dz.slice_name;
+
+		if(primary) {
+			if(!bootloader_write(kdz, &db, primary, poff, pchunks, pbufs, np,
+simulate)) {
+				fprintf(stderr,
+"Failed while writing \"%s\", its backup \"%s\" is whole\n", primary, bak);
+				goto abort;
+			}
+			done[ndone++]=primary;
+		}
+
+		for(k=0; k<np; ++k) {
+			if(pbufs[k]!=bbufs[k]) free(pbufs[k]);
+			pbufs[k]=NULL;
+		}
+		for(k=0; k<nb; ++k) {
+			free(bbufs[k]);
+			bbufs[k]=NULL;
+		}
+		np=nb=0;
+	}
+
+	ret=true;
+
+	/* read back everything written, all at once */
+	if(flags&KDZ_WRITE_VERIFY&&!simulate&&ndone) {
+		if(!(results=malloc(sizeof(results[0])*ndone))) {
+			fprintf(stderr, "Memory allocation failure!\n");
+			ret=false;
+		} else {
+			for(k=0; k<ndone; ++k) results[k]=1;
+			if(!verify_kdzfiles(kdz, done, results, ndone)) ret=false;
+			for(k=0; k<ndone; ++k) if(!results[k]) {
+				fprintf(stderr, "\"%s\" didn't read back correctly\n",
+done[k]);
+				ret=false;
+			}
+		}
+	}
+
+abort:
+	if(pbufs&&bbufs) for(k=0; k<np||k<nb; ++k) {
+		if(k<np&&pbufs[k]!=bbufs[k]) free(pbufs[k]);
+		if(k<nb) free(bbufs[k]);
+	}
+	kdz_devbuf_free(&db);
+	free(names);
+	free(done);
+	free(pchunks);
+	free(bchunks);
+	free(pbufs);
+	free(bbufs);
+	free(results);
+
+	return ret;
+}
+
+
+/* size of each read by verify_kdzfiles(), the CRCs of the pieces of a chunk
+** are joined with crc32_combine() */
+#define KDZ_VERIFY_PIECE (4<<20)
+
+struct verify_kdzfiles_piece {
+	unsigned chunk;
+	uint32_t off, len;	/* within the chunk's data */
+	uLong crc;
+};
+
+struct verify_kdzfiles_ctx {
+	const struct kdz_file *kdz;
+	const int *fds;		/* per device, O_DIRECT when allowed */
+	struct verify_kdzfiles_piece *piece;
+	unsigned npieces;
+	unsigned next;		/* next piece to take, taken atomically */
+	bool fail;
+};
+
+static void *verify_kdzfiles_thread(void *opaque)
+{
+	struct verify_kdzfiles_ctx *const v=opaque;
+	char *buf;
+	unsigned i;
+
+	if(posix_memalign((void **)&buf, 4096, KDZ_VERIFY_PIECE)) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		v->fail=true;
+		return NULL;
+	}
+
+	while((i=__atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED))<v->npieces) {
+		struct verify_kdzfiles_piece *const p=v->piece+i;
+		const struct dz_chunk *const dz=&v->kdz->chunks[p->chunk].dz;
+		const uint32_t blksz=v->kdz->devs[dz->device].blksz;
+		const size_t rlen=((size_t)p->len+blksz-1)/blksz*blksz;
+		const off64_t off=(off64_t)dz->target_addr*blksz+p->off;
+		const int fd=v->fds[dz->device];
+		size_t cnt;
+
+		for(cnt=0; cnt<rlen; ) {
+			const ssize_t r=pread64(fd, buf+cnt, rlen-cnt, off+cnt);
+
+			if(r>0) {
+				cnt+=r;
+				continue;
+			}
+			if(r<0&&errno==EINTR) continue;
+
+			/* the descriptor is shared, another thread may have been first */
+			if(r<0&&errno==EINVAL&&fcntl(fd, F_GETFL)&O_DIRECT) {
+				if(verbose>=0) fprintf(stderr,
+"O_DIRECT read refused, verifying through the page cache\n");
+				if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)&~O_DIRECT)<0) break;
+				continue;
+			}
+
+			fprintf(stderr, "Failed reading back sd%c: %s\n",
+'a'+dz->device, r<0?strerror(errno):"short read");
+			break;
+		}
+		if(cnt<rlen) {
+			v->fail=true;
+			break;
+		}
+
+		p->crc=crc32(crc32(0, Z_NULL, 0), (Bytef *)buf, p->len);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+bool verify_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], int results[], unsigned count)
+{
+	struct verify_kdzfiles_ctx v={kdz, NULL, NULL, 0, 0, false};
+	pthread_t *threads=NULL;
+	int *fds=NULL;
+	struct timespec start, end;
+	uint64_t bytes=0;
+	unsigned i, j, nthreads=0;
+	long cpus;
+	bool checked=false, ret=false;
+
+	if(!(fds=malloc(sizeof(fds[0])*(kdz->max_device+1)))) goto nomem;
+	for(j=0; j<=kdz->max_device; ++j) fds[j]=-1;
+	v.fds=fds;
+
+	/* split the chunks of the slices still in good standing */
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		uint32_t off;
+
+		for(j=0; j<count; ++j)
+			if(results[j]&&!strcmp(slice_names[j], dz->slice_name)) break;
+		if(j==count) continue;
+
+		if(fds[dz->device]<0) {
+			if((fds[dz->device]=open_device(kdz, dz->device,
+O_RDONLY|O_DIRECT))<0&&errno==EINVAL) {
+				if(verbose>=0) fprintf(stderr,
+"O_DIRECT refused for sd%c, verifying through the page cache\n",
+'a'+dz->device);
+				fds[dz->device]=open_device(kdz, dz->device, O_RDONLY);
+			}
+			if(fds[dz->device]<0) {
+				fprintf(stderr, "Failed to open sd%c for verification\n",
+'a'+dz->device);
+				goto abort;
+			}
+		}
+
+		for(off=0; off<dz->target_size; off+=KDZ_VERIFY_PIECE) {
+			struct verify_kdzfiles_piece *p;
+
+			if(!(v.npieces&0xFF)) {
+				if(!(p=realloc(v.piece, sizeof(p[0])*(v.npieces+0x100))))
+					goto nomem;
+				v.piece=p;
+			}
+			p=v.piece+v.npieces++;
+			p->chunk=i;
+			p->off=off;
+			p->len=dz->target_size-off<KDZ_VERIFY_PIECE?
+dz->target_size-off:KDZ_VERIFY_PIECE;
+		}
+		bytes+=dz->target_size;
+	}
+
+	/* chunks and devices are mixed in the queue, all get read at once */
+	if((cpus=sysconf(_SC_NPROCESSORS_ONLN))<1) cpus=1;
+	if(cpus>v.npieces) cpus=v.npieces?v.npieces:1;
+	if(!(threads=malloc(sizeof(threads[0])*cpus))) goto nomem;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(; nthreads<cpus; ++nthreads) {
+		int err;
+
+		if((err=pthread_create(threads+nthreads, NULL,
+verify_kdzfiles_thread, &v))) {
+			if(verbose>=1) fprintf(stderr,
+"Failed to start verification thread: %s\n", strerror(err));
+			break;
+		}
+	}
+	/* none started, do it here */
+	if(!nthreads) verify_kdzfiles_thread(&v);
+	for(j=0; j<nthreads; ++j) pthread_join(threads[j], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(v.fail) goto abort;
+
+	/* pieces are in chunk order, join each chunk's and compare */
+	for(i=0; i<v.npieces; ) {
+		const unsigned chunk=v.piece[i].chunk;
+		const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+		uLong crc=v.piece[i].crc;
+
+		for(++i; i<v.npieces&&v.piece[i].chunk==chunk; ++i)
+			crc=crc32_combine(crc, v.piece[i].crc, v.piece[i].len);
+
+		if(crc==le32toh(dz->crc32)) continue;
+
+		fprintf(stderr, "Verification of \"%s\" failed, chunk \"%s\" differs\n",
+dz->slice_name, dz->chunk_name);
+		/* resuming mustn't pass over it */
+		kdz_journal_forget(kdz_journal, chunk);
+		for(j=0; j<count; ++j)
+			if(!strcmp(slice_names[j], dz->slice_name)) results[j]=0;
+	}
+
+	checked=true;
+
+	if(verbose>=1) {
+		const double secs=(end.tv_sec-start.tv_sec)+
+(end.tv_nsec-start.tv_nsec)/1e9;
+
+		printf("Verified %llu bytes with %u threads in %.2f seconds\n",
+(unsigned long long)bytes, nthreads?nthreads:1, secs);
+	}
+
+	ret=true;
+	for(j=0; j<count; ++j) if(!results[j]) ret=false;
+
+	goto abort;
+
+nomem:
+	fprintf(stderr, "Memory allocation failure!\n");
+
+abort:
+	/* unable to tell, so nothing passes */
+	if(!checked) for(j=0; j<count; ++j) results[j]=0;
+
+	if(fds) for(j=0; j<=kdz->max_device; ++j) if(fds[j]>=0) close(fds[j]);
+	free(fds);
+	free(v.piece);
+	free(threads);
+
+	return ret;
+}
+
+
+static int plan_kdzfiles_order(const void *_a, const void *_b)
+{
+	const struct kdz_planent *const a=_a, *const b=_b;
+
+	return a->rec.chunk<b->rec.chunk?-1:a->rec.chunk>b->rec.chunk;
+}
+
+bool plan_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], unsigned count, unsigned flags,
+const char *filename)
+{
+	struct kdz_plan_head head;
+	struct kdz_planent *ent;
+	unsigned nent, i, j, k;
+	int *results;
+	int fd=-1;
+	bool ret=false;
+
+	if(!(results=malloc(sizeof(results[0])*count))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		return false;
+	}
+
+	pthread_mutex_lock(&kdz_planrec.lock);
+	kdz_planrec.active=true;
+	pthread_mutex_unlock(&kdz_planrec.lock);
+
+	ret=write_kdzfiles(kdz, slice_names, results, count,
+flags|KDZ_WRITE_SIMULATE);
+
+	pthread_mutex_lock(&kdz_planrec.lock);
+	kdz_planrec.active=false;
+	ent=kdz_planrec.ent;
+	nent=kdz_planrec.count;
+	kdz_planrec.ent=NULL;
+	kdz_planrec.count=0;
+	pthread_mutex_unlock(&kdz_planrec.lock);
+
+	free(results);
+
+	if(!ret) {
+		fprintf(stderr, "Simulation failed, no plan saved\n");
+		goto abort;
+	}
+	ret=false;
+
+	qsort(ent, nent, sizeof(ent[0]), plan_kdzfiles_order);
+
+	if((fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, 0644))<0) {
+		fprintf(stderr, "Failed to create \"%s\": %s\n", filename,
+strerror(errno));
+		goto abort;
+	}
+
+	memcpy(head.magic, kdz_plan_magic, KDZ_PLAN_MAGIC_LEN);
+	head.version=htole32(1);
+	head.count=htole32(nent);
+	memcpy(head.md5, kdz->dz_file.md5, sizeof(head.md5));
+
+	if(write(fd, &head, sizeof(head))!=sizeof(head)) goto abort_io;
+
+	for(i=0; i<nent; ++i) {
+		struct kdz_plan_chunk rec=ent[i].rec;
+
+		rec.chunk=htole32(rec.chunk);
+		rec.devcrc=htole32(rec.devcrc);
+		rec.start=htole64(rec.start);
+		rec.trim_off=htole64(rec.trim_off);
+		rec.trim_len=htole64(rec.trim_len);
+		rec.nruns=htole32(rec.nruns);
+		rec.reserved=0;
+		if(write(fd, &rec, sizeof(rec))!=sizeof(rec)) goto abort_io;
+
+		for(j=0; j<ent[i].rec.nruns; ++j) {
+			struct kdz_plan_run run=ent[i].runs[j];
+
+			run.off=htole64(run.off);
+			run.len=htole32(run.len);
+			run.zero=htole32(run.zero);
+			if(write(fd, &run, sizeof(run))!=sizeof(run)) goto abort_io;
+		}
+	}
+
+	if(close(fd)) {
+		fd=-1;
+		goto abort_io;
+	}
+	fd=-1;
+
+	/* the point of planning, what the write will cost */
+	if(verbose>=0) for(k=0; k<count; ++k) {
+		uint64_t wbytes=0, zbytes=0, tbytes=0;
+		unsigned wruns=0, inflate=0, chunks=0;
+
+		for(i=0; i<nent; ++i) {
+			bool data=false;
+
+			if(strcmp(slice_names[k],
+kdz->chunks[ent[i].rec.chunk].dz.slice_name)) continue;
+
+			++chunks;
+			tbytes+=ent[i].rec.trim_len;
+			for(j=0; j<ent[i].rec.nruns; ++j) {
+				if(ent[i].runs[j].zero) zbytes+=ent[i].runs[j].len;
+				else {
+					wbytes+=ent[i].runs[j].len;
+					++wruns;
+					data=true;
+				}
+			}
+			if(data) ++inflate;
+		}
+
+		printf(
+"Plan for %s: write %llu bytes in %u runs, zero %llu bytes, discard %llu bytes;\n"
+"  %u of %u chunks to decompress\n", slice_names[k],
+(unsigned long long)wbytes, wruns, (unsigned long long)zbytes,
+(unsigned long long)tbytes, inflate, chunks);
+	}
+
+	if(verbose>=1) fprintf(stderr, "Saved plan of %u chunks as \"%s\"\n",
+nent, filename);
+
+	ret=true;
+	goto abort;
+
+abort_io:
+	fprintf(stderr, "Failed while writing \"%s\": %s\n", filename,
+strerror(errno));
+	close(fd);
+	fd=-1;
+	unlink(filename);
+abort:
+	for(i=0; i<nent; ++i) free(ent[i].runs);
+	free(ent);
+
+	return ret;
+}
+
+
+/* load a plan, checking it fits the KDZ file */
+static struct kdz_planent *exec_kdzplan_load(const struct kdz_file *kdz,
+const char *filename, unsigned *count)
+{
+	struct kdz_plan_head head;
+	struct kdz_planent *ent=NULL;
+	uint32_t n=0, i, j, last=0;
+	int fd;
+
+	if((fd=open(filename, O_RDONLY|O_LARGEFILE))<0) {
+		fprintf(stderr, "Unable to open plan \"%s\": %s\n", filename,
+strerror(errno));
+		return NULL;
+	}
+
+	if(read(fd, &head, sizeof(head))!=sizeof(head)||
+memcmp(head.magic, kdz_plan_magic, KDZ_PLAN_MAGIC_LEN)||
+le32toh(head.version)!=1) {
+		fprintf(stderr, "\"%s\" is not a usable plan\n", filename);
+		goto abort;
+	}
+
+	if(memcmp(head.md5, kdz->dz_file.md5, sizeof(head.md5))) {
+		fprintf(stderr, "Plan \"%s\" is for a different KDZ file\n",
+filename);
+		goto abort;
+	}
+
+	if((n=le32toh(head.count))>kdz->dz_file.chunk_count) {
+		n=0;
+		goto bad;
+	}
+
+	if(!(ent=calloc(n?n:1, sizeof(ent[0])))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		goto abort;
+	}
+
+	for(i=0; i<n; ++i) {
+		struct kdz_plan_chunk *const rec=&ent[i].rec;
+		const struct dz_chunk *dz;
+		uint64_t area, areaend, trimend;
+		uint32_t blksz;
+
+		if(read(fd, rec, sizeof(*rec))!=sizeof(*rec)) goto bad;
+
+		rec->chunk=le32toh(rec->chunk);
+		rec->devcrc=le32toh(rec->devcrc);
+		rec->start=le64toh(rec->start);
+		rec->trim_off=le64toh(rec->trim_off);
+		rec->trim_len=le64toh(rec->trim_len);
+		rec->nruns=le32toh(rec->nruns);
+
+		if(rec->chunk<=last||rec->chunk>kdz->dz_file.chunk_count) goto bad;
+		last=rec->chunk;
+
+		/* everything has to stay within the chunk's own area */
+		dz=&kdz->chunks[rec->chunk].dz;
+		blksz=kdz->devs[dz->device].blksz;
+		area=(uint64_t)dz->target_addr*blksz;
+		if(area<rec->start) goto bad;
+		area-=rec->start;
+		areaend=area+dz->target_size;
+		trimend=area+(uint64_t)dz->trim_count*blksz;
+
+		if(rec->nruns>dz->target_size/blksz+1||(rec->trim_len&&
+(rec->trim_off<areaend||rec->trim_off+rec->trim_len>trimend))) goto bad;
+
+		if(!(ent[i].runs=malloc(sizeof(ent[i].runs[0])*(rec->nruns+1))))
+			goto bad;
+
+		for(j=0; j<rec->nruns; ++j) {
+			struct kdz_plan_run *const run=ent[i].runs+j;
+
+			if(read(fd, run, sizeof(*run))!=sizeof(*run)) goto bad;
+
+			run->off=le64toh(run->off);
+			run->len=le32toh(run->len);
+			run->zero=le32toh(run->zero);
+
+			if(run->off<area||run->off+run->len>areaend) goto bad;
+		}
+	}
+
+	close(fd);
+
+	*count=n;
+	return ent;
+
+bad:
+	fprintf(stderr, "Plan \"%s\" is corrupt\n", filename);
+abort:
+	if(ent) for(i=0; i<n; ++i) free(ent[i].runs);
+	free(ent);
+	close(fd);
+
+	return NULL;
+}
+
+/* inflate a chunk's data, if it hasn't been already */
+static bool exec_kdzplan_inflate(const struct kdz_file *kdz, unsigned chunk,
+char **out, size_t *outsz, bool *inflated)
+{
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+
+	if(*inflated) return true;
+
+	if(!write_kdzfile_grow(out, outsz, dz->target_size)) return false;
+
+	if(!unpackchunk_alloc(ctx, kdz, chunk)||
+unpackchunk(ctx, *out, dz->target_size)!=dz->target_size||
+!unpackchunk_free(ctx, false)) {
+		unpackchunk_free(ctx, true);
+		fprintf(stderr, "Failed to decompress chunk %u\n", chunk);
+		return false;
+	}
+
+	*inflated=true;
+	return true;
+}
+
+int exec_kdzplan_writes(const struct kdz_file *kdz, const char *filename,
+const char *slice_name)
+{
+	struct kdz_planent *ent;
+	unsigned count, i;
+	int ret=0;
+
+	if(!(ent=exec_kdzplan_load(kdz, filename, &count))) return -1;
+
+	for(i=0; i<count; ++i) {
+		if(strcmp(kdz->chunks[ent[i].rec.chunk].dz.slice_name, slice_name))
+			continue;
+		if(ent[i].rec.nruns||ent[i].rec.trim_len) ret=1;
+	}
+
+	for(i=0; i<count; ++i) free(ent[i].runs);
+	free(ent);
+
+	return ret;
+}
+
+bool exec_kdzplan(const struct kdz_file *kdz, const char *filename,
+unsigned flags)
+{
+	const bool simulate=flags&KDZ_WRITE_SIMULATE;
+	struct kdz_planent *ent;
+	struct kdz_devbuf db=KDZ_DEVBUF_INIT;
+	struct discard *dsc=NULL;
+	const char *slice_name=NULL;
+	char *out=NULL;
+	size_t outsz=0;
+	struct kdz_wr w;
+	uint64_t wbytes=0, zbytes=0;
+	unsigned count, i, j, inflates=0, wrote=0, zeroed=0;
+	bool ret=false;
+	int fd=-1;
+	off64_t base=0;
+
+	memset(&w, 0, sizeof(w));
+
+	if(!(ent=exec_kdzplan_load(kdz, filename, &count))) return false;
+
+	/* nothing gets written unless all of it still applies */
+	for(i=0; i<count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[ent[i].rec.chunk].dz;
+		const uint32_t blksz=kdz->devs[dz->device].blksz;
+		const char *devmap;
+
+		if(!slice_name||strcmp(slice_name, dz->slice_name)) {
+			slice_name=dz->slice_name;
+			if(kdz_slice_offset(kdz, dz->device, slice_name)!=
+(off64_t)ent[i].rec.start) {
+				fprintf(stderr, "\"%s\" has moved since the plan was made\n",
+slice_name);
+				goto abort;
+			}
 		}
 
-		cur=0;
+		if(!(devmap=kdz_devget(&db, kdz, dz->device,
+(off64_t)dz->target_addr*blksz, dz->target_size))) goto abort;
 
-		while(cur<dz->target_size) {
-			if(unpackchunk(ctx, buf, bufsz)!=bufsz)
-				goto abort_block;
+		if(crc32(crc32(0, Z_NULL, 0), (Bytef *)devmap, dz->target_size)!=
+ent[i].rec.devcrc) {
+			fprintf(stderr,
+"\"%s\" has changed since the plan was made, make a new plan\n", slice_name);
+			goto abort;
+		}
+	}
+
+	slice_name=NULL;
+
+	for(i=0; i<count; ++i) {
+		const struct kdz_plan_chunk *const rec=&ent[i].rec;
+		const struct dz_chunk *const dz=&kdz->chunks[rec->chunk].dz;
+		const uint32_t blksz=kdz->devs[dz->device].blksz;
+		const uint64_t area=(uint64_t)dz->target_addr*blksz-rec->start;
+		bool inflated=false;
+
+		/* the plan is in chunk order, so each slice's are together */
+		if(!slice_name||strcmp(slice_name, dz->slice_name)) {
+			if(fd>=0) {
+				if(!kdz_wr_release(&w)) goto abort;
+				kdz_wr_free(&w);
+				discard_close(dsc, verbose>=1?slice_name:NULL);
+				dsc=NULL;
+				if(!simulate&&kdz_fsync(fd)<0) goto abort_write;
+				close(fd);
+				fd=-1;
+				if(verbose<3) putchar('\n');
+			}
 
-			if(memcmp(map+dz->target_addr*blksz+cur, buf, blksz))
-				++mismatch;
+			slice_name=dz->slice_name;
+			if(verbose>=0) printf("Executing plan for %s%s\n", slice_name,
+simulate?" (simulated)":"");
 
-			cur+=blksz;
+			if((fd=kdz_open_slice(kdz, dz->device, slice_name, rec->start,
+simulate, &base))<0) goto abort;
+
+			kdz_wr_init(&w, kdz, &db, dz->device, slice_name, fd, rec->start,
+base, simulate);
+			if(!simulate&&!(dsc=discard_open(fd))&&verbose>=1) fprintf(stderr,
+"Unable to discard in the background, discarding synchronously\n");
+			w.dsc=dsc;
+			if(flags&KDZ_WRITE_DIRECT&&!simulate)
+				w.direct=kdz_setdirect(fd, blksz, &w.iosz);
 		}
 
-		if(!unpackchunk_free(ctx, false))
-			++mismatch; /* not exactly, but sort of */
+		for(j=0; j<rec->nruns; ++j) {
+			const struct kdz_plan_run *const run=ent[i].runs+j;
 
-		if(mismatch)
-			fmt="Chunk %1$d(%2$s): %7$d of %3$ld blocks mismatched (%4$lu-%5$lu,trim=%6$lu)\n";
-		else
-			fmt="Chunk %d(%s): all %ld blocks matched (%lu-%lu,trim=%lu)\n";
-		printf(fmt, i, dz->slice_name, dz->target_size/blksz,
-dz->target_addr, dz->target_addr+dz->trim_count, dz->trim_count, mismatch);
+			if(!kdz_wr_save(&w, NULL, run->off, run->len)) goto abort;
 
-	abort_block:
-		unpackchunk_free(ctx, true);
+			if(run->zero&&kdz_wr_zero(&w, run->off, run->len)) {
+				write_kdzfile_progress(&zeroed, run->len/blksz, '0');
+				zbytes+=run->len;
+				continue;
+			}
+
+			/* zero runs are in the chunk's data too */
+			if(!inflated) ++inflates;
+			if(!exec_kdzplan_inflate(kdz, rec->chunk, &out, &outsz, &inflated))
+				goto abort;
+
+			write_kdzfile_progress(&wrote, run->len/blksz, 'o');
+			wbytes+=run->len;
+
+			if(!kdz_wr_write(&w, out+run->off-area, run->off, run->len))
+				goto abort;
+		}
+
+		if(!rec->trim_len) continue;
+
+		if(!kdz_wr_trim(&w, rec->trim_off, rec->trim_len)) goto abort;
+
+		if(verbose<3) {
+			putchar('*');
+			fflush(stdout);
+		}
 	}
 
-	free(buf);
+	if(fd>=0) {
+		if(!kdz_wr_release(&w)) goto abort;
+		kdz_wr_free(&w);
+		discard_close(dsc, verbose>=1?slice_name:NULL);
+		dsc=NULL;
+		if(!simulate&&kdz_fsync(fd)<0) goto abort_write;
+		if(verbose<3) putchar('\n');
+	}
 
-	return 0;
+	if(verbose>=0) printf(
+"Plan executed: wrote %llu bytes, zeroed %llu bytes, decompressed %u of %u chunks%s\n",
+(unsigned long long)wbytes, (unsigned long long)zbytes, inflates, count,
+simulate?" (simulated)":"");
 
-abort:
-	if(buf) free(buf);
+	ret=true;
+	goto abort;
 
-	unpackchunk_free(ctx, true);
+abort_write:
+	fprintf(stderr, "Write to \"%s\" failed: %s\n", slice_name,
+strerror(errno));
+abort:
+	kdz_wr_free(&w);
+	discard_close(dsc, NULL);
+	if(fd>=0) close(fd);
+	for(i=0; i<count; ++i) free(ent[i].runs);
+	free(ent);
+	free(out);
+	kdz_devbuf_free(&db);
 
-	return 128;
+	return ret;
 }
 
 
-bool fix_gpts(const struct kdz_file *kdz, const bool simulate)
+/* fewest blocks estimate_kdzfile() samples from a chunk */
+#define KDZ_ESTIMATE_MINBLKS 16
+/* guess at the write throughput, nothing gets written to measure it */
+#define KDZ_ESTIMATE_WRITE_MBPS 60
+
+/* one sampled chunk */
+struct estimate_chunk {
+	uint64_t blocks;	/* in the chunk */
+	uint64_t sampled;
+	uint64_t dirty;		/* of those sampled */
+};
+
+/* sample a chunk's blocks: the CRC32 of the device range settles it when the
+** range is unchanged, otherwise inflate up to the last sampled block */
+static bool estimate_kdzfile_chunk(const struct kdz_file *kdz,
+struct kdz_devbuf *db, unsigned chunk, double fraction,
+struct estimate_chunk *ec, double *inflsec, uint64_t *inflbytes,
+double *readsec, uint64_t *readbytes)
 {
-	int i, j;
-	int dev=-1;
 	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
-	size_t bufsz=4096;
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	const uint32_t blksz=kdz->devs[dz->device].blksz;
+	const kdz_blkdifffunc diff=kdz_blkdiffsel(blksz);
+	const size_t piece=kdz_devread_piece(blksz);
+	struct timespec start, end;
+	uint64_t *pick=NULL, m, k, pos=0;
+	const char *devmap;
 	char *buf=NULL;
-	struct gpt_data *gptkdz=NULL;
-	int fd;
-	unsigned long long opsz;
-	bool ret=true;
+	bool ret=false;
+
+	ec->blocks=(dz->target_size+blksz-1)/blksz;
+	ec->sampled=ec->dirty=0;
+	if(!ec->blocks) return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(!(devmap=kdz_devget(db, kdz, dz->device,
+(off64_t)dz->target_addr*blksz, dz->target_size))) return false;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*readsec+=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+	*readbytes+=dz->target_size;
+
+	/* fast path, nothing to write */
+	if(crc32(crc32(0, Z_NULL, 0), (Bytef *)devmap, dz->target_size)==
+le32toh(dz->crc32)) {
+		ec->sampled=ec->blocks;
+		return true;
+	}
 
-	if(!(buf=malloc(bufsz))) return false;
+	if((m=ec->blocks*fraction+0.5)<KDZ_ESTIMATE_MINBLKS)
+		m=KDZ_ESTIMATE_MINBLKS;
+	if(m>ec->blocks) m=ec->blocks;
 
-	if(access("/dev/block/bootdevice/by-name/cust", F_OK)<0) {
-		fprintf(stderr,
-"Cannot access /dev/block/bootdevice/by-name, assuming OP size of 0.\n");
-		opsz=0;
-	} else {
-		if(mkdir("/cust", 0777)<0) {
-			struct stat buf;
-			if(errno!=EEXIST) {
-				fprintf(stderr,
-"Failed to create /cust mount point: %s\n", strerror(errno));
-				goto abort;
-			}
-			if(stat("/cust", &buf)<0||!S_ISDIR(buf.st_mode)) {
-				fprintf(stderr,
-"Failed when creating /cust mount point, unable to continue\n");
-				goto abort;
+	/* selection sampling gives m distinct blocks, already in order */
+	if(!(pick=malloc(sizeof(pick[0])*m))||!(buf=malloc(piece))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		goto abort;
+	}
+	for(k=0; k<ec->blocks&&ec->sampled<m; ++k)
+		if(drand48()*(ec->blocks-k)<m-ec->sampled) pick[ec->sampled++]=k;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(!unpackchunk_alloc(ctx, kdz, chunk)) goto abort;
+
+	for(k=0; k<m; ) {
+		const int got=unpackchunk(ctx, buf, piece);
+
+		if(got<=0) goto abort;
+
+		for(; k<m&&pick[k]*blksz<pos+got; ++k) {
+			const size_t off=pick[k]*blksz-pos;
+			const size_t len=got-off<blksz?got-off:blksz;
+
+			if(len<blksz?memcmp(buf+off, devmap+pick[k]*blksz, len):
+diff(buf+off, devmap+pick[k]*blksz, blksz)) ++ec->dirty;
+		}
+		pos+=got;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*inflsec+=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+	*inflbytes+=pos;
+
+	ret=true;
+
+abort:
+	/* stopping early, so nothing to verify */
+	unpackchunk_free(ctx, true);
+	free(pick);
+	free(buf);
+
+	return ret;
+}
+
+bool estimate_kdzfile(const struct kdz_file *kdz, double fraction)
+{
+	struct kdz_devbuf db=KDZ_DEVBUF_INIT;
+	struct estimate_chunk *ec=NULL;
+	unsigned *idx=NULL;
+	double inflsec=0, readsec=0;
+	uint64_t inflbytes=0, readbytes=0;
+	double tot_est=0, tot_lo=0, tot_hi=0, tot_sec=0;
+	unsigned i, j;
+	bool ret=false;
+
+	if(fraction<=0||fraction>1) {
+		fprintf(stderr, "Sampling fraction must be more than 0 and at most 1\n");
+		return false;
+	}
+
+	if(!(ec=malloc(sizeof(ec[0])*(kdz->dz_file.chunk_count+1)))||
+!(idx=malloc(sizeof(idx[0])*(kdz->dz_file.chunk_count+1)))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		goto abort;
+	}
+
+	srand48(time(NULL)^getpid());
+
+	if(verbose>=0) printf("%-16s %10s %12s %27s %9s\n", "slice", "blocks",
+"est. dirty", "95% interval", "est. time");
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const char *const slice_name=kdz->chunks[i].dz.slice_name;
+		const uint32_t blksz=kdz->devs[kdz->chunks[i].dz.device].blksz;
+		unsigned nc=0, c=0, want;
+		uint64_t nblocks=0, sblocks=0;
+		double p, y, s2=0, within=0, half, lo, hi, z, wh, sec;
+
+		/* each slice once, at its first chunk */
+		for(j=1; j<i; ++j)
+			if(!strcmp(slice_name, kdz->chunks[j].dz.slice_name)) break;
+		if(j<i) continue;
+
+		for(j=i; j<=kdz->dz_file.chunk_count; ++j)
+			if(!strcmp(slice_name, kdz->chunks[j].dz.slice_name)) {
+				idx[nc++]=j;
+				nblocks+=(kdz->chunks[j].dz.target_size+blksz-1)/blksz;
 			}
-			/* this could mean we were run recently... */
-			umount("/cust");
+
+		/* two chunks at least, so their spread can be seen */
+		if((want=nc*fraction+0.5)<2) want=2;
+		if(want>nc) want=nc;
+
+		/* partial shuffle, the first want are the sample */
+		for(j=0; j<want; ++j) {
+			const unsigned r=j+drand48()*(nc-j);
+			const unsigned t=idx[j];
+
+			idx[j]=idx[r];
+			idx[r]=t;
 		}
 
-		if(mount("/dev/block/bootdevice/by-name/cust", "/cust",
-"ext4", MS_RDONLY, "discard")) {
-			fprintf(stderr,
-"Failed OP resize data retrieval: %s\n", strerror(errno));
+		for(j=0; j<want; ++j, ++c) if(!estimate_kdzfile_chunk(kdz, &db,
+idx[j], fraction, ec+j, &inflsec, &inflbytes, &readsec, &readbytes))
 			goto abort;
+
+		/* ratio estimate of the dirty proportion over the sampled chunks */
+		y=0;
+		for(j=0; j<c; ++j) {
+			y+=(double)ec[j].dirty*ec[j].blocks/(ec[j].sampled?ec[j].sampled:1);
+			sblocks+=ec[j].blocks;
 		}
+		p=sblocks?y/sblocks:0;
 
-		if((fd=open("/cust/official_op_resize.cfg",
-O_RDONLY|MS_NOATIME))<0) {
-			fprintf(stderr,
-"Unable to open official_op_resize.cfg: %s\n", strerror(errno));
-			umount("/cust");
-			goto abort;
+		/* between chunks (with finite population correction), then within */
+		for(j=0; c>1&&j<c; ++j) {
+			const double d=(double)ec[j].dirty*ec[j].blocks/
+(ec[j].sampled?ec[j].sampled:1)-p*ec[j].blocks;
+
+			s2+=d*d/(c-1);
 		}
+		for(j=0; j<c; ++j) {
+			const double n=ec[j].blocks, m=ec[j].sampled;
+			const double pc=m?ec[j].dirty/m:0;
 
-		if(read(fd, buf, bufsz)<0) {
-			fprintf(stderr,
-"Failed during read of official_op_resize.cfg: %s\n", strerror(errno));
-			opsz=0;
+			if(m>1&&m<n) within+=n*n*(1-m/n)*pc*(1-pc)/(m-1);
+		}
+		half=sblocks?1.96*sqrt((1-(double)c/nc)*s2*c/((double)sblocks*sblocks)+
+within/((double)sblocks*sblocks)):0;
+
+		/* the Wilson interval of the pooled blocks keeps a sample with no
+		** dirty blocks from claiming certainty */
+		for(j=0, z=0; j<c; ++j) z+=ec[j].sampled;
+		if(z&&z<nblocks) {
+			double d=0, ph, centre;
+
+			for(j=0; j<c; ++j) d+=ec[j].dirty;
+			ph=d/z;
+			centre=(ph+1.96*1.96/(2*z))/(1+1.96*1.96/z);
+			wh=1.96*sqrt(ph*(1-ph)/z+1.96*1.96/(4*z*z))/(1+1.96*1.96/z);
+			lo=p-half<centre-wh?p-half:centre-wh;
+			hi=p+half>centre+wh?p+half:centre+wh;
 		} else {
-			buf[bufsz-1]='\0';
+			lo=p-half;
+			hi=p+half;
+		}
+		if(lo<0) lo=0;
+		if(hi>1) hi=1;
+
+		/* a full write reads and inflates everything, writes what differs */
+		sec=(readsec>0?nblocks*blksz/(readbytes/readsec):0)+
+(inflsec>0?nblocks*blksz/(inflbytes/inflsec):0)+
+p*nblocks*blksz/(KDZ_ESTIMATE_WRITE_MBPS*1e6);
+
+		if(verbose>=0) printf("%-16s %10llu %12.0f %12.0f - %12.0f %8.1fs\n",
+slice_name, (unsigned long long)nblocks, p*nblocks, lo*nblocks, hi*nblocks,
+sec);
+		if(verbose>=1) printf(
+"  sampled %u of %u chunks, %.0f blocks\n", c, nc, z);
+
+		tot_est+=p*nblocks*blksz;
+		tot_lo+=lo*nblocks*blksz;
+		tot_hi+=hi*nblocks*blksz;
+		tot_sec+=sec;
+	}
 
-			i=strchr(buf, '=')-buf+1;
+	if(verbose>=0) printf(
+"Estimated rewrite: %.1f MB (%.1f - %.1f MB), about %.1f seconds assuming\n"
+"writes at %u MB/s\n", tot_est/1e6, tot_lo/1e6, tot_hi/1e6, tot_sec,
+KDZ_ESTIMATE_WRITE_MBPS);
 
-			opsz=strtoull(buf+i, NULL, 0);
-		}
+	ret=true;
 
-		if(verbose>=1) fprintf(stderr,
-"official_op_resize.cfg makes /OP %llu bytes\n", opsz);
+abort:
+	kdz_devbuf_free(&db);
+	free(ec);
+	free(idx);
 
-		close(fd);
-		umount("/cust");
+	return ret;
+}
+
+
+/* decoded chunks fanout_kdzfiles() can have in flight */
+#define KDZ_FANOUT_SLOTS 64
+/* most bytes of decoded chunks held, once the slowest target falls this far
+** behind the rest wait for it */
+#define KDZ_FANOUT_BUFFER ((size_t)256<<20)
+
+struct fanout_slot {
+	unsigned chunk;
+	char *buf;
+	unsigned refs;		/* targets yet to finish with it */
+};
+
+/* shared by the decoder and the target threads */
+struct fanout {
+	const struct kdz_file *kdz;
+	const char *const *slice_names;
+	off64_t *start;		/* of each slice, where the KDZ puts it */
+	unsigned count;
+	uint32_t blksz;		/* the KDZ's, whatever the targets' */
+	bool simulate;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fanout_slot slot[KDZ_FANOUT_SLOTS];
+	uint64_t head, tail;	/* oldest slot in use, next slot to fill */
+	size_t bytes;		/* decoded bytes held */
+	bool done;		/* nothing more is coming */
+	unsigned ntargets;
+};
+
+/* one device of a target set */
+struct fanout_dev {
+	int fd;
+	char *map;
+	off64_t len;
+	uint32_t blksz;
+	struct kdz_wr wr;	/* the whole device, positions are absolute */
+	char name[PATH_MAX];
+};
+
+struct fanout_target {
+	struct fanout *fo;
+	const char *pattern;
+	struct fanout_dev *devs;
+	off64_t *offset;	/* of each slice, 0 until looked up */
+	bool ok;
+	pthread_t thread;
+};
+
+static struct fanout_dev *fanout_dev(struct fanout_target *t, int dev)
+{
+	struct fanout_dev *const td=t->devs+dev;
+	const struct kdz_file *const kdz=t->fo->kdz;
+	int flags=(t->fo->simulate?O_RDONLY:O_RDWR)|O_LARGEFILE;
+	struct stat st;
+	uint32_t lbs;
+	void *map;
+
+	if(td->map) return td;
+
+	if(!kdz_devname(kdz, t->pattern, dev, td->name, sizeof(td->name)))
+		return NULL;
+
+	/* on Linux O_EXCL refuses a block device in use */
+	if(!t->fo->simulate&&stat(td->name, &st)==0&&S_ISBLK(st.st_mode))
+		flags|=O_EXCL;
+
+	if((td->fd=open(td->name, flags))<0) {
+		fprintf(stderr, errno==EBUSY?"\"%s\" in use, refusing to write\n":
+"Failed to open \"%s\": %s\n", td->name, strerror(errno));
+		return NULL;
+	}
+
+	/* the KDZ's addresses are in its blocks, the target's have to fit */
+	td->blksz=t->fo->blksz;
+	if(ioctl(td->fd, BLKSSZGET, &lbs)==0&&(!lbs||td->blksz%lbs)) {
+		fprintf(stderr, "\"%s\" has %u byte blocks, %u byte blocks needed\n",
+td->name, lbs, td->blksz);
+		close(td->fd);
+		td->fd=-1;
+		return NULL;
+	}
+
+	if((td->len=lseek(td->fd, 0, SEEK_END))<=0||(map=mmap(NULL, td->len,
+PROT_READ, MAP_SHARED, td->fd, 0))==MAP_FAILED) {
+		fprintf(stderr, "Failed to map \"%s\": %s\n", td->name,
+td->len<0?strerror(errno):"empty");
+		close(td->fd);
+		td->fd=-1;
+		return NULL;
+	}
+	td->map=map;
+
+	/* nothing to save, -F doesn't go with an undo log */
+	kdz_wr_init(&td->wr, kdz, NULL, dev, td->name, td->fd, 0, 0,
+t->fo->simulate);
+	td->wr.blksz=td->blksz;
+	td->wr.undo=false;
+	if(!t->fo->simulate) td->wr.dsc=discard_open(td->fd);
+
+	return td;
+}
+
+/* bring one target's copy of a chunk in line with buf */
+static bool fanout_chunk(struct fanout_target *t, unsigned chunk,
+const char *buf)
+{
+	const struct kdz_file *const kdz=t->fo->kdz;
+	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
+	struct fanout_dev *td;
+	off64_t base;
+	unsigned s;
+
+	if(!(td=fanout_dev(t, dz->device))) return false;
+
+	base=(off64_t)dz->target_addr*td->blksz;
+
+	if((uint64_t)base+(uint64_t)dz->trim_count*td->blksz>td->len) {
+		fprintf(stderr, "\"%s\" is too small for \"%s\"\n", td->name,
+dz->slice_name);
+		return false;
+	}
+
+	/* the target's own GPT has to agree about where the slice is */
+	for(s=0; strcmp(t->fo->slice_names[s], dz->slice_name); ++s);
+	if(!t->offset[s]&&!(t->offset[s]=kdz_slice_offset_map(td->map, td->len,
+td->blksz, td->name, dz->slice_name))) {
+		fprintf(stderr, "No \"%s\" slice on \"%s\"\n", dz->slice_name,
+td->name);
+		return false;
+	}
+	if(t->offset[s]!=t->fo->start[s]) {
+		fprintf(stderr, "\"%s\" on \"%s\" doesn't match the KDZ's layout\n",
+dz->slice_name, td->name);
+		return false;
+	}
+
+	/* the rest of the chunk's range is discarded, as write_kdzfile() */
+	return kdz_wr_range(&td->wr, buf, td->map+base, base, dz->target_size)&&
+kdz_wr_trim(&td->wr, base+dz->target_size, kdz_trim_len(kdz, chunk));
+}
+
+/* take every decoded chunk in turn, a failed target keeps taking them so
+** it doesn't hold up the rest */
+static void *fanout_thread(void *opaque)
+{
+	struct fanout_target *const t=opaque;
+	struct fanout *const fo=t->fo;
+	uint64_t seq;
+
+	for(seq=0; ; ++seq) {
+		struct fanout_slot *const sl=fo->slot+seq%KDZ_FANOUT_SLOTS;
+
+		pthread_mutex_lock(&fo->lock);
+		while(seq==fo->tail&&!fo->done)
+			pthread_cond_wait(&fo->cond, &fo->lock);
+		if(seq==fo->tail) {
+			pthread_mutex_unlock(&fo->lock);
+			break;
+		}
+		pthread_mutex_unlock(&fo->lock);
+
+		if(t->ok&&!fanout_chunk(t, sl->chunk, sl->buf)) t->ok=false;
+
+		/* everyone goes in order, so the last one out has the oldest */
+		pthread_mutex_lock(&fo->lock);
+		if(!--sl->refs) {
+			fo->bytes-=fo->kdz->chunks[sl->chunk].dz.target_size;
+			free(sl->buf);
+			sl->buf=NULL;
+			++fo->head;
+			pthread_cond_broadcast(&fo->cond);
+		}
+		pthread_mutex_unlock(&fo->lock);
 	}
 
+	return NULL;
+}
+
+/* where the KDZ puts slice_name, by its own GPT, failing that by the
+** slice's first chunk */
+static off64_t fanout_start(const struct kdz_file *kdz, struct unpackctx *ctx,
+const char *slice_name, uint32_t blksz)
+{
+	struct gpt_data *gpt;
+	off64_t ret=-1, off;
+	unsigned i;
+	int dev=-1;
 
 	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
 		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
-		uint32_t blksz;
-		struct gpt_buf gpt_buf;
 
-		if(strcmp(dz->slice_name, "PrimaryGPT")) continue;
+		if(strcmp(dz->slice_name, slice_name)) continue;
+		dev=dz->device;
+		if(ret<0||(off64_t)dz->target_addr*blksz<ret)
+			ret=(off64_t)dz->target_addr*blksz;
+	}
 
-		if((dev=open_device(kdz, dz->device, O_RDWR))<0) goto abort;
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(kdz->chunks[i].dz.device==dev&&
+!strcmp(kdz->chunks[i].dz.slice_name, "PrimaryGPT")) break;
 
-		blksz=kdz->devs[dz->device].blksz;
+	if(i<=kdz->dz_file.chunk_count&&(gpt=test_kdzfile_kdzgpt(kdz, ctx, i))) {
+		if((off=kdz_slice_offset_gpt(gpt, blksz, slice_name))) ret=off;
+		free(gpt);
+	}
+
+	return ret;
+}
+
+bool fanout_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], unsigned count,
+const char *const targets[], bool results[], unsigned ntargets,
+unsigned flags)
+{
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	struct fanout fo;
+	struct fanout_target *t;
+	unsigned i, j, started=0, decoded=0;
+	bool fed=true, ret=true;
+
+	memset(&fo, 0, sizeof(fo));
+	fo.kdz=kdz;
+	fo.slice_names=slice_names;
+	fo.count=count;
+	fo.blksz=(kdz->dz_file.flag_ufs&256)==256?4096:512;
+	fo.simulate=flags&KDZ_WRITE_SIMULATE;
+	fo.ntargets=ntargets;
+
+	for(i=0; i<ntargets; ++i) results[i]=false;
+
+	if(!(fo.start=malloc(sizeof(fo.start[0])*(count?count:1)))||
+!(t=calloc(ntargets, sizeof(t[0])))) {
+		fprintf(stderr, "Memory allocation failure!\n");
+		free(fo.start);
+		return false;
+	}
+
+	for(i=0; i<count; ++i)
+		fo.start[i]=fanout_start(kdz, ctx, slice_names[i], fo.blksz);
+
+	for(i=0; i<ntargets; ++i) {
+		t[i].fo=&fo;
+		t[i].pattern=targets[i];
+		t[i].ok=true;
+		if(!(t[i].devs=calloc(kdz->max_device+1, sizeof(t[i].devs[0])))||
+!(t[i].offset=calloc(count, sizeof(t[i].offset[0])))) {
+			fprintf(stderr, "Memory allocation failure!\n");
+			ret=false;
+			goto abort;
+		}
+		for(j=0; j<=kdz->max_device; ++j) t[i].devs[j].fd=-1;
+	}
+
+	pthread_mutex_init(&fo.lock, NULL);
+	pthread_cond_init(&fo.cond, NULL);
+
+	for(; started<ntargets; ++started) {
+		int err;
+
+		if((err=pthread_create(&t[started].thread, NULL, fanout_thread,
+t+started))) {
+			fprintf(stderr, "Failed to start thread: %s\n", strerror(err));
+			fed=false;
+			break;
+		}
+	}
 
+	/* every chunk is inflated and checked once, whatever the targets */
+	for(i=1; fed&&i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		struct fanout_slot *sl;
+		char *buf;
+
+		for(j=0; j<count&&strcmp(slice_names[j], dz->slice_name); ++j);
+		if(j==count) continue;
+
+		pthread_mutex_lock(&fo.lock);
+		while(fo.tail-fo.head==KDZ_FANOUT_SLOTS||
+(fo.bytes&&fo.bytes+dz->target_size>KDZ_FANOUT_BUFFER))
+			pthread_cond_wait(&fo.cond, &fo.lock);
+		pthread_mutex_unlock(&fo.lock);
+
+		if(!(buf=malloc(dz->target_size?dz->target_size:1))) {
+			fprintf(stderr, "Memory allocation failure!\n");
+			fed=false;
+			break;
+		}
 
-		if(dz->target_size>bufsz) {
+		if(!unpackchunk_alloc(ctx, kdz, i)||
+unpackchunk(ctx, buf, dz->target_size)!=dz->target_size||
+!unpackchunk_free(ctx, false)) {
+			unpackchunk_free(ctx, true);
+			fprintf(stderr, "Failed to decompress chunk %u\n", i);
 			free(buf);
-			bufsz=dz->target_size;
-			if(!(buf=malloc(bufsz))) {
-				fprintf(stderr, "Memory allocation failure.\n");
-				goto abort;
+			fed=false;
+			break;
+		}
+		++decoded;
+
+		pthread_mutex_lock(&fo.lock);
+		sl=fo.slot+fo.tail%KDZ_FANOUT_SLOTS;
+		sl->chunk=i;
+		sl->buf=buf;
+		sl->refs=started;
+		fo.bytes+=dz->target_size;
+		++fo.tail;
+		pthread_cond_broadcast(&fo.cond);
+		pthread_mutex_unlock(&fo.lock);
+	}
+
+	pthread_mutex_lock(&fo.lock);
+	fo.done=true;
+	pthread_cond_broadcast(&fo.cond);
+	pthread_mutex_unlock(&fo.lock);
+
+	for(i=0; i<started; ++i) pthread_join(t[i].thread, NULL);
+
+	pthread_cond_destroy(&fo.cond);
+	pthread_mutex_destroy(&fo.lock);
+
+	for(i=0; i<ntargets; ++i) {
+		bool ok=fed&&t[i].ok;
+		uint64_t wrote=0, zeroed=0, same=0, trimmed=0;
+
+		for(j=0; j<=kdz->max_device; ++j) {
+			struct fanout_dev *const td=t[i].devs+j;
+
+			if(td->fd<0) continue;
+
+			wrote+=td->wr.wrote;
+			zeroed+=td->wr.zeroed;
+			same+=td->wr.same;
+			trimmed+=td->wr.trimmed;
+
+			discard_close(td->wr.dsc, NULL);
+			if(!fo.simulate&&ok&&fsync(td->fd)<0) {
+				fprintf(stderr, "Flushing \"%s\" failed: %s\n", td->name,
+strerror(errno));
+				ok=false;
 			}
 		}
 
-		if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+		if(verbose>=0) printf(
+"%s: %s, wrote %llu bytes, zeroed %llu, left %llu alone, discarded %llu%s\n",
+t[i].pattern, ok?"done":"FAILED", (unsigned long long)wrote,
+(unsigned long long)zeroed, (unsigned long long)same,
+(unsigned long long)trimmed, fo.simulate?" (simulated)":"");
 
-		if(unpackchunk(ctx, buf, dz->target_size)!=dz->target_size)
-			goto abort;
+		results[i]=ok;
+		if(!ok) ret=false;
+	}
+
+	if(verbose>=1) printf("Decompressed %u chunks once for %u targets\n",
+decoded, ntargets);
+
+abort:
+	for(i=0; i<ntargets; ++i) {
+		if(t[i].devs) for(j=0; j<=kdz->max_device; ++j) {
+			struct fanout_dev *const td=t[i].devs+j;
+
+			if(td->map) munmap(td->map, td->len);
+			if(td->fd>=0) close(td->fd);
+		}
+		free(t[i].devs);
+		free(t[i].offset);
+	}
+	free(t);
+	free(fo.start);
+
+	return ret;
+}
 
-		if(!unpackchunk_free(ctx, false)) goto abort;
 
-		gpt_buf.bufsz=dz->target_size;
-		gpt_buf.buf=buf;
-		if(!(gptkdz=readgptb(gptbuffunc, &gpt_buf, blksz, GPT_PRIMARY))) {
-			fprintf(stderr,
-"Failed to load GPT from primary image in KDZ, aborting.\n");
-			goto abort;
-		}
+/* deflate window, needed to resume mid-stream */
+#define KDZ_WINSIZE 32768
+/* uncompressed bytes between resumption points */
+#define KDZ_SPAN (1<<22)
+/* granularity of the slice reader's cache */
+#define KDZ_CACHEBLK (1<<16)
 
+/* place to resume inflating a chunk mid-stream */
+struct kdz_point {
+	uint64_t out;		/* offset in uncompressed data */
+	uint64_t in;		/* offset in compressed data */
+	int bits;		/* bits of the preceding byte still unused */
+	unsigned char window[KDZ_WINSIZE];
+};
 
-		for(j=0; j<gptkdz->head.entryCount; ++j) {
-			int64_t delta;
-			uint32_t start, end;
-			struct gpt_entry *const kdzentr=gptkdz->entry+j;
+struct kdz_slice {
+	const struct kdz_file *kdz;
+	off64_t start;		/* offset of the slice on the device */
+	off64_t size;		/* size of the slice */
+	unsigned count;		/* number of extents */
+	struct {
+		off64_t off;	/* offset of the chunk in the slice */
+		off64_t len;	/* data plus trimmed area */
+		uint32_t data;	/* bytes of data, remainder reads as zeros */
+		uint32_t chunk;
+		unsigned npoints;
+		struct kdz_point *points;
+	} *ext;
+	struct {
+		bool valid;
+		unsigned ext;	/* extent being inflated */
+		uint64_t out;	/* uncompressed bytes so far */
+		z_stream zstr;
+		/* last output, circular with the oldest at zstr.next_out */
+		unsigned char window[KDZ_WINSIZE];
+	} live;
+	unsigned ncache;
+	uint64_t stamp;
+	struct {
+		off64_t off;	/* -1 for unused */
+		uint64_t stamp;	/* least recently used goes first */
+		char *data;
+	} *cache;
+};
 
-			if(!strcmp("persistent", kdzentr->name)) {
-				struct gpt_data *gptdev=NULL;
 
-				gpt_buf.bufsz=kdz->devs[dz->device].len;
-				gpt_buf.buf=kdz->devs[dz->device].map;
-				gptdev=readgptb(gptbuffunc, &gpt_buf, blksz,
-GPT_ANY);
+struct kdz_slice *open_kdzslice(const struct kdz_file *kdz, uint32_t dev,
+const char *slice_name, size_t cachesz)
+{
+	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
+	struct kdz_slice *ret;
+	struct gpt_data *gpt=NULL;
+	const uint32_t blksz=kdz->devs[dev].blksz;
+	off64_t end=0;
+	unsigned i, j, n;
 
-				if(gptdev&&!uuid_is_null(gptdev->entry[j].id))
-					uuid_copy(kdzentr->id, gptdev->entry[j].id);
+	if(!(ret=malloc(sizeof(*ret)))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return NULL;
+	}
 
-				else {
-					int urandom;
-					urandom=open("/dev/urandom", O_RDONLY);
+	ret->kdz=kdz;
+	ret->live.valid=false;
+	ret->stamp=0;
+	ret->cache=NULL;
+	ret->ext=NULL;
+	ret->count=0;
+	ret->start=-1;
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(kdz->chunks[i].dz.device==dev&&
+!strcmp(kdz->chunks[i].dz.slice_name, slice_name)) ++ret->count;
+
+	if(!ret->count) {
+		fprintf(stderr, "No slice \"%s\" on sd%c in KDZ\n", slice_name,
+'a'+dev);
+		goto abort;
+	}
 
-					/* I'm guessing this is appropriate */
-					/* if this fails, well can't do much */
-					if(urandom>=0) {
-						read(urandom, &kdzentr->id, sizeof(kdzentr->id));
-						close(urandom);
-					}
-				}
+	ret->ncache=cachesz/KDZ_CACHEBLK;
+	if(ret->ncache<2) ret->ncache=2;
 
-				if(gptdev) free(gptdev);
-			}
+	if(!(ret->ext=malloc(sizeof(ret->ext[0])*ret->count))||
+!(ret->cache=malloc(sizeof(ret->cache[0])*ret->ncache))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		goto abort;
+	}
 
-			if(strcmp("OP", kdzentr->name)) continue;
+	for(i=0; i<ret->ncache; ++i) {
+		ret->cache[i].off=-1;
+		ret->cache[i].stamp=0;
+		ret->cache[i].data=NULL;
+	}
 
-			/* convert to block count */
-			delta=opsz/blksz;
 
-			/* oddly OP in KDZ files is non-zero size */
-			delta-=(kdzentr->endLBA-kdzentr->startLBA+1);
+	/* the KDZ's own GPT tells where the slice lies and its true size */
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(kdz->chunks[i].dz.device==dev&&
+!strcmp(kdz->chunks[i].dz.slice_name, "PrimaryGPT")) break;
 
-			start=end=j;
-			if(!strcmp("userdata", gptkdz->entry[j-1].name)) {
-				if(verbose>=7) fprintf(stderr,
-"DEBUG: userdata before OP, userdata end=%lu, OP begin=%lu\n",
-gptkdz->entry[j-1].endLBA, kdzentr->startLBA);
-				if(gptkdz->entry[j-1].endLBA+1!=kdzentr->startLBA) continue;
-				--end;
-				delta=-delta;
-			} else if(!strcmp("userdata", gptkdz->entry[j+1].name)) {
-				if(verbose>=7) fprintf(stderr,
-"DEBUG: OP before userdata, userdata begin=%lu, OP end=%lu\n",
-gptkdz->entry[j+1].startLBA, kdzentr->endLBA);
-				if(gptkdz->entry[j+1].startLBA!=kdzentr->endLBA+1) continue;
-				++start;
-			} else continue;
-			if(verbose>=4) fprintf(stderr,
-"DEBUG: OP: start idx %u end idx %u, delta=%+ld\n", start, end, delta);
-			gptkdz->entry[start].startLBA+=delta;
-			gptkdz->entry[end].endLBA+=delta;
-			if(verbose>=4) fprintf(stderr,
-"DEBUG: OP: new start %lu, new end %lu\n", gptkdz->entry[start].startLBA,
-gptkdz->entry[end].endLBA);
+	if(i<=kdz->dz_file.chunk_count&&(gpt=test_kdzfile_kdzgpt(kdz, ctx, i))) {
+		for(j=0; j<gpt->head.entryCount; ++j) {
+			if(strcmp(gpt->entry[j].name, slice_name)) continue;
 
-			/* Yes, they ARE this perverse; adjust userdata first */
-			if(opsz<=0)
-				memset(kdzentr, 0, sizeof(struct gpt_entry));
+			ret->start=gpt->entry[j].startLBA*blksz;
+			end=(gpt->entry[j].endLBA+1)*blksz;
+			break;
 		}
+		free(gpt);
+	}
 
-		if(!simulate) {
-			if(!writegpt(dev, gptkdz)) {
-				fprintf(stderr, "\bGPT write operation failed!\n");
-				goto abort;
-			}
 
-			/* the GPT code ignores the first block */
-			if(memcmp(buf, kdz->devs[dz->device].map, 512))
-				pwrite(dev, buf, 512, 0);
-		} else close(dev);
+	for(i=1, n=0; i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
 
-		free(gptkdz);
-		gptkdz=NULL;
+		if(dz->device!=dev||strcmp(dz->slice_name, slice_name)) continue;
+
+		j=n++;
+		ret->ext[j].off=(off64_t)dz->target_addr*blksz;
+		ret->ext[j].len=(off64_t)dz->trim_count*blksz;
+		if(ret->ext[j].len<dz->target_size) ret->ext[j].len=dz->target_size;
+		ret->ext[j].data=dz->target_size;
+		ret->ext[j].chunk=i;
+		ret->ext[j].npoints=0;
+		ret->ext[j].points=NULL;
+
+		/* chunks are normally in order, but keep them sorted */
+		for(; j>0&&ret->ext[j-1].off>ret->ext[j].off; --j) {
+			__typeof__(ret->ext[0]) tmp=ret->ext[j];
+			ret->ext[j]=ret->ext[j-1];
+			ret->ext[j-1]=tmp;
+		}
+	}
 
-		if(!simulate) {
-			/* failure indicates kernel may be using old table */
-#ifndef DEBUG
-			if(ioctl(dev, BLKRRPART, NULL)) {
-				if(verbose>=7) fprintf(stderr,
-"ioctl(BLKRRPART) failed, kernel still uses old GPT\n");
-				ret=false;
-			}
-#endif
+	/* PrimaryGPT and friends aren't in the GPT, they are their chunks */
+	if(ret->start<0) ret->start=ret->ext[0].off;
+
+	for(j=0; j<ret->count; ++j) {
+		ret->ext[j].off-=ret->start;
+		if(ret->ext[j].off<0) {
+			fprintf(stderr, "Chunk %u lies before start of \"%s\"\n",
+ret->ext[j].chunk, slice_name);
+			goto abort;
 		}
+		if(ret->ext[j].off+ret->ext[j].len>end-ret->start)
+			end=ret->ext[j].off+ret->ext[j].len+ret->start;
 	}
 
+	ret->size=end-ret->start;
+
+	if(verbose>=3) fprintf(stderr,
+"DEBUG: slice \"%s\" at %lld, %lld bytes in %u chunks\n", slice_name,
+(long long)ret->start, (long long)ret->size, ret->count);
+
 	return ret;
 
 abort:
-	if(buf) free(buf);
+	if(ret->ext) free(ret->ext);
+	if(ret->cache) free(ret->cache);
+	free(ret);
 
-	if(gptkdz) free(gptkdz);
+	return NULL;
+}
 
-	if(dev>=0) close(dev);
 
-	unpackchunk_free(ctx, true);
+void close_kdzslice(struct kdz_slice *slice)
+{
+	unsigned i;
 
-	return false;
-}
+	if(!slice) return;
 
+	if(slice->live.valid) inflateEnd(&slice->live.zstr);
 
-int write_kdzfile(const struct kdz_file *const kdz,
-const char *const slice_name, const bool simulate)
-{
-	int i, j;
-	int dev;
-	struct unpackctx _ctx={0,}, *const ctx=&_ctx;
-	size_t bufsz=0;
-	char *buf=NULL;
-	off64_t offset;
-	uint64_t startLBA=0;
-	int fd=-1;
-	uint64_t blksz;
-	short wrote=0, skip=0;
+	for(i=0; i<slice->count; ++i)
+		if(slice->ext[i].points) free(slice->ext[i].points);
 
-	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
-		struct gpt_data *gptdev;
-		struct gpt_buf gpt_buf;
+	for(i=0; i<slice->ncache; ++i)
+		if(slice->cache[i].data) free(slice->cache[i].data);
 
-		/* not the one */
-		if(strcmp(slice_name, kdz->chunks[i].dz.slice_name)) continue;
+	free(slice->ext);
+	free(slice->cache);
+	free(slice);
+}
 
-		dev=kdz->chunks[i].dz.device;
 
-		gpt_buf.bufsz=kdz->devs[dev].len;
-		gpt_buf.buf=kdz->devs[dev].map;
+off64_t kdzslice_size(const struct kdz_slice *slice)
+{
+	return slice->size;
+}
 
-		blksz=kdz->devs[dev].blksz;
 
-		if(!(gptdev=readgptb(gptbuffunc, &gpt_buf, blksz, GPT_ANY))) {
-			fprintf(stderr, "Failed to read GPT from /dev/block/sd%c\n", 'a'+dev);
-			return 0;
-		}
+/* (re)start the live stream at pt, or the beginning of the chunk if NULL */
+static bool kdzslice_restart(struct kdz_slice *s, unsigned e,
+const struct kdz_point *pt)
+{
+	const struct kdz_file *const kdz=s->kdz;
+	const unsigned chunk=s->ext[e].chunk;
+	const unsigned char *const base=(unsigned char *)kdz->map+
+kdz->chunks[chunk].zoff;
+	const uint32_t insz=kdz->chunks[chunk].dz.data_size;
+	z_stream *const zstr=&s->live.zstr;
+	int zret;
 
-		for(j=0; j<gptdev->head.entryCount-1; ++j) {
-			/* not the one */
-			if(strcmp(slice_name, gptdev->entry[j].name)) continue;
+	if(s->live.valid) inflateEnd(zstr);
+	s->live.valid=false;
 
-			startLBA=gptdev->entry[j].startLBA;
-			offset=startLBA*blksz;
+	zstr->zalloc=Z_NULL;
+	zstr->zfree=Z_NULL;
+	zstr->opaque=Z_NULL;
 
-			break;
+	if(!pt) {
+		zstr->next_in=(Bytef *)base;
+		zstr->avail_in=insz;
+		zret=inflateInit(zstr);
+		s->live.out=0;
+	} else {
+		const uint64_t in=pt->in-(pt->bits?1:0);
+
+		zstr->next_in=(Bytef *)base+in;
+		zstr->avail_in=insz-in;
+		/* resumption is mid-stream, no header */
+		if((zret=inflateInit2(zstr, -15))==Z_OK) {
+			if(pt->bits) {
+				int ch=*zstr->next_in++;
+				--zstr->avail_in;
+				inflatePrime(zstr, pt->bits, ch>>(8-pt->bits));
+			}
+			inflateSetDictionary(zstr, pt->window, KDZ_WINSIZE);
 		}
+		memcpy(s->live.window, pt->window, KDZ_WINSIZE);
+		s->live.out=pt->out;
+	}
 
-		free(gptdev);
-		/* fail */
-		if(!startLBA) return 0;
-		break;
+	if(zret!=Z_OK) {
+		fprintf(stderr, "inflateInit() failed: %s\n", zstr->msg);
+		return false;
 	}
 
-	/* fail */
-	if(!startLBA) return 0;
+	zstr->next_out=s->live.window;
+	zstr->avail_out=0;
 
+	s->live.ext=e;
+	s->live.valid=true;
 
-	{
-		int flags=O_LARGEFILE;
-		char name[64];
-		/* on Linux O_EXCL refuses if mounted */
-		if(!simulate) flags|=O_EXCL|O_WRONLY;
-		snprintf(name, sizeof(name), "/dev/block/bootdevice/by-name/%s",
-slice_name);
+	return true;
+}
 
-		if((fd=open(name, flags))<0) {
-			const char *fmt;
-			if(errno==EBUSY) fmt="\"%s\" mounted, refusing to continue\n";
-			else fmt="Failed to open \"%s\": %s\n";
+/* note a resumption point at the live stream's current position */
+static void kdzslice_addpoint(struct kdz_slice *s)
+{
+	__typeof__(s->ext[0]) *const ext=s->ext+s->live.ext;
+	const z_stream *const zstr=&s->live.zstr;
+	const size_t left=s->live.window+KDZ_WINSIZE-zstr->next_out;
+	struct kdz_point *pt;
+
+	/* if this fails, we simply don't get faster */
+	if(!(pt=realloc(ext->points, sizeof(ext->points[0])*(ext->npoints+1))))
+		return;
+	ext->points=pt;
+	pt+=ext->npoints++;
+
+	pt->out=s->live.out;
+	pt->in=zstr->next_in-((Bytef *)s->kdz->map+
+s->kdz->chunks[ext->chunk].zoff);
+	pt->bits=zstr->data_type&7;
+	memcpy(pt->window, zstr->next_out, left);
+	memcpy(pt->window+left, s->live.window, KDZ_WINSIZE-left);
+}
 
-			fprintf(stderr, fmt, name, strerror(errno));
-			return 0;
-		}
+/* retrieve len bytes at coff from the uncompressed data of extent e */
+static bool kdzslice_inflate(struct kdz_slice *s, unsigned e, uint64_t coff,
+char *dst, size_t len)
+{
+	__typeof__(s->ext[0]) *const ext=s->ext+e;
+	z_stream *const zstr=&s->live.zstr;
+	const struct kdz_point *pt=NULL;
+	unsigned i;
+
+	/* nearest resumption point at or before coff */
+	for(i=ext->npoints; i>0; --i) if(ext->points[i-1].out<=coff) {
+		pt=ext->points+i-1;
+		break;
 	}
 
+	/* restart unless the live stream is already on the way */
+	if(!s->live.valid||s->live.ext!=e||s->live.out>coff||
+(pt&&pt->out>s->live.out)) {
+		if(!kdzslice_restart(s, e, pt)) return false;
+	}
 
-	for(; i<=kdz->dz_file.chunk_count; ++i) {
-		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
-		uint64_t range[2];
+	while(len>0) {
+		const unsigned char *from;
+		uint64_t got;
+		int zret;
 
-		/* obviously skip other slices */
-		if(strcmp(slice_name, dz->slice_name)) continue;
+		if(zstr->next_out==s->live.window+KDZ_WINSIZE)
+			zstr->next_out=s->live.window;
 
-		if(dev!=dz->device) { /* trouble! */
-			fprintf(stderr, "PANIC: \"%s\"'s chunks cross multiple devices?!\n", slice_name);
-			goto abort;
+		/* don't get ahead of the request, next read may continue */
+		zstr->avail_out=s->live.window+KDZ_WINSIZE-zstr->next_out;
+		if(zstr->avail_out>coff+len-s->live.out)
+			zstr->avail_out=coff+len-s->live.out;
+
+		from=zstr->next_out;
+
+		zret=inflate(zstr, Z_BLOCK);
+		if(zret!=Z_OK&&zret!=Z_STREAM_END) {
+			fprintf(stderr, "Chunk %d(%s): inflate() failed: %s\n",
+ext->chunk, s->kdz->chunks[ext->chunk].dz.slice_name, zstr->msg);
+			inflateEnd(zstr);
+			s->live.valid=false;
+			return false;
 		}
 
-		if(bufsz<dz->target_size) {
-			bufsz=dz->target_size;
-			free(buf);
-			if(!(buf=malloc(bufsz))) {
-				fprintf(stderr, "Memory allocation failure!\n");
-				goto abort;
-			}
+		got=zstr->next_out-from;
+
+		/* hand out whatever overlaps the request */
+		if(s->live.out+got>coff) {
+			const uint64_t skip=coff-s->live.out;
+			uint64_t cnt=got-skip;
+			if(cnt>len) cnt=len;
+
+			memcpy(dst, from+skip, cnt);
+			dst+=cnt;
+			coff+=cnt;
+			len-=cnt;
 		}
 
+		s->live.out+=got;
 
-		if(!unpackchunk_alloc(ctx, kdz, i)) goto abort;
+		if(zret==Z_STREAM_END) {
+			inflateEnd(zstr);
+			s->live.valid=false;
 
-		if(unpackchunk(ctx, buf, dz->target_size)!=dz->target_size)
-			goto abort;
+			if(len) {
+				fprintf(stderr,
+"Chunk %d(%s): less data than header indicates\n", ext->chunk,
+s->kdz->chunks[ext->chunk].dz.slice_name);
+				return false;
+			}
+			break;
+		}
 
-		if(!unpackchunk_free(ctx, false)) goto abort;
+		/* end of a deflate block (not the last) is a resumption point */
+		if((zstr->data_type&128)&&!(zstr->data_type&64)&&
+s->live.out>=(ext->npoints?ext->points[ext->npoints-1].out:0)+KDZ_SPAN)
+			kdzslice_addpoint(s);
+	}
 
+	return true;
+}
 
-		if(verbose>=3) fprintf(stderr, "DEBUG: chunk %u\n", i);
+/* fill dst from the slice, without benefit of the cache */
+static bool kdzslice_fill(struct kdz_slice *s, char *dst, off64_t off,
+size_t len)
+{
+	while(len>0) {
+		int lo=0, hi=s->count, mid;
+		size_t cnt;
+
+		/* find the last extent starting at or before off */
+		while(lo<hi) {
+			mid=(lo+hi)/2;
+			if(s->ext[mid].off<=off) lo=mid+1;
+			else hi=mid;
+		}
+		mid=lo-1;
+
+		if(mid<0||off>=s->ext[mid].off+s->ext[mid].len) {
+			/* gap between chunks */
+			off64_t next=mid+1<s->count?s->ext[mid+1].off:s->size;
+			cnt=next-off<len?next-off:len;
+			memset(dst, 0, cnt);
+		} else if(off<s->ext[mid].off+s->ext[mid].data) {
+			cnt=s->ext[mid].off+s->ext[mid].data-off;
+			if(cnt>len) cnt=len;
+			if(!kdzslice_inflate(s, mid, off-s->ext[mid].off, dst, cnt))
+				return false;
+		} else {
+			/* trimmed area */
+			cnt=s->ext[mid].off+s->ext[mid].len-off;
+			if(cnt>len) cnt=len;
+			memset(dst, 0, cnt);
+		}
 
-		/* write the device while trying to keep wear to a minimum */
-		for(j=0; j<dz->target_size; j+=blksz) {
-			uint64_t target=dz->target_addr*blksz+j;
+		dst+=cnt;
+		off+=cnt;
+		len-=cnt;
+	}
 
-			if(!memcmp(buf+j, kdz->devs[dev].map+target, blksz)) {
+	return true;
+}
 
-				if(verbose>=3) fprintf(stderr,
-"DEBUG: skipping %lu bytes at %lu (block %lu)\n", blksz, target-offset,
-(target-offset)/blksz);
-				else if(++skip>=512) {
-					skip-=512;
-					putchar('.');
-					fflush(stdout);
-				}
-				continue;
-			}
+ssize_t pread_kdzslice(struct kdz_slice *s, void *_buf, size_t count,
+off64_t offset)
+{
+	char *buf=_buf;
+	ssize_t ret=0;
 
-			if(verbose>=3) fprintf(stderr,
-"DEBUG: writing %lu bytes at %lu (block %lu)\n", blksz, target-offset,
-(target-offset)/blksz);
-			else if(++wrote>=512) {
-				wrote-=512;
-				putchar('o');
-				fflush(stdout);
-			}
+	if(offset<0) return -1;
+	if(offset>=s->size) return 0;
+	if(count>s->size-offset) count=s->size-offset;
+
+	while(count>0) {
+		const off64_t boff=offset-offset%KDZ_CACHEBLK;
+		unsigned i, use=0;
+		size_t cnt;
 
-			if(!simulate)
-				pwrite64(fd, buf+j, blksz, target-offset);
+		for(i=0; i<s->ncache; ++i) {
+			if(s->cache[i].off==boff) break;
+			if(s->cache[i].stamp<s->cache[use].stamp) use=i;
 		}
 
+		if(i<s->ncache) use=i;
+		else {
+			size_t len=s->size-boff<KDZ_CACHEBLK?s->size-boff:
+KDZ_CACHEBLK;
+
+			s->cache[use].off=-1;
+			if(!s->cache[use].data&&
+!(s->cache[use].data=malloc(KDZ_CACHEBLK))) {
+				fprintf(stderr, "Memory allocation failure\n");
+				return ret?ret:-1;
+			}
 
-		/* Discard (TRIM) all possible space */
-		/* Note, this is being done on the slice, so slice-relative */
+			if(!kdzslice_fill(s, s->cache[use].data, boff, len))
+				return ret?ret:-1;
 
-		/* start byte */
-		range[0]=dz->target_addr*blksz-offset+dz->target_size;
+			s->cache[use].off=boff;
+		}
 
-		range[1]=dz->trim_count*blksz-dz->target_size;
+		s->cache[use].stamp=++s->stamp;
 
+		cnt=KDZ_CACHEBLK-(offset-boff);
+		if(cnt>count) cnt=count;
 
-		if(verbose>=3) fprintf(stderr,
-"DEBUG: discarding %lu bytes (%lu blocks) at %lu (block %lu)\n", range[1],
-range[1]/blksz, range[0], range[0]/blksz);
-		else {
-			putchar('*');
-			fflush(stdout);
-		}
+		memcpy(buf, s->cache[use].data+(offset-boff), cnt);
 
-		/* do the deed (sanity check, and not simulating) */
-		if(range[1]>0&&range[1]<((uint64_t)1<<40)&&!simulate)
-			if(ioctl(fd, BLKDISCARD, range)<0&&verbose>=1)
-fprintf(stderr, "Discard failed: %s\n", strerror(errno));
+		buf+=cnt;
+		offset+=cnt;
+		count-=cnt;
+		ret+=cnt;
 	}
 
-	if(fd>=0) close(fd);
-	if(buf) free(buf);
+	return ret;
+}
 
-	if(verbose<3) putchar('\n');
 
-	return 1;
+/* the pattern with "%c" replaced by the device's letter (digit for eMMC)
+** and "%%" by '%' */
+static bool kdz_devname(const struct kdz_file *kdz, const char *pattern,
+int dev, char *name, size_t size)
+{
+	const bool ufs=(kdz->dz_file.flag_ufs&256)==256;
 
-abort:
-	unpackchunk_free(ctx, true);
+	return kdz_unitname(pattern, (ufs?'a':'0')+dev, name, size);
+}
 
-	if(fd>=0) close(fd);
-	if(buf) free(buf);
+static bool kdz_unitname(const char *pattern, char unit, char *name,
+size_t size)
+{
+	const char *p;
+	size_t n=0;
 
-	if(verbose<3) putchar('\n');
+	for(p=pattern; *p&&n<size-1; ++p) {
+		if(*p!='%') name[n++]=*p;
+		else if(*++p=='c') name[n++]=unit;
+		else if(*p=='%') name[n++]='%';
+		else {
+			fprintf(stderr,
+"\"%s\" may only use \"%%c\" for the device\n", pattern);
+			return false;
+		}
+	}
+	name[n]='\0';
 
-	return 0;
+	if(*p) fprintf(stderr, "\"%s\" is too long\n", pattern);
+	return !*p;
 }
 
-
 static int open_device(const struct kdz_file *kdz, int dev, int flags)
 {
-	char name[32];
+	char name[PATH_MAX];
 	const char *fmt;
 	char unit;
+
+	if(kdz_devices) {
+		if(!kdz_devname(kdz, kdz_devices, dev, name, sizeof(name))) {
+			errno=EINVAL;
+			return -1;
+		}
+	} else {
 #ifdef DEBUG
-	if((flags&O_RDWR)==O_RDWR||(flags&O_WRONLY)==O_WRONLY) {
-		fmt="/sd%c";
-		unit='a';
-	} else
+		if((flags&O_RDWR)==O_RDWR||(flags&O_WRONLY)==O_WRONLY) {
+			fmt="/sd%c";
+			unit='a';
+		} else
 #endif
-	if((kdz->dz_file.flag_ufs&256)==256) {
-		fmt="/dev/block/sd%c";
-		unit='a';
-	} else {
-		fmt="/dev/block/mmcblk%c";
-		unit='0';
+		if((kdz->dz_file.flag_ufs&256)==256) {
+			fmt="/dev/block/sd%c";
+			unit='a';
+		} else {
+			fmt="/dev/block/mmcblk%c";
+			unit='0';
+		}
+		snprintf(name, sizeof(name), fmt, unit+dev);
 	}
-	snprintf(name, sizeof(name), fmt, unit+dev);
 
 	if(verbose>=5) {
 		switch(flags&O_ACCMODE) {
@@ -1142,6 +5782,13 @@ name, fmt, flags);
 
 static bool unpackchunk_alloc(struct unpackctx *const ctx,
 const struct kdz_file *const kdz, const unsigned chunk)
+{
+	return unpackchunk_alloc_in(ctx, kdz, chunk,
+kdz->map+kdz->chunks[chunk].zoff);
+}
+
+static bool unpackchunk_alloc_in(struct unpackctx *const ctx,
+const struct kdz_file *const kdz, const unsigned chunk, const char *in)
 {
 	const struct dz_chunk *const dz=&kdz->chunks[chunk].dz;
 
@@ -1160,8 +5807,11 @@ const struct kdz_file *const kdz, const unsigned chunk)
 	ctx->zstr.zalloc=Z_NULL;
 	ctx->zstr.zfree=Z_NULL;
 
-	ctx->zstr.next_in=(Bytef *)(kdz->map+kdz->chunks[chunk].zoff);
-	ctx->zstr.avail_in=dz->data_size;
+	ctx->zstr.next_in=(Bytef *)in;
+	ctx->zstr.avail_in=in?dz->data_size:0;
+	ctx->ring=NULL;
+	ctx->ring_left=0;
+	ctx->ring_held=false;
 	ctx->zstr.total_in=0;
 	ctx->zstr.avail_out=0;
 	ctx->zstr.total_out=0;
@@ -1192,6 +5842,42 @@ const struct kdz_file *const kdz, const unsigned chunk)
 }
 
 
+static bool unpackchunk_alloc_ring(struct unpackctx *const ctx,
+const struct kdz_file *const kdz, const unsigned chunk, struct kdz_ring *ring)
+{
+	if(!unpackchunk_alloc_in(ctx, kdz, chunk, NULL)) return false;
+
+	ctx->ring=ring;
+	ctx->ring_left=kdz->chunks[chunk].dz.data_size;
+
+	return true;
+}
+
+/* move on to the next piece of input from the ring */
+static bool unpackchunk_input(struct unpackctx *const ctx)
+{
+	const char *buf;
+	ssize_t len;
+
+	if(ctx->ring_held) kdz_ring_put(ctx->ring);
+	ctx->ring_held=false;
+
+	/* out of input, inflate() will complain */
+	if(!ctx->ring_left) return true;
+
+	if((len=kdz_ring_get(ctx->ring, &buf))<0) {
+		fprintf(stderr, "Reading KDZ file failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	ctx->ring_held=true;
+	ctx->ring_left-=len;
+	ctx->zstr.next_in=(Bytef *)buf;
+	ctx->zstr.avail_in=len;
+
+	return true;
+}
+
 static int unpackchunk(struct unpackctx *const ctx, void *buf, size_t bufsz)
 {
 	const struct dz_chunk *const dz=&ctx->kdz->chunks[ctx->chunk].dz;
@@ -1204,14 +5890,27 @@ static int unpackchunk(struct unpackctx *const ctx, void *buf, size_t bufsz)
 
 	if(ctx->z_finished) return 0;
 
-	switch((zret=inflate(&ctx->zstr, Z_SYNC_FLUSH))) {
-	case Z_STREAM_END:
-		ctx->z_finished=1;
-	case Z_OK:
-		break;
-	default:
+	/* input may arrive in pieces, keep going until the buffer is full */
+	while(ctx->zstr.avail_out&&!ctx->z_finished) {
+		if(!ctx->zstr.avail_in&&ctx->ring&&!unpackchunk_input(ctx)) {
+			ctx->fail=1;
+			return -1;
+		}
+
+		switch((zret=inflate(&ctx->zstr, Z_SYNC_FLUSH))) {
+		case Z_STREAM_END:
+			ctx->z_finished=1;
+		case Z_OK:
+			continue;
+		case Z_BUF_ERROR:
+			/* all input consumed, yet the stream hasn't ended */
+			if(!ctx->zstr.avail_in&&ctx->ring&&ctx->ring_left) continue;
+		default:
+			break;
+		}
+
 		fprintf(stderr, "Chunk %d(%s): inflate() failed: %s\n",
-ctx->chunk, dz->slice_name, ctx->zstr.msg);
+ctx->chunk, dz->slice_name, ctx->zstr.msg?ctx->zstr.msg:"truncated");
 		if(verbose>=3) fprintf(stderr,
 "DEBUG: inflate()=%d, @ %lu bytes of input, %lu bytes of output\n", zret,
 ctx->zstr.total_in, ctx->zstr.total_out);
@@ -1221,6 +5920,8 @@ ctx->zstr.total_in, ctx->zstr.total_out);
 		return -1;
 	}
 
+	bufsz-=ctx->zstr.avail_out;
+
 	(*pMD5_Update)(&ctx->md5, buf, bufsz);
 	ctx->crc=crc32(ctx->crc, (Bytef *)buf, bufsz);
 
@@ -1246,6 +5947,20 @@ __func__, discard?"":"not ");
 
 	ctx->valid=0; /* or about to be invalid */
 
+	/* the ring must be left at the start of the next chunk's data */
+	if(ctx->ring) {
+		const char *buf;
+
+		if(ctx->ring_held) kdz_ring_put(ctx->ring);
+		ctx->ring_held=false;
+
+		for(; ctx->ring_left; kdz_ring_put(ctx->ring)) {
+			const ssize_t len=kdz_ring_get(ctx->ring, &buf);
+			if(len<0) break;
+			ctx->ring_left-=len;
+		}
+	}
+
 	if(inflateEnd(&ctx->zstr)!=Z_OK||!ctx->z_finished) {
 		if(!discard) goto fail;
 	} else discard=false; /* if we got to the end, why not try? */
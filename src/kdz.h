@@ -84,6 +84,14 @@ struct kdz_chunk {
 	uint64_t off;
 };
 
+/* how restore_kdzfiles() schedules a slice, and what test_kdzfile() keeps */
+enum kdz_slice_class {
+	KDZ_SLICE_GPT,		/* left to fix_gpts() */
+	KDZ_SLICE_BACKUP,	/* backup copy of a bootloader slice */
+	KDZ_SLICE_BOOT,		/* bootloader slice, has a backup copy */
+	KDZ_SLICE_BULK,		/* everything else */
+};
+
 struct kdz_file {
 	char *map;
 	off64_t len;
@@ -100,6 +108,77 @@ struct kdz_file {
 		off64_t zoff; /* offset of Z-stream */
 		struct dz_chunk dz;
 	} *chunks;
+	struct kdz_fp *fp; /* fingerprint, if one was loaded */
+	int fd; /* for reads which bypass the mmap */
+	/* the caches below change through a const kdz, each device's entries
+	** belong to whichever thread is working on that device */
+	char **kept; /* by chunk, inflated by test_kdzfile() for a later write */
+	struct gpt_data **gpts; /* parsed device GPTs, primary and backup */
+	unsigned keep; /* 1<<class of the slices test_kdzfile() should keep */
+};
+
+
+#define KDZ_FP_MAGIC_LEN 8
+
+extern const char kdz_fp_magic[KDZ_FP_MAGIC_LEN];
+
+/* fingerprint file header, all values are little-endian */
+struct kdz_fp_head {
+	char magic[KDZ_FP_MAGIC_LEN];
+	uint32_t version;	/* format version */
+	uint32_t count;		/* number of records */
+	char md5[16];		/* MD5 of chunk headers, from struct dz_file */
+};
+
+/* one per chunk examined by test_kdzfile(), whose data was found to match
+** the CRC32 and MD5 in its header, so the device can be checked against
+** those without inflating anything */
+struct kdz_fp_rec {
+	uint32_t chunk;		/* index of chunk */
+	uint32_t device;	/* flash device Id */
+	uint32_t target_addr;	/* first block of device range */
+	uint32_t target_size;	/* size of device range */
+	uint32_t gpt_len;	/* bytes of GPT chunk data following, or zero */
+};
+
+/* in-memory form of a fingerprint file */
+struct kdz_fp {
+	uint32_t count;
+	struct {
+		struct kdz_fp_rec rec;
+		char *gpt; /* data of GPT chunks, as inflated */
+	} ent[];
+};
+
+
+#define KDZ_PLAN_MAGIC_LEN 8
+
+extern const char kdz_plan_magic[KDZ_PLAN_MAGIC_LEN];
+
+/* plan file header, all values are little-endian */
+struct kdz_plan_head {
+	char magic[KDZ_PLAN_MAGIC_LEN];
+	uint32_t version;	/* format version */
+	uint32_t count;		/* number of chunk records */
+	char md5[16];		/* MD5 of chunk headers, from struct dz_file */
+};
+
+/* one per chunk of the planned slices, followed by its runs */
+struct kdz_plan_chunk {
+	uint32_t chunk;		/* index of chunk */
+	uint32_t devcrc;	/* CRC32 of the device range when planned */
+	uint64_t start;		/* offset of the slice on the device */
+	uint64_t trim_off;	/* slice-relative area to discard */
+	uint64_t trim_len;
+	uint32_t nruns;		/* number of struct kdz_plan_run following */
+	uint32_t reserved;
+};
+
+/* an area of the chunk to write, slice-relative */
+struct kdz_plan_run {
+	uint64_t off;
+	uint32_t len;
+	uint32_t zero;		/* zeroed by ioctl() rather than written */
 };
 
 
@@ -109,21 +188,168 @@ extern int verbose;
 
 /* open a file and load KDZ structure */
 extern struct kdz_file *open_kdzfile(const char *filename);
+/* as open_kdzfile(), but leave the devices alone (no device functions!) */
+extern struct kdz_file *open_kdzfile_nodev(const char *filename);
 /* close file and deallocate KDZ structure */
 extern void close_kdzfile(struct kdz_file *kdz);
 
-/* test for "safe" application */
+/* how test_kdzfile(), report_kdzfile() and write_kdzfile() get at device
+** contents: faulting in the mmap, or large reads into a buffer */
+enum kdz_devread {
+	KDZ_DEVREAD_MMAP,
+	KDZ_DEVREAD_PREAD,
+	KDZ_DEVREAD_DIRECT,	/* pread() with O_DIRECT */
+	KDZ_DEVREAD_COUNT
+};
+extern enum kdz_devread kdz_devread;
+
+/* size of the reads for KDZ_DEVREAD_PREAD/KDZ_DEVREAD_DIRECT */
+extern size_t kdz_devread_batch;
+
+/* show how fast each method has read so far */
+extern void kdz_devread_report(void);
+
+/* bytes of compressed data report_kdzfile() and write_kdzfile() read ahead
+** of inflating with a separate thread, 0 to use the mmap instead */
+extern size_t kdz_readahead;
+
+/* test for "safe" application; chunks it inflates of the slice classes in
+** kdz->keep are kept for the write which follows, rather than being
+** inflated twice */
 extern int test_kdzfile(struct kdz_file *kdz);
 
+/* one candidate for rank_kdzfiles() */
+struct kdz_rank {
+	const char *name;	/* filename, for reporting */
+	struct kdz_file *kdz;
+	int result;		/* as returned by test_kdzfile() */
+	uint64_t mismatched;	/* blocks in examined slices which differ */
+};
+
+/* test many KDZ files at once, reading each device area only once, then sort
+** the candidates with the best match first */
+extern bool rank_kdzfiles(struct kdz_rank *cand, unsigned count);
+
+/* generate a fingerprint for test_kdzfile() and save it as filename */
+extern bool write_kdzfp(const struct kdz_file *kdz, const char *filename);
+
+/* load a fingerprint, test_kdzfile() will then use it instead of inflating */
+extern bool load_kdzfp(struct kdz_file *kdz, const char *filename);
+
 /* test and report state of device/KDZ */
 extern int report_kdzfile(struct kdz_file *kdz);
 
+/* estimate how much of each slice a write would change, and how long it
+** would take, from a random sample of fraction of the chunks and blocks */
+extern bool estimate_kdzfile(const struct kdz_file *kdz, double fraction);
+
 /* restore GPTs from KDZ file, unless simulate */
 extern bool fix_gpts(const struct kdz_file *kdz, const bool simulate);
 
-/* (re)write the named flash slice, unless simulate */
+/* flags for write_kdzfile() */
+#define KDZ_WRITE_SIMULATE 0x01	/* only report what would be done */
+#define KDZ_WRITE_EXT4 0x02	/* leave blocks free in the KDZ's ext4 alone */
+#define KDZ_WRITE_DIRECT 0x04	/* bypass the page cache (O_DIRECT) */
+#define KDZ_WRITE_VERIFY 0x08	/* write_kdzfiles() reads back afterward */
+#define KDZ_WRITE_SYNC 0x10	/* fsync() each slice once written */
+
+/* most dirty bytes buffered writes may leave in the page cache, 0 leaves
+** writeback to the kernel */
+extern uint64_t kdz_dirty_max;
+
+/* write_kdzfile() widens differing runs to whole units of the device (from
+** its queue limits, or kdz_write_unit if set) when at least 1/kdz_write_amp
+** of the unit differs anyway, 0 never widens */
+extern unsigned kdz_write_amp;
+extern size_t kdz_write_unit;
+
+/* requests write_kdzfile() keeps in flight through io_uring, 0 for none */
+extern unsigned kdz_io_depth;
+
+/* write_kdzfile() journals the chunks it finishes here, passing over those
+** a previous run journaled (see journal.h), NULL for none */
+struct kdz_journal;
+extern struct kdz_journal *kdz_journal;
+
+/* write_kdzfile() saves whatever it overwrites or trims here (see undo.h),
+** NULL for none */
+struct undo;
+extern struct undo *kdz_undo;
+
+/* image files standing in for the devices, a path with "%c" for the device
+** letter (digit for eMMC); slices are found through the images' GPTs and
+** trimmed by punching holes.  NULL for the real devices */
+extern const char *kdz_devices;
+
+/* open a slice by name alone for writing (reading when simulating), through
+** kdz_devices when set; *base gets the slice's offset in what was opened */
+extern int kdz_open_named(const char *slice_name, bool simulate,
+off64_t *base);
+
+/* (re)write the named flash slice */
 extern int write_kdzfile(const struct kdz_file *kdz, const char *slice_name,
-bool simulate);
+unsigned flags);
+
+/* write_kdzfile() several slices at once, with a thread for each device
+** taking its slices in order of address, results[] gets each return */
+extern bool write_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], int results[], unsigned count,
+unsigned flags);
+
+/* write every slice of the KDZ but the GPTs, all devices at once: first the
+** backup copies of the bootloader slices along with the bulk slices, then
+** the bootloader slices themselves */
+extern bool restore_kdzfiles(const struct kdz_file *kdz, unsigned flags);
+
+/* write the bootloader slices, each backup copy and then its primary, the
+** pair inflated once when they carry the same image; each slice is flushed
+** before the next is touched and the first failure stops everything */
+extern bool bootloader_kdzfiles(const struct kdz_file *kdz, unsigned flags);
+
+/* simulate write_kdzfiles(), saving exactly what it would do as a plan, along
+** with a CRC32 of each chunk's device range, and report the volume */
+extern bool plan_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], unsigned count, unsigned flags,
+const char *filename);
+
+/* write the slices to several target sets at once, each chunk being inflated
+** and checked only once; targets[] are paths with "%c" standing for the
+** device letter (digit for eMMC), whose GPTs must place the slices as the
+** KDZ does; results[] gets whether each target succeeded */
+extern bool fanout_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], unsigned count,
+const char *const targets[], bool results[], unsigned ntargets,
+unsigned flags);
+
+/* carry out a plan, once every chunk's device range still matches; only
+** chunks with data to write are inflated */
+extern bool exec_kdzplan(const struct kdz_file *kdz, const char *filename,
+unsigned flags);
+
+/* does the plan write or trim any of slice_name?  -1 if it can't be loaded */
+extern int exec_kdzplan_writes(const struct kdz_file *kdz,
+const char *filename, const char *slice_name);
+
+/* read back the device areas of the slices with O_DIRECT and check the
+** chunks' CRC32s, in parallel across chunks and devices; slices whose
+** results[] is already 0 are skipped, others get 0 if they differ */
+extern bool verify_kdzfiles(const struct kdz_file *kdz,
+const char *const slice_names[], int results[], unsigned count);
+
+
+/* random-access reader for a slice's contents, straight from the KDZ */
+struct kdz_slice;
+
+/* prepare to read slice_name of device dev, caching up to cachesz bytes */
+extern struct kdz_slice *open_kdzslice(const struct kdz_file *kdz,
+uint32_t dev, const char *slice_name, size_t cachesz);
+/* release the reader */
+extern void close_kdzslice(struct kdz_slice *slice);
+/* size of the slice in bytes */
+extern off64_t kdzslice_size(const struct kdz_slice *slice);
+/* read from the slice, areas without data in the KDZ read as zeros */
+extern ssize_t pread_kdzslice(struct kdz_slice *slice, void *buf, size_t count,
+off64_t offset);
 
 #endif
 
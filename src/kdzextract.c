@@ -0,0 +1,409 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+*************************************************************************
+*$Id$			*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "kdz.h"
+#include "ext4.h"
+#include "md5.h"
+
+
+int verbose=0;
+
+
+/* copy buffer size */
+#define EXTRACT_BUFSZ (1<<20)
+
+/* directories nested deeper than this are taken to be a loop */
+#define EXTRACT_MAXDEPTH 128
+
+
+static ssize_t slice_pread(void *opaque, void *buf, size_t count,
+off64_t offset);
+static bool list_path(struct ext4_fs *fs, const char *path);
+static bool extract_path(struct ext4_fs *fs, const char *path,
+const char *dest);
+
+
+int main(int argc, char **argv)
+{
+	int ret=1;
+	int opt;
+	bool list=false;
+	const char *slice_name="system";
+	const char *outdir=".";
+	struct kdz_file *kdz=NULL;
+	struct kdz_slice *slice=NULL;
+	struct ext4_fs *fs=NULL;
+	uint32_t dev;
+	unsigned i;
+
+	while((opt=getopt(argc, argv, "ls:o:vqhH?"))>=0) {
+		switch(opt) {
+		case 'l':
+			list=true;
+			break;
+		case 's':
+			slice_name=optarg;
+			break;
+		case 'o':
+			outdir=optarg;
+			break;
+		case 'v':
+			if(verbose!=((int)-1>>1)) ++verbose;
+			break;
+
+		case 'q':
+			if(verbose!=~((int)-1>>1)) --verbose;
+			break;
+
+		case 'h':
+		case 'H':
+		case '?':
+			ret=0;
+			do {
+		default:
+				ret=1;
+			} while(0);
+			goto usage;
+		}
+	}
+
+	if(argc-optind<2) {
+		ret=1;
+	usage:
+		fprintf(stderr,
+"Copyright (C) 2018 Elliott Mitchell, distributed under GPLv3\n"
+"Version: $Id$\n" "\n"
+"Usage: %s [-vql] [-s <slice>] [-o <dir>] <KDZ file> <path> [<path>...]\n"
+"  -h  Help, this message\n" "  -v  Verbose, increase verbosity\n"
+"  -q  Quiet, decrease verbosity\n"
+"  -l  List the paths instead of extracting them\n"
+"  -s  Slice holding the ext4 filesystem (default \"system\")\n"
+"  -o  Directory to extract into (default \".\")\n"
+"Directories are extracted recursively.  Only the parts of the KDZ file\n"
+"holding the requested files are decompressed.\n", argv[0]);
+		return ret;
+	}
+
+	md5_start();
+
+	if(!(kdz=open_kdzfile_nodev(argv[optind]))) {
+		fprintf(stderr, "Failed to open KDZ file \"%s\", aborting\n",
+argv[optind]);
+		goto abort;
+	}
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i)
+		if(!strcmp(kdz->chunks[i].dz.slice_name, slice_name)) break;
+
+	if(i>kdz->dz_file.chunk_count) {
+		fprintf(stderr, "Slice \"%s\" not found in KDZ file\n",
+slice_name);
+		goto abort;
+	}
+	dev=kdz->chunks[i].dz.device;
+
+	if(!(slice=open_kdzslice(kdz, dev, slice_name, 16<<20))) goto abort;
+
+	if(!(fs=ext4_open(slice_pread, slice))) {
+		fprintf(stderr, "No usable ext4 filesystem in slice \"%s\"\n",
+slice_name);
+		goto abort;
+	}
+
+	ret=0;
+	for(++optind; optind<argc; ++optind) {
+		if(list) {
+			if(!list_path(fs, argv[optind])) ret=1;
+		} else {
+			const char *base=strrchr(argv[optind], '/');
+			char dest[PATH_MAX];
+
+			base=base?base+1:argv[optind];
+			if(!*base) base=slice_name;
+
+			snprintf(dest, sizeof(dest), "%s/%s", outdir, base);
+
+			if(!extract_path(fs, argv[optind], dest)) ret=1;
+		}
+	}
+
+abort:
+	if(fs) ext4_close(fs);
+	if(slice) close_kdzslice(slice);
+	if(kdz) close_kdzfile(kdz);
+
+	md5_stop();
+
+	return ret;
+}
+
+
+static ssize_t slice_pread(void *opaque, void *buf, size_t count,
+off64_t offset)
+{
+	return pread_kdzslice(opaque, buf, count, offset);
+}
+
+
+static void list_entry(const struct ext4_inode *inode, const char *name)
+{
+	char date[32];
+	const time_t mtime=inode->mtime;
+	char type='-';
+
+	if(S_ISDIR(inode->mode)) type='d';
+	else if(S_ISLNK(inode->mode)) type='l';
+	else if(S_ISCHR(inode->mode)) type='c';
+	else if(S_ISBLK(inode->mode)) type='b';
+	else if(S_ISFIFO(inode->mode)) type='p';
+	else if(S_ISSOCK(inode->mode)) type='s';
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", gmtime(&mtime));
+
+	printf("%c%04o %5u %5u %10llu %s %s\n", type, inode->mode&07777,
+inode->uid, inode->gid, (unsigned long long)inode->size, date, name);
+}
+
+static bool list_func(void *opaque, uint32_t ino, const char *name,
+uint8_t type)
+{
+	struct ext4_fs *const fs=opaque;
+	struct ext4_inode inode;
+
+	if(!strcmp(name, ".")||!strcmp(name, "..")) return true;
+
+	if(!ext4_inode(fs, ino, &inode)) {
+		fprintf(stderr, "Failed to load inode %u for \"%s\"\n", ino, name);
+		return true;
+	}
+
+	list_entry(&inode, name);
+
+	return true;
+}
+
+static bool list_path(struct ext4_fs *fs, const char *path)
+{
+	struct ext4_inode inode;
+	uint32_t ino;
+
+	if(!(ino=ext4_lookup(fs, path))||!ext4_inode(fs, ino, &inode)) {
+		fprintf(stderr, "\"%s\" not found\n", path);
+		return false;
+	}
+
+	if(!S_ISDIR(inode.mode)) {
+		list_entry(&inode, path);
+		return true;
+	}
+
+	if(verbose>=0) printf("%s:\n", path);
+
+	if(!ext4_readdir(fs, &inode, list_func, fs)) {
+		fprintf(stderr, "Failed reading directory \"%s\": %s\n", path,
+strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool extract_inode(struct ext4_fs *fs, const struct ext4_inode *inode,
+const char *dest, unsigned depth);
+
+struct extract_dir {
+	struct ext4_fs *fs;
+	const char *dest;
+	unsigned depth;
+	bool ret;
+};
+
+static bool extract_func(void *opaque, uint32_t ino, const char *name,
+uint8_t type)
+{
+	struct extract_dir *const dir=opaque;
+	struct ext4_inode inode;
+	char dest[PATH_MAX];
+
+	if(!strcmp(name, ".")||!strcmp(name, "..")) return true;
+
+	/* a crafted name could reach outside the destination */
+	if(!name[0]||strchr(name, '/')) {
+		fprintf(stderr, "Skipping bad name \"%s\" in \"%s\"\n", name,
+dir->dest);
+		dir->ret=false;
+		return true;
+	}
+
+	snprintf(dest, sizeof(dest), "%s/%s", dir->dest, name);
+
+	if(!ext4_inode(dir->fs, ino, &inode)) {
+		fprintf(stderr, "Failed to load inode %u for \"%s\"\n", ino, dest);
+		dir->ret=false;
+	} else if(!extract_inode(dir->fs, &inode, dest, dir->depth+1))
+		dir->ret=false;
+
+	return true;
+}
+
+static bool extract_inode(struct ext4_fs *fs, const struct ext4_inode *inode,
+const char *dest, unsigned depth)
+{
+	char *buf=NULL;
+	int fd=-1;
+	off64_t off;
+	bool ret=false;
+
+	if(verbose>=1) fprintf(stderr, "Extracting \"%s\"\n", dest);
+
+	if(S_ISDIR(inode->mode)) {
+		struct extract_dir dir={fs, dest, depth, true};
+
+		if(depth>=EXTRACT_MAXDEPTH) {
+			fprintf(stderr,
+"\"%s\" is nested too deeply, the filesystem likely has a loop\n", dest);
+			return false;
+		}
+
+		if(mkdir(dest, 0755)<0&&errno!=EEXIST) {
+			fprintf(stderr, "Failed to create \"%s\": %s\n", dest,
+strerror(errno));
+			return false;
+		}
+
+		/* only -o itself may be a symlink, an extracted one is never
+		** followed */
+		if(depth) {
+			struct stat st;
+
+			if(lstat(dest, &st)<0||!S_ISDIR(st.st_mode)) {
+				fprintf(stderr, "\"%s\" exists and isn't a directory\n",
+dest);
+				return false;
+			}
+		}
+
+		if(!ext4_readdir(fs, inode, extract_func, &dir)) {
+			fprintf(stderr, "Failed reading directory for \"%s\": %s\n",
+dest, strerror(errno));
+			return false;
+		}
+
+		return dir.ret;
+	}
+
+	if(S_ISLNK(inode->mode)) {
+		char target[PATH_MAX];
+
+		if(inode->size>=sizeof(target)||
+ext4_pread(fs, inode, target, inode->size, 0)!=inode->size) {
+			fprintf(stderr, "Failed reading symlink for \"%s\"\n", dest);
+			return false;
+		}
+		target[inode->size]='\0';
+
+		if(symlink(target, dest)<0) {
+			fprintf(stderr, "Failed to create symlink \"%s\": %s\n", dest,
+strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	if(!S_ISREG(inode->mode)) {
+		if(verbose>=0) fprintf(stderr,
+"Skipping \"%s\", not a regular file\n", dest);
+		return true;
+	}
+
+	if(!(buf=malloc(EXTRACT_BUFSZ))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return false;
+	}
+
+	/* never through a symlink, nor over anything already there */
+	if((fd=open(dest, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_LARGEFILE,
+inode->mode&0777))<0) {
+		fprintf(stderr, "Failed to create \"%s\": %s\n", dest,
+strerror(errno));
+		goto abort;
+	}
+
+	for(off=0; off<inode->size; ) {
+		ssize_t len, cnt;
+
+		if((len=ext4_pread(fs, inode, buf, EXTRACT_BUFSZ, off))<=0) {
+			fprintf(stderr, "Failed reading \"%s\" from filesystem\n",
+dest);
+			goto abort;
+		}
+
+		for(cnt=0; cnt<len; ) {
+			ssize_t w;
+			if((w=write(fd, buf+cnt, len-cnt))<0) {
+				fprintf(stderr, "Failed writing \"%s\": %s\n", dest,
+strerror(errno));
+				goto abort;
+			}
+			cnt+=w;
+		}
+
+		off+=len;
+	}
+
+	ret=true;
+
+abort:
+	if(fd>=0&&close(fd)<0&&ret) {
+		fprintf(stderr, "Failed writing \"%s\": %s\n", dest,
+strerror(errno));
+		ret=false;
+	}
+	free(buf);
+
+	return ret;
+}
+
+static bool extract_path(struct ext4_fs *fs, const char *path,
+const char *dest)
+{
+	struct ext4_inode inode;
+	uint32_t ino;
+
+	if(!(ino=ext4_lookup(fs, path))||!ext4_inode(fs, ino, &inode)) {
+		fprintf(stderr, "\"%s\" not found\n", path);
+		return false;
+	}
+
+	return extract_inode(fs, &inode, dest, 0);
+}
+
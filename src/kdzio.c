@@ -0,0 +1,642 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+*************************************************************************
+*$Id$			*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "kdz.h"
+#include "kdzio.h"
+
+
+/* The NDK's headers predate io_uring, these match <linux/io_uring.h>.  The
+** system call numbers are the same on every architecture we build for. */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#endif
+
+struct kdz_uring_sqring_offsets {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t ring_mask;
+	uint32_t ring_entries;
+	uint32_t flags;
+	uint32_t dropped;
+	uint32_t array;
+	uint32_t resv1;
+	uint64_t resv2;
+};
+
+struct kdz_uring_cqring_offsets {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t ring_mask;
+	uint32_t ring_entries;
+	uint32_t overflow;
+	uint32_t cqes;
+	uint32_t flags;
+	uint32_t resv1;
+	uint64_t resv2;
+};
+
+struct kdz_uring_params {
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t flags;
+	uint32_t sq_thread_cpu;
+	uint32_t sq_thread_idle;
+	uint32_t features;
+	uint32_t wq_fd;
+	uint32_t resv[3];
+	struct kdz_uring_sqring_offsets sq_off;
+	struct kdz_uring_cqring_offsets cq_off;
+};
+
+struct kdz_uring_sqe {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t ioprio;
+	int32_t fd;
+	uint64_t off;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t rw_flags;
+	uint64_t user_data;
+	uint16_t buf_index;
+	uint16_t personality;
+	int32_t splice_fd_in;
+	uint64_t pad[2];
+};
+
+struct kdz_uring_cqe {
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+};
+
+#define KDZ_URING_OFF_SQ_RING 0ULL
+#define KDZ_URING_OFF_CQ_RING 0x8000000ULL
+#define KDZ_URING_OFF_SQES 0x10000000ULL
+
+/* vectored versions work on every kernel with io_uring (5.1+) */
+#define KDZ_URING_OP_READV 1
+#define KDZ_URING_OP_WRITEV 2
+
+#define KDZ_URING_ENTER_GETEVENTS 1
+
+
+struct kdz_ioreq {
+	struct iovec iov;	/* remainder still to transfer */
+	off64_t off;
+	int fd;
+	bool write;
+	struct kdz_iogroup *grp;
+};
+
+struct kdz_io {
+	int ring;		/* -1 when synchronous */
+	bool failed;		/* submitting failed, new requests are synchronous */
+	unsigned depth;
+	unsigned inflight;
+
+	void *sqmap;
+	size_t sqmapsz;
+	unsigned *sqtail, *sqmask, *sqarray;
+	struct kdz_uring_sqe *sqes;
+	size_t sqesz;
+
+	void *cqmap;
+	size_t cqmapsz;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct kdz_uring_cqe *cqes;
+
+	unsigned nfree;
+	unsigned *free;		/* unused request slots */
+	struct kdz_ioreq req[];
+};
+
+
+static bool kdz_io_submit(struct kdz_io *io, unsigned slot);
+static bool kdz_io_reap(struct kdz_io *io);
+
+
+
+struct kdz_io *kdz_io_open(unsigned depth)
+{
+	struct kdz_io *io;
+	struct kdz_uring_params p;
+	unsigned i;
+
+	if(!(io=malloc(sizeof(struct kdz_io)+sizeof(io->req[0])*depth)))
+		return NULL;
+
+	memset(io, 0, sizeof(struct kdz_io));
+	io->ring=-1;
+	io->depth=depth;
+
+	if(!depth) return io;
+
+	if(!(io->free=malloc(sizeof(io->free[0])*depth))) goto abort;
+	for(i=0; i<depth; ++i) io->free[i]=i;
+	io->nfree=depth;
+
+	memset(&p, 0, sizeof(p));
+	if((io->ring=syscall(__NR_io_uring_setup, depth, &p))<0) {
+		/* nothing before Linux 5.1 */
+		if(verbose>=1) fprintf(stderr,
+"io_uring unavailable (%s), using synchronous I/O\n", strerror(errno));
+		io->ring=-1;
+		return io;
+	}
+
+	io->sqmapsz=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	io->sqmap=mmap(NULL, io->sqmapsz, PROT_READ|PROT_WRITE,
+MAP_SHARED|MAP_POPULATE, io->ring, KDZ_URING_OFF_SQ_RING);
+	io->cqmapsz=p.cq_off.cqes+p.cq_entries*sizeof(struct kdz_uring_cqe);
+	io->cqmap=mmap(NULL, io->cqmapsz, PROT_READ|PROT_WRITE,
+MAP_SHARED|MAP_POPULATE, io->ring, KDZ_URING_OFF_CQ_RING);
+	io->sqesz=p.sq_entries*sizeof(struct kdz_uring_sqe);
+	io->sqes=mmap(NULL, io->sqesz, PROT_READ|PROT_WRITE,
+MAP_SHARED|MAP_POPULATE, io->ring, KDZ_URING_OFF_SQES);
+
+	if(io->sqmap==MAP_FAILED||io->cqmap==MAP_FAILED||io->sqes==MAP_FAILED) {
+		fprintf(stderr, "Failed to map io_uring: %s\n", strerror(errno));
+		goto abort;
+	}
+
+	io->sqtail=(unsigned *)((char *)io->sqmap+p.sq_off.tail);
+	io->sqmask=(unsigned *)((char *)io->sqmap+p.sq_off.ring_mask);
+	io->sqarray=(unsigned *)((char *)io->sqmap+p.sq_off.array);
+	io->cqhead=(unsigned *)((char *)io->cqmap+p.cq_off.head);
+	io->cqtail=(unsigned *)((char *)io->cqmap+p.cq_off.tail);
+	io->cqmask=(unsigned *)((char *)io->cqmap+p.cq_off.ring_mask);
+	io->cqes=(struct kdz_uring_cqe *)((char *)io->cqmap+p.cq_off.cqes);
+
+	if(verbose>=2) fprintf(stderr, "Using io_uring, queue depth %u\n",
+depth);
+
+	return io;
+
+abort:
+	kdz_io_close(io);
+	return NULL;
+}
+
+void kdz_io_close(struct kdz_io *io)
+{
+	if(!io) return;
+
+	while(io->inflight&&kdz_io_reap(io));
+
+	if(io->sqes&&io->sqes!=MAP_FAILED) munmap(io->sqes, io->sqesz);
+	if(io->cqmap&&io->cqmap!=MAP_FAILED) munmap(io->cqmap, io->cqmapsz);
+	if(io->sqmap&&io->sqmap!=MAP_FAILED) munmap(io->sqmap, io->sqmapsz);
+	if(io->ring>=0) close(io->ring);
+	if(io->free) free(io->free);
+	free(io);
+}
+
+
+bool kdz_io_async(const struct kdz_io *io)
+{
+	return io->ring>=0;
+}
+
+
+static void kdz_io_sync(int fd, void *buf, size_t len, off64_t off,
+struct kdz_iogroup *grp, bool write)
+{
+	while(len) {
+		const ssize_t cnt=write?pwrite64(fd, buf, len, off):
+pread64(fd, buf, len, off);
+
+		if(cnt<=0) {
+			if(cnt<0&&errno==EINTR) continue;
+			if(!grp->error) grp->error=cnt<0?errno:EIO;
+			return;
+		}
+
+		buf=(char *)buf+cnt;
+		len-=cnt;
+		off+=cnt;
+	}
+}
+
+/* an O_DIRECT write came back EINVAL, do what kdz_pwrite_direct() does and
+** continue buffered; other requests in flight may have done so already */
+static bool kdz_io_buffered(int fd)
+{
+	const int flags=fcntl(fd, F_GETFL);
+
+	if(flags<0) return false;
+	if(!(flags&O_DIRECT)) return true;
+
+	if(verbose>=0) fprintf(stderr,
+"O_DIRECT write refused, continuing buffered\n");
+	return fcntl(fd, F_SETFL, flags&~O_DIRECT)>=0;
+}
+
+static bool kdz_io_queue(struct kdz_io *io, int fd, void *buf, size_t len,
+off64_t off, struct kdz_iogroup *grp, bool write)
+{
+	struct kdz_ioreq *req;
+	unsigned slot;
+
+	if(io->ring<0||io->failed) {
+		/* no io_uring, just do it */
+		kdz_io_sync(fd, buf, len, off, grp, write);
+		return true;
+	}
+
+	if(!len) return true;
+
+	while(!io->nfree) if(!kdz_io_reap(io)) return false;
+
+	slot=io->free[--io->nfree];
+	req=io->req+slot;
+	req->iov.iov_base=buf;
+	req->iov.iov_len=len;
+	req->off=off;
+	req->fd=fd;
+	req->write=write;
+	req->grp=grp;
+
+	++grp->pending;
+	++io->inflight;
+
+	if(!kdz_io_submit(io, slot)) {
+		--grp->pending;
+		--io->inflight;
+		io->free[io->nfree++]=slot;
+
+		/* what is in flight still completes, the rest is done here */
+		if(verbose>=1) fprintf(stderr,
+"io_uring submission failed (%s), continuing with synchronous I/O\n",
+strerror(errno));
+		io->failed=true;
+		return kdz_io_queue(io, fd, buf, len, off, grp, write);
+	}
+
+	return true;
+}
+
+bool kdz_io_pread(struct kdz_io *io, int fd, void *buf, size_t len,
+off64_t off, struct kdz_iogroup *grp)
+{
+	return kdz_io_queue(io, fd, buf, len, off, grp, false);
+}
+
+bool kdz_io_pwrite(struct kdz_io *io, int fd, const void *buf, size_t len,
+off64_t off, struct kdz_iogroup *grp)
+{
+	return kdz_io_queue(io, fd, (void *)buf, len, off, grp, true);
+}
+
+
+bool kdz_io_wait(struct kdz_io *io, struct kdz_iogroup *grp)
+{
+	while(grp->pending) if(!kdz_io_reap(io)) {
+		if(!grp->error) grp->error=errno;
+		break;
+	}
+
+	if(grp->error) {
+		errno=grp->error;
+		grp->error=0;
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool kdz_io_submit(struct kdz_io *io, unsigned slot)
+{
+	const struct kdz_ioreq *const req=io->req+slot;
+	const unsigned tail=*io->sqtail;
+	const unsigned idx=tail&*io->sqmask;
+	struct kdz_uring_sqe *const sqe=io->sqes+idx;
+	int ret;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode=req->write?KDZ_URING_OP_WRITEV:KDZ_URING_OP_READV;
+	sqe->fd=req->fd;
+	sqe->off=req->off;
+	sqe->addr=(uintptr_t)&req->iov;
+	sqe->len=1;
+	sqe->user_data=slot;
+
+	io->sqarray[idx]=idx;
+	__atomic_store_n(io->sqtail, tail+1, __ATOMIC_RELEASE);
+
+	while((ret=syscall(__NR_io_uring_enter, io->ring, 1, 0, 0, NULL, 0))<0)
+		if(errno!=EINTR&&errno!=EAGAIN) {
+			/* not consumed, take it back before the slot is reused */
+			__atomic_store_n(io->sqtail, tail, __ATOMIC_RELEASE);
+			return false;
+		}
+
+	return true;
+}
+
+/* wait for and handle at least one completion */
+static bool kdz_io_reap(struct kdz_io *io)
+{
+	unsigned head=*io->cqhead;
+	unsigned tail=__atomic_load_n(io->cqtail, __ATOMIC_ACQUIRE);
+
+	while(head==tail) {
+		if(syscall(__NR_io_uring_enter, io->ring, 0, 1,
+KDZ_URING_ENTER_GETEVENTS, NULL, 0)<0&&errno!=EINTR) return false;
+		tail=__atomic_load_n(io->cqtail, __ATOMIC_ACQUIRE);
+	}
+
+	for(; head!=tail; ++head) {
+		const struct kdz_uring_cqe *const cqe=io->cqes+(head&*io->cqmask);
+		const unsigned slot=cqe->user_data;
+		struct kdz_ioreq *const req=io->req+slot;
+		const int res=cqe->res;
+
+		/* publish before any resubmission can produce more */
+		__atomic_store_n(io->cqhead, head+1, __ATOMIC_RELEASE);
+
+		if(res==-EINTR||res==-EAGAIN||
+(res>0&&(size_t)res<req->iov.iov_len)) {
+			/* short transfer, go for the rest */
+			if(res>0) {
+				req->iov.iov_base=(char *)req->iov.iov_base+res;
+				req->iov.iov_len-=res;
+				req->off+=res;
+			}
+			if(kdz_io_submit(io, slot)) continue;
+			if(!req->grp->error) req->grp->error=errno;
+		} else if(res==-EINVAL&&req->write&&kdz_io_buffered(req->fd)) {
+			/* the rest of the write goes through the page cache */
+			kdz_io_sync(req->fd, req->iov.iov_base, req->iov.iov_len,
+req->off, req->grp, true);
+		} else if(res<=0&&!req->grp->error) req->grp->error=res?-res:EIO;
+
+		--req->grp->pending;
+		--io->inflight;
+		io->free[io->nfree++]=slot;
+	}
+
+	return true;
+}
+
+
+
+struct kdz_ring {
+	int fd;
+	size_t piece;
+	unsigned depth;
+
+	struct {
+		off64_t off;
+		uint64_t len;
+	} *ext;
+	unsigned nexts, extsz;
+
+	pthread_t thread;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* everything below is protected by lock */
+	unsigned rext;		/* extent being read */
+	uint64_t rpos;		/* position within it */
+	unsigned head, count;	/* oldest filled piece, number filled */
+	bool stop, done;
+	int error;
+	struct {
+		char *buf;
+		size_t len;
+	} slot[];
+};
+
+
+static void *kdz_ring_thread(void *opaque);
+
+
+struct kdz_ring *kdz_ring_open(int fd, size_t piece, unsigned depth)
+{
+	struct kdz_ring *ring;
+	unsigned i;
+
+	/* one being consumed, one being filled */
+	if(depth<2) depth=2;
+
+	if(!(ring=malloc(sizeof(struct kdz_ring)+sizeof(ring->slot[0])*depth)))
+		return NULL;
+
+	memset(ring, 0, sizeof(struct kdz_ring)+sizeof(ring->slot[0])*depth);
+	ring->fd=fd;
+	ring->piece=piece;
+	ring->depth=depth;
+
+	for(i=0; i<depth; ++i) if(posix_memalign((void **)&ring->slot[i].buf,
+4096, piece)) {
+		ring->slot[i].buf=NULL;
+		goto abort;
+	}
+
+	if(pthread_mutex_init(&ring->lock, NULL)) goto abort;
+	if(pthread_cond_init(&ring->cond, NULL)) {
+		pthread_mutex_destroy(&ring->lock);
+		goto abort;
+	}
+
+	return ring;
+
+abort:
+	for(i=0; i<depth; ++i) free(ring->slot[i].buf);
+	free(ring);
+	return NULL;
+}
+
+void kdz_ring_close(struct kdz_ring *ring)
+{
+	unsigned i;
+
+	if(!ring) return;
+
+	if(ring->started) {
+		pthread_mutex_lock(&ring->lock);
+		ring->stop=true;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+		pthread_join(ring->thread, NULL);
+	}
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	for(i=0; i<ring->depth; ++i) free(ring->slot[i].buf);
+	free(ring->ext);
+	free(ring);
+}
+
+
+bool kdz_ring_add(struct kdz_ring *ring, off64_t off, uint64_t len)
+{
+	if(ring->started) return false;
+	if(!len) return true;
+
+	if(ring->nexts==ring->extsz) {
+		const unsigned extsz=ring->extsz?ring->extsz*2:16;
+		void *const tmp=realloc(ring->ext, sizeof(ring->ext[0])*extsz);
+
+		if(!tmp) return false;
+		ring->ext=tmp;
+		ring->extsz=extsz;
+	}
+
+	ring->ext[ring->nexts].off=off;
+	ring->ext[ring->nexts].len=len;
+	++ring->nexts;
+
+	return true;
+}
+
+bool kdz_ring_start(struct kdz_ring *ring)
+{
+	int err;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if(ring->nexts) posix_fadvise(ring->fd, ring->ext[0].off, 0,
+POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if((err=pthread_create(&ring->thread, NULL, kdz_ring_thread, ring))) {
+		errno=err;
+		return false;
+	}
+	ring->started=true;
+
+	return true;
+}
+
+
+ssize_t kdz_ring_get(struct kdz_ring *ring, const char **buf)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&ring->lock);
+
+	while(!ring->count&&!ring->done) pthread_cond_wait(&ring->cond,
+&ring->lock);
+
+	if(ring->count) {
+		*buf=ring->slot[ring->head].buf;
+		ret=ring->slot[ring->head].len;
+	} else {
+		/* failed, or asked for more than was queued */
+		errno=ring->error?ring->error:EIO;
+		ret=-1;
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+
+	return ret;
+}
+
+void kdz_ring_put(struct kdz_ring *ring)
+{
+	pthread_mutex_lock(&ring->lock);
+
+	if(ring->count) {
+		ring->head=(ring->head+1)%ring->depth;
+		--ring->count;
+		pthread_cond_broadcast(&ring->cond);
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+}
+
+
+static void *kdz_ring_thread(void *opaque)
+{
+	struct kdz_ring *const ring=opaque;
+
+	pthread_mutex_lock(&ring->lock);
+
+	while(!ring->stop&&ring->rext<ring->nexts) {
+		const off64_t off=ring->ext[ring->rext].off+ring->rpos;
+		const uint64_t left=ring->ext[ring->rext].len-ring->rpos;
+		size_t len, cnt;
+		char *buf;
+		int err=0;
+
+		if(ring->count==ring->depth) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+			continue;
+		}
+
+		/* pieces end on piece boundaries, keeping the reads aligned */
+		len=ring->piece-off%ring->piece;
+		if(len>left) len=left;
+		buf=ring->slot[(ring->head+ring->count)%ring->depth].buf;
+
+		pthread_mutex_unlock(&ring->lock);
+
+		for(cnt=0; cnt<len; ) {
+			const ssize_t r=pread64(ring->fd, buf+cnt, len-cnt, off+cnt);
+
+			if(r>0) cnt+=r;
+			else if(r<0&&errno==EINTR) continue;
+			else {
+				err=r<0?errno:EIO;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&ring->lock);
+
+		if(err) {
+			ring->error=err;
+			break;
+		}
+
+		ring->slot[(ring->head+ring->count)%ring->depth].len=len;
+		++ring->count;
+		if((ring->rpos+=len)==ring->ext[ring->rext].len) {
+			++ring->rext;
+			ring->rpos=0;
+		}
+		pthread_cond_broadcast(&ring->cond);
+	}
+
+	ring->done=true;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
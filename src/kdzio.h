@@ -0,0 +1,76 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+*************************************************************************
+*$Id$			*
+************************************************************************/
+
+#ifndef _KDZIO_H_
+#define _KDZIO_H_
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+
+/* asynchronous reads and writes through io_uring, when the kernel has it;
+** otherwise, or once submitting fails, each request is done synchronously
+** as it is queued */
+struct kdz_io;
+
+/* completion tracking for a set of requests */
+struct kdz_iogroup {
+	unsigned pending;	/* requests still in flight */
+	int error;		/* first failure, as an errno value */
+};
+
+/* prepare for up to depth requests in flight */
+extern struct kdz_io *kdz_io_open(unsigned depth);
+/* waits for everything still in flight */
+extern void kdz_io_close(struct kdz_io *io);
+
+/* is io_uring actually in use? */
+extern bool kdz_io_async(const struct kdz_io *io);
+
+/* queue a read or write, the buffer must stay put until completion */
+extern bool kdz_io_pread(struct kdz_io *io, int fd, void *buf, size_t len,
+off64_t off, struct kdz_iogroup *grp);
+extern bool kdz_io_pwrite(struct kdz_io *io, int fd, const void *buf,
+size_t len, off64_t off, struct kdz_iogroup *grp);
+
+/* wait for all of a group's requests, false if any failed */
+extern bool kdz_io_wait(struct kdz_io *io, struct kdz_iogroup *grp);
+
+
+/* sequential reader, a thread reads queued extents of a file in large
+** aligned pieces into a ring ahead of the consumer */
+struct kdz_ring;
+
+/* depth is the number of pieces in the ring */
+extern struct kdz_ring *kdz_ring_open(int fd, size_t piece, unsigned depth);
+/* stops the thread, discarding anything unconsumed */
+extern void kdz_ring_close(struct kdz_ring *ring);
+
+/* queue an extent, only before kdz_ring_start() */
+extern bool kdz_ring_add(struct kdz_ring *ring, off64_t off, uint64_t len);
+extern bool kdz_ring_start(struct kdz_ring *ring);
+
+/* next piece, in order; pieces never span extents; -1 on failure */
+extern ssize_t kdz_ring_get(struct kdz_ring *ring, const char **buf);
+/* done with the piece from kdz_ring_get(), which must precede the next */
+extern void kdz_ring_put(struct kdz_ring *ring);
+
+#endif
@@ -0,0 +1,530 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+*************************************************************************
+*$Id$			*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <linux/fuse.h>
+
+#include "kdz.h"
+#include "md5.h"
+
+
+/* Android lacks libfuse, so this speaks the kernel protocol directly.  Only
+** the read-only subset is implemented: the root directory holds one file per
+** slice in the KDZ file, reads decompress only what they touch. */
+
+
+int verbose=0;
+
+
+/* one per slice in the KDZ file, inode numbers start at 2 */
+struct kdzfs_file {
+	char name[48];		/* slice name, device added if ambiguous */
+	const char *slice;	/* slice name in the KDZ */
+	uint32_t dev;
+	off64_t size;
+	unsigned opens;		/* reader is closed when this drops to 0 */
+	struct kdz_slice *reader;
+};
+
+static struct kdz_file *kdz=NULL;
+static struct kdzfs_file *files=NULL;
+static unsigned nfiles=0;
+static size_t cachesz=16<<20;
+static struct stat kdzstat;
+static const char *mntpoint;
+
+
+static bool kdzfs_files(void);
+static void kdzfs_loop(int fd);
+static void kdzfs_unmount(int sig);
+
+
+int main(int argc, char **argv)
+{
+	int ret=1;
+	int opt;
+	int fd=-1;
+	char opts[128];
+
+	while((opt=getopt(argc, argv, "c:vqhH?"))>=0) {
+		switch(opt) {
+		case 'c':
+			cachesz=strtoul(optarg, NULL, 0)<<20;
+			break;
+		case 'v':
+			if(verbose!=((int)-1>>1)) ++verbose;
+			break;
+
+		case 'q':
+			if(verbose!=~((int)-1>>1)) --verbose;
+			break;
+
+		case 'h':
+		case 'H':
+		case '?':
+			ret=0;
+			do {
+		default:
+				ret=1;
+			} while(0);
+			goto usage;
+		}
+	}
+
+	if(argc-optind!=2) {
+		ret=1;
+	usage:
+		fprintf(stderr,
+"Copyright (C) 2018 Elliott Mitchell, distributed under GPLv3\n"
+"Version: $Id$\n" "\n"
+"Usage: %s [-vq] [-c <MB>] <KDZ file> <mount point>\n"
+"  -h  Help, this message\n" "  -v  Verbose, increase verbosity\n"
+"  -q  Quiet, decrease verbosity\n"
+"  -c  Cache size per open slice in megabytes (default 16)\n"
+"Presents each slice of the KDZ file as a read-only file, only decompressing\n"
+"what is actually read.  Unmount to exit.\n", argv[0]);
+		return ret;
+	}
+
+	mntpoint=argv[optind+1];
+
+	md5_start();
+
+	if(stat(argv[optind], &kdzstat)<0||
+!(kdz=open_kdzfile_nodev(argv[optind]))) {
+		fprintf(stderr, "Failed to open KDZ file \"%s\", aborting\n",
+argv[optind]);
+		goto abort;
+	}
+
+	if(!kdzfs_files()) goto abort;
+
+	if((fd=open("/dev/fuse", O_RDWR))<0) {
+		fprintf(stderr, "%s: Failed to open /dev/fuse: %s\n", argv[0],
+strerror(errno));
+		goto abort;
+	}
+
+	snprintf(opts, sizeof(opts),
+"fd=%d,rootmode=40000,user_id=%u,group_id=%u,allow_other", fd, getuid(),
+getgid());
+
+	if(mount("kdzmount", mntpoint, "fuse", MS_NOSUID|MS_NODEV|MS_RDONLY,
+opts)) {
+		fprintf(stderr, "%s: Failed to mount on \"%s\": %s\n", argv[0],
+mntpoint, strerror(errno));
+		goto abort;
+	}
+
+	signal(SIGINT, kdzfs_unmount);
+	signal(SIGTERM, kdzfs_unmount);
+
+	if(verbose>=1) fprintf(stderr, "Mounted %u slices on \"%s\"\n", nfiles,
+mntpoint);
+
+	kdzfs_loop(fd);
+
+	ret=0;
+
+abort:
+	if(fd>=0) close(fd);
+
+	if(files) {
+		unsigned i;
+		for(i=0; i<nfiles; ++i) close_kdzslice(files[i].reader);
+		free(files);
+	}
+
+	if(kdz) close_kdzfile(kdz);
+
+	md5_stop();
+
+	return ret;
+}
+
+
+static void kdzfs_unmount(int sig)
+{
+	/* kernel then fails our read(), ending the loop */
+	umount2(mntpoint, MNT_DETACH);
+}
+
+
+/* collect the slices, checking their sizes */
+static bool kdzfs_files(void)
+{
+	unsigned i, j;
+
+	if(!(files=malloc(sizeof(files[0])*kdz->dz_file.chunk_count))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return false;
+	}
+
+	for(i=1; i<=kdz->dz_file.chunk_count; ++i) {
+		const struct dz_chunk *const dz=&kdz->chunks[i].dz;
+		struct kdz_slice *reader;
+
+		for(j=0; j<nfiles; ++j) if(files[j].dev==dz->device&&
+!strcmp(files[j].slice, dz->slice_name)) break;
+		if(j<nfiles) continue;
+
+		if(!(reader=open_kdzslice(kdz, dz->device, dz->slice_name, 0)))
+			return false;
+
+		files[nfiles].slice=dz->slice_name;
+		files[nfiles].dev=dz->device;
+		files[nfiles].size=kdzslice_size(reader);
+		files[nfiles].opens=0;
+		files[nfiles].reader=NULL;
+		snprintf(files[nfiles].name, sizeof(files[nfiles].name), "%s",
+dz->slice_name);
+		++nfiles;
+
+		close_kdzslice(reader);
+	}
+
+	/* PrimaryGPT and BackupGPT appear once per device */
+	for(i=0; i<nfiles; ++i) {
+		bool dup=false;
+
+		for(j=0; j<nfiles; ++j)
+			if(j!=i&&!strcmp(files[i].slice, files[j].slice)) dup=true;
+
+		if(dup) snprintf(files[i].name, sizeof(files[i].name),
+"%s.sd%c", files[i].slice, 'a'+files[i].dev);
+	}
+
+	return true;
+}
+
+
+static void kdzfs_reply(int fd, uint64_t unique, int error, const void *data,
+size_t len)
+{
+	struct fuse_out_header out;
+	struct iovec iov[2];
+
+	if(error) len=0;
+
+	out.len=sizeof(out)+len;
+	out.error=-error;
+	out.unique=unique;
+
+	iov[0].iov_base=&out;
+	iov[0].iov_len=sizeof(out);
+	iov[1].iov_base=(void *)data;
+	iov[1].iov_len=len;
+
+	if(writev(fd, iov, len?2:1)<0&&verbose>=1)
+		fprintf(stderr, "Reply failed: %s\n", strerror(errno));
+}
+
+static void kdzfs_attr(struct fuse_attr *attr, uint64_t ino)
+{
+	memset(attr, 0, sizeof(*attr));
+
+	attr->ino=ino;
+	attr->uid=getuid();
+	attr->gid=getgid();
+	attr->blksize=1<<16;
+	attr->atime=attr->mtime=attr->ctime=kdzstat.st_mtime;
+
+	if(ino==FUSE_ROOT_ID) {
+		attr->mode=S_IFDIR|0555;
+		attr->nlink=2;
+	} else {
+		attr->size=files[ino-2].size;
+		attr->blocks=(attr->size+511)/512;
+		attr->mode=S_IFREG|0444;
+		attr->nlink=1;
+	}
+}
+
+/* valid inode number? */
+#define KDZFS_INO(ino) ((ino)==FUSE_ROOT_ID||((ino)>=2&&(ino)<nfiles+2))
+
+static void kdzfs_loop(int fd)
+{
+	const size_t bufsz=(1<<17)+4096;
+	char *buf;
+	char *out=NULL;
+	size_t outsz=0;
+	ssize_t len;
+
+	if(!(buf=malloc(bufsz))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return;
+	}
+
+	while((len=read(fd, buf, bufsz))>=0||errno==EINTR||errno==ENOENT) {
+		const struct fuse_in_header *const in=(struct fuse_in_header *)buf;
+		const void *const arg=in+1;
+
+		/* interrupted, or the request was aborted */
+		if(len<(ssize_t)sizeof(*in)) continue;
+
+		if(verbose>=8) fprintf(stderr,
+"DEBUG: request %u on %llu\n", in->opcode, (unsigned long long)in->nodeid);
+
+		switch(in->opcode) {
+		case FUSE_INIT: {
+			const struct fuse_init_in *const init=arg;
+			struct fuse_init_out reply;
+
+			memset(&reply, 0, sizeof(reply));
+			reply.major=FUSE_KERNEL_VERSION;
+			reply.minor=FUSE_KERNEL_MINOR_VERSION;
+			reply.max_readahead=init->max_readahead;
+			reply.max_write=4096;
+
+			if(init->major!=FUSE_KERNEL_VERSION) {
+				fprintf(stderr, "Unsupported FUSE version %u\n",
+init->major);
+				kdzfs_reply(fd, in->unique, EPROTO, NULL, 0);
+				goto done;
+			}
+
+			kdzfs_reply(fd, in->unique, 0, &reply, init->minor<23?
+FUSE_COMPAT_22_INIT_OUT_SIZE:sizeof(reply));
+		}	break;
+
+		case FUSE_DESTROY:
+			kdzfs_reply(fd, in->unique, 0, NULL, 0);
+			goto done;
+
+		case FUSE_LOOKUP: {
+			const char *const name=arg;
+			struct fuse_entry_out reply;
+			unsigned i;
+
+			if(in->nodeid!=FUSE_ROOT_ID) {
+				kdzfs_reply(fd, in->unique, ENOENT, NULL, 0);
+				break;
+			}
+
+			for(i=0; i<nfiles; ++i) if(!strcmp(files[i].name, name))
+				break;
+
+			if(i>=nfiles) {
+				kdzfs_reply(fd, in->unique, ENOENT, NULL, 0);
+				break;
+			}
+
+			memset(&reply, 0, sizeof(reply));
+			reply.nodeid=i+2;
+			reply.entry_valid=reply.attr_valid=3600;
+			kdzfs_attr(&reply.attr, i+2);
+
+			kdzfs_reply(fd, in->unique, 0, &reply, sizeof(reply));
+		}	break;
+
+		case FUSE_GETATTR: {
+			struct fuse_attr_out reply;
+
+			if(!KDZFS_INO(in->nodeid)) {
+				kdzfs_reply(fd, in->unique, ENOENT, NULL, 0);
+				break;
+			}
+
+			memset(&reply, 0, sizeof(reply));
+			reply.attr_valid=3600;
+			kdzfs_attr(&reply.attr, in->nodeid);
+
+			kdzfs_reply(fd, in->unique, 0, &reply, sizeof(reply));
+		}	break;
+
+		case FUSE_OPEN: {
+			const struct fuse_open_in *const open=arg;
+			struct kdzfs_file *file;
+			struct fuse_open_out reply;
+
+			if(in->nodeid<2||!KDZFS_INO(in->nodeid)) {
+				kdzfs_reply(fd, in->unique, EISDIR, NULL, 0);
+				break;
+			}
+
+			if((open->flags&O_ACCMODE)!=O_RDONLY) {
+				kdzfs_reply(fd, in->unique, EROFS, NULL, 0);
+				break;
+			}
+
+			file=files+in->nodeid-2;
+
+			if(!file->reader&&!(file->reader=open_kdzslice(kdz,
+file->dev, file->slice, cachesz))) {
+				kdzfs_reply(fd, in->unique, EIO, NULL, 0);
+				break;
+			}
+			++file->opens;
+
+			memset(&reply, 0, sizeof(reply));
+			reply.fh=in->nodeid-2;
+			/* contents never change */
+			reply.open_flags=FOPEN_KEEP_CACHE;
+
+			kdzfs_reply(fd, in->unique, 0, &reply, sizeof(reply));
+		}	break;
+
+		case FUSE_READ: {
+			const struct fuse_read_in *const read=arg;
+			struct kdzfs_file *file;
+			ssize_t cnt;
+
+			if(read->fh>=nfiles||!files[read->fh].reader) {
+				kdzfs_reply(fd, in->unique, EBADF, NULL, 0);
+				break;
+			}
+			file=files+read->fh;
+
+			if(outsz<read->size) {
+				free(out);
+				outsz=read->size;
+				if(!(out=malloc(outsz))) {
+					outsz=0;
+					kdzfs_reply(fd, in->unique, ENOMEM, NULL, 0);
+					break;
+				}
+			}
+
+			if((cnt=pread_kdzslice(file->reader, out, read->size,
+read->offset))<0) {
+				kdzfs_reply(fd, in->unique, EIO, NULL, 0);
+				break;
+			}
+
+			kdzfs_reply(fd, in->unique, 0, out, cnt);
+		}	break;
+
+		case FUSE_RELEASE: {
+			const struct fuse_release_in *const release=arg;
+
+			if(release->fh<nfiles&&files[release->fh].opens&&
+!--files[release->fh].opens) {
+				close_kdzslice(files[release->fh].reader);
+				files[release->fh].reader=NULL;
+			}
+
+			kdzfs_reply(fd, in->unique, 0, NULL, 0);
+		}	break;
+
+		case FUSE_OPENDIR: {
+			struct fuse_open_out reply;
+
+			if(in->nodeid!=FUSE_ROOT_ID) {
+				kdzfs_reply(fd, in->unique, ENOTDIR, NULL, 0);
+				break;
+			}
+
+			memset(&reply, 0, sizeof(reply));
+			kdzfs_reply(fd, in->unique, 0, &reply, sizeof(reply));
+		}	break;
+
+		case FUSE_READDIR: {
+			const struct fuse_read_in *const read=arg;
+			uint64_t i;
+			size_t used=0;
+
+			if(outsz<read->size) {
+				free(out);
+				outsz=read->size;
+				if(!(out=malloc(outsz))) {
+					outsz=0;
+					kdzfs_reply(fd, in->unique, ENOMEM, NULL, 0);
+					break;
+				}
+			}
+
+			/* offsets 0 and 1 are "." and ".." */
+			for(i=read->offset; i<nfiles+2; ++i) {
+				struct fuse_dirent *const dirent=
+(struct fuse_dirent *)(out+used);
+				const char *const name=i==0?".":i==1?"..":
+files[i-2].name;
+				const size_t namelen=strlen(name);
+				const size_t entlen=FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET+
+namelen);
+
+				if(used+entlen>read->size) break;
+
+				memset(dirent, 0, entlen);
+				dirent->ino=i<2?FUSE_ROOT_ID:i;
+				dirent->off=i+1;
+				dirent->namelen=namelen;
+				dirent->type=i<2?DT_DIR:DT_REG;
+				memcpy(dirent->name, name, namelen);
+
+				used+=entlen;
+			}
+
+			kdzfs_reply(fd, in->unique, 0, out, used);
+		}	break;
+
+		case FUSE_STATFS: {
+			struct fuse_statfs_out reply;
+			unsigned i;
+
+			memset(&reply, 0, sizeof(reply));
+			reply.st.bsize=reply.st.frsize=4096;
+			for(i=0; i<nfiles; ++i)
+				reply.st.blocks+=(files[i].size+4095)/4096;
+			reply.st.files=nfiles+1;
+			reply.st.namelen=sizeof(files[0].name)-1;
+
+			kdzfs_reply(fd, in->unique, 0, &reply, sizeof(reply));
+		}	break;
+
+		case FUSE_RELEASEDIR:
+		case FUSE_FLUSH:
+		case FUSE_ACCESS:
+			kdzfs_reply(fd, in->unique, 0, NULL, 0);
+			break;
+
+		/* these never get replies */
+		case FUSE_FORGET:
+		case FUSE_BATCH_FORGET:
+		case FUSE_INTERRUPT:
+			break;
+
+		default:
+			kdzfs_reply(fd, in->unique, ENOSYS, NULL, 0);
+			break;
+		}
+	}
+
+	/* ENODEV is the normal result of being unmounted */
+	if(errno!=ENODEV) fprintf(stderr, "Failed reading FUSE requests: %s\n",
+strerror(errno));
+
+done:
+	free(buf);
+	if(out) free(out);
+}
+
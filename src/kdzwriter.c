@@ -37,6 +37,8 @@
 
 #include "kdz.h"
 #include "md5.h"
+#include "journal.h"
+#include "undo.h"
 
 
 int verbose=0;
@@ -44,6 +46,7 @@ int verbose=0;
 
 static struct kmod_file *read_kmods(bool simulate);
 static int write_kmods(struct kmod_file *kmod, bool simulate);
+static int rank_main(char *const names[], unsigned count);
 
 
 int main(int argc, char **argv)
@@ -60,6 +63,8 @@ int main(int argc, char **argv)
 		EXCL_WRITE=WRITE|0x2000,
 		RW_MASK	=0xF000,
 		REPORT	=READ|0x1,
+		FPRINT	=READ|0x2,
+		ESTIMATE=READ|0x3,
 		SYSTEM	=SHAR_WRITE|0x01,
 		MODEM	=SHAR_WRITE|0x02,
 		KERNEL	=SHAR_WRITE|0x04,
@@ -67,18 +72,42 @@ int main(int argc, char **argv)
 		OP	=SHAR_WRITE|0x10,
 		BOOTLOADER=EXCL_WRITE|0x1,
 		RESTORE	=EXCL_WRITE|0x2,
+		PLANNED	=EXCL_WRITE|0x4,
 		SLICES  =EXCL_WRITE|0x80,
 		MODE_MASK=0x0F,
 	} mode=0;
 	bool savekmods=1;
-
-	while((opt=getopt(argc, argv, "trsmckOSPabvqMBhH?"))>=0) {
+	char *fpname=NULL;
+	const char *jname=NULL;
+	const char *undoname=NULL, *rollname=NULL;
+	const char *planname=NULL;
+	double estfrac=0;
+	const char *targets[16];
+	bool tresults[16];
+	unsigned ntargets=0;
+	char *jbuf=NULL;
+	bool resume=false, widen=false;
+	unsigned wflags=0;
+	const char *slices[4];
+	int results[4];
+	unsigned i, nslices=0;
+
+	while((opt=getopt(argc, argv, "trfsmckOSPabedVRE:F:I:J:L:X:p:x:w:u:D:A:W:U:vqMBhH?"))>=0) {
 		switch(opt) {
 			int modecnt;
 		case 'r':
 			if(mode&~TEST) goto badmode;
 			mode|=REPORT;
 			break;
+		case 'f':
+			if(mode&~TEST) goto badmode;
+			mode|=FPRINT;
+			break;
+		case 'E':
+			if(mode&~TEST) goto badmode;
+			estfrac=strtod(optarg, NULL)/100;
+			mode|=ESTIMATE;
+			break;
 		case 't':
 			mode|=TEST;
 			break;
@@ -113,6 +142,21 @@ int main(int argc, char **argv)
 			if(mode&~TEST) goto badmode;
 			mode|=BOOTLOADER;
 			break;
+		case 'S':
+			if(mode&~TEST) goto badmode;
+			mode|=RESTORE;
+			break;
+
+		case 'p':
+			/* planning is simulating with a record kept */
+			planname=optarg;
+			mode|=TEST;
+			break;
+		case 'x':
+			if(mode&~TEST) goto badmode;
+			planname=optarg;
+			mode|=PLANNED;
+			break;
 
 		check_mode:
 			modecnt=0;
@@ -133,6 +177,69 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Multiple incompatible modes have been selected, cannot continue!\n");
 			return 1;
 
+		case 'e':
+			wflags|=KDZ_WRITE_EXT4;
+			break;
+		case 'd':
+			wflags|=KDZ_WRITE_DIRECT;
+			break;
+		case 'V':
+			wflags|=KDZ_WRITE_VERIFY;
+			break;
+		case 'R':
+			resume=true;
+			break;
+		case 'J':
+			jname=optarg;
+			break;
+		case 'L':
+			undoname=optarg;
+			break;
+		case 'F':
+			if(ntargets==sizeof(targets)/sizeof(targets[0])) {
+				fprintf(stderr, "Too many targets, at most %zu\n",
+sizeof(targets)/sizeof(targets[0]));
+				return 1;
+			}
+			targets[ntargets++]=optarg;
+			break;
+		case 'X':
+			rollname=optarg;
+			break;
+		case 'I':
+			/* no running system to keep modules for */
+			kdz_devices=optarg;
+			savekmods=0;
+			break;
+		case 'w':
+			kdz_dirty_max=strtoull(optarg, NULL, 0)<<20;
+			break;
+		case 'u':
+			kdz_io_depth=strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			kdz_write_amp=strtoul(optarg, NULL, 0);
+			widen=true;
+			break;
+		case 'U':
+			kdz_write_unit=strtoul(optarg, NULL, 0)<<10;
+			widen=true;
+			break;
+		case 'A':
+			kdz_readahead=strtoull(optarg, NULL, 0)<<20;
+			break;
+		case 'D':
+			if(!strcmp(optarg, "mmap")) kdz_devread=KDZ_DEVREAD_MMAP;
+			else if(!strcmp(optarg, "pread")) kdz_devread=KDZ_DEVREAD_PREAD;
+			else if(!strcmp(optarg, "direct"))
+				kdz_devread=KDZ_DEVREAD_DIRECT;
+			else {
+				fprintf(stderr, "Unknown device read method \"%s\"\n",
+optarg);
+				return 1;
+			}
+			break;
+
 		case 'B':
 			/* set blocksize (ever needed?) */
 			break;
@@ -153,17 +260,43 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* rolling back needs only the undo log */
+	if(rollname) {
+		if(mode&~TEST||argc!=optind) {
+			fprintf(stderr,
+"Rolling back excludes other modes and KDZ files\n");
+			return 1;
+		}
+		return undo_rollback(rollname, mode&TEST, kdz_open_named)?0:1;
+	}
+
+	/* several KDZ files only make sense for ranking */
+	if(argc-optind>1&&mode==TEST) {
+		md5_start();
+		ret=rank_main(argv+optind, argc-optind);
+		md5_stop();
+		return ret;
+	}
+
 	if(argc-optind!=1) {
 		ret=1;
 	usage:
 		fprintf(stderr,
 "Copyright (C) 2017-2018 Elliott Mitchell, distributed under GPLv3\n"
 "Version: $Id$\n" "\n"
-"Usage: %s [-trsmOPabvqB] <KDZ file>\n"
+"Usage: %s [-trfsmOPabSedVRvqB] [-w <MB>] [-u <depth>] [-D <method>] [-A <MB>]\n"
+"       [-W <factor>] [-U <KB>] [-J <journal>] [-L <undo log>] [-I <images>]\n"
+"       [-p <plan> | -x <plan> | -E <percent> | -F <target>...] <KDZ file>\n"
+"       %s -t <KDZ file> <KDZ file>...\n"
+"       %s [-t] [-I <images>] -X <undo log>\n"
 "  -h  Help, this message\n" "  -v  Verbose, increase verbosity\n"
 "  -q  Quiet, decrease verbosity\n"
-"  -t  Test, does the KDZ file appear applicable, simulates writing\n"
+"  -t  Test, does the KDZ file appear applicable, simulates writing; given\n"
+"      several KDZ files, rank them by how well they match this device\n"
 "  -r  Report, list status of KDZ chunks\n"
+"  -f  Fingerprint, save <KDZ file>.fp which is then used to speed testing\n"
+"  -E  Estimate, from a sample of this percentage of each slice's chunks and\n"
+"      blocks, how much a write would change and how long it would take\n"
 "  -a  Apply all, write all areas safe to write from KDZ\n"
 "  -s  System, write system area from KDZ\n"
 "  -M  Do NOT attempt to preserve old kernel modules\n"
@@ -174,19 +307,125 @@ int main(int argc, char **argv)
 "  -k  Kernel, write kernel/boot area from KDZ; need to restore system at\n"
 "      same time, or else be prepared to install new kernel immediately!\n"
 "  -b  Bootloader, write bootloader from KDZ; USED FOR RETURNING TO STOCK!\n"
-"Only one of -P, -b, or -r is allowed.  -a, -s, -m, -k, and -O may be used\n"
-"together, but they exclude the prior options.\n", argv[0]);
+"  -S  Stock, restore every slice from KDZ (GPTs must already match), all\n"
+"      devices at once and backup bootloader slices before the primaries\n"
+"  -e  Ext4, leave blocks which are free in the KDZ's filesystem alone (a\n"
+"      later -t will see those blocks as differing)\n"
+"  -d  Direct, write slices with O_DIRECT, bypassing the page cache\n"
+"  -w  Most megabytes of buffered writes waiting for the device (default 32,\n"
+"      0 leaves writeback to the kernel)\n"
+"  -u  Keep up to this many reads and writes in flight with io_uring while\n"
+"      writing (default 0, synchronous; without io_uring, before Linux 5.1,\n"
+"      or if it fails, I/O continues synchronously)\n"
+"  -V  Verify, read the written slices back bypassing the page cache and check\n"
+"      them against the KDZ's CRC32s (can't be combined with -e)\n"
+"  -R  Resume an interrupted write made with -J or -R, passing over the\n"
+"      chunks its journal records once a few of their blocks check out\n"
+"  -J  Journal finished chunks to this file, so an interrupted write can be\n"
+"      resumed (-R alone uses <KDZ file>.journal); removed once everything\n"
+"      is written.  Without -J or -R nothing is journaled\n"
+"  -L  Undo log, save the blocks about to be overwritten or trimmed,\n"
+"      compressed, to this file (best kept on another partition); an\n"
+"      existing log is added to, as with -R\n"
+"  -X  Roll back, restore the blocks saved in an undo log\n"
+"  -I  Images, work on image files instead of the device; \"%%c\" in the path\n"
+"      stands for the device letter (e.g. golden/sd%%c).  Trimmed areas and\n"
+"      zero runs become holes, kernel modules aren't kept\n"
+"  -F  Fan out, write the selected areas to this target set instead of the\n"
+"      device; \"%%c\" in it stands for the device letter (e.g.\n"
+"      /srv/rig1/sd%%c).  Repeat it for more sets, everything is decompressed\n"
+"      only once for all of them\n"
+"  -p  Plan, simulate writing the selected areas and save exactly what would\n"
+"      be done, reporting how much\n"
+"  -x  Execute a plan, provided the device hasn't changed since; only what\n"
+"      needs writing is decompressed\n"
+"  -D  How device contents are read for comparison: \"mmap\" (default),\n"
+"      \"pread\" in large batches, or \"direct\" for pread with O_DIRECT; -v\n"
+"      shows the throughput\n"
+"  -A  Megabytes of the KDZ file to read ahead of decompression when\n"
+"      reporting or writing (default 8, 0 reads through the mmap)\n"
+"  -W  Widen differing runs to whole device write units when at least\n"
+"      1/factor of the unit differs anyway (default 4, 0 never widens)\n"
+"  -U  Write unit in kilobytes (default from the device's queue limits)\n"
+"Only one of -P, -b, -S, -E, -f, or -r is allowed.  -a, -s, -m, -k, and -O may\n"
+"be used together, but they exclude the prior options.\n", argv[0], argv[0], argv[0]);
 		return ret;
 	}
 
+	/* blocks left alone can't match the KDZ's CRC32s */
+	if((wflags&(KDZ_WRITE_VERIFY|KDZ_WRITE_EXT4))==
+(KDZ_WRITE_VERIFY|KDZ_WRITE_EXT4)) {
+		fprintf(stderr, "-V and -e cannot be used together\n");
+		return 1;
+	}
+
+	/* the plan already says exactly what gets written */
+	if((mode&~TEST)==PLANNED&&(wflags&KDZ_WRITE_VERIFY||resume||jname||
+widen)) {
+		fprintf(stderr, "-x cannot be used with -V, -R, -J, -W, or -U\n");
+		return 1;
+	}
+
+	/* the bootloader write is all or nothing, no journal to resume from */
+	if((mode&~TEST)==BOOTLOADER&&(resume||jname)) {
+		fprintf(stderr, "-b cannot be used with -J or -R\n");
+		return 1;
+	}
+
+	/* plans are only made of area writes */
+	if(planname&&(mode&~TEST)!=PLANNED&&(mode&RW_MASK)!=SHAR_WRITE) {
+		fprintf(stderr, "-p only goes with -a, -s, -m, -c, and -k\n");
+		return 1;
+	}
+
+	/* the targets get plain writes of the areas, nothing more */
+	if(ntargets&&((mode&RW_MASK)!=SHAR_WRITE||planname||undoname||resume||
+wflags&(KDZ_WRITE_EXT4|KDZ_WRITE_DIRECT|KDZ_WRITE_VERIFY))) {
+		fprintf(stderr, "-F only goes with -a, -s, -m, -c, -k, and -t\n");
+		return 1;
+	}
+
+	if(mode&TEST) wflags|=KDZ_WRITE_SIMULATE;
+
 	md5_start();
 
-	if(!(kdz=open_kdzfile(argv[optind]))) {
+	/* targets stand in for this device */
+	if(!(kdz=ntargets?open_kdzfile_nodev(argv[optind]):
+open_kdzfile(argv[optind]))) {
 		fprintf(stderr, "Failed to open KDZ file \"%s\", aborting\n", argv[optind]);
 		ret=1;
 		goto abort;
 	}
 
+	if(!(fpname=malloc(strlen(argv[optind])+4))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		ret=1;
+		goto abort;
+	}
+	strcpy(fpname, argv[optind]);
+	strcat(fpname, ".fp");
+
+	/* journaling is only done when asked for, -R alone uses the default */
+	if(!jname&&resume) {
+		if(!(jbuf=malloc(strlen(argv[optind])+9))) {
+			fprintf(stderr, "Memory allocation failure\n");
+			ret=1;
+			goto abort;
+		}
+		strcpy(jbuf, argv[optind]);
+		strcat(jbuf, ".journal");
+		jname=jbuf;
+	}
+
+	/* a fingerprint alongside the KDZ file lets testing skip inflating;
+	** fanout tests nothing, and without a device can't check the records */
+	if((mode&~TEST)!=FPRINT&&!ntargets) load_kdzfp(kdz, fpname);
+
+	/* these rewrite slices testing inflates, so inflate those only once;
+	** -b leaves the likes of factory and sec alone, no point keeping them */
+	if((mode&~TEST)==BOOTLOADER) kdz->keep=1<<KDZ_SLICE_BOOT|1<<KDZ_SLICE_BACKUP;
+	else if((mode&~TEST)==RESTORE) kdz->keep=~0U;
+
 
 	/* one final warning before doing the deed */
 	if(mode&WRITE&&!(mode&TEST)) {
@@ -244,6 +483,18 @@ int main(int argc, char **argv)
 	case REPORT|TEST:
 		ret=report_kdzfile(kdz);
 		break;
+	case FPRINT:
+	case FPRINT|TEST:
+		if(!write_kdzfp(kdz, fpname)) {
+			fprintf(stderr, "%s: Failed to fingerprint KDZ file\n",
+argv[0]);
+			ret=1;
+		}
+		break;
+	case ESTIMATE:
+	case ESTIMATE|TEST:
+		if(!estimate_kdzfile(kdz, estfrac)) ret=1;
+		break;
 	case TEST:
 		ret=test_kdzfile(kdz);
 		{
@@ -270,7 +521,34 @@ int main(int argc, char **argv)
 			ret=8;
 			goto abort;
 		}
-		printf("Write everything (to be implemented)\n");
+
+		printf("Begining restore of everything%s\n", mode&TEST?" (simulated)":"");
+
+		if(jname&&!(mode&TEST)&&
+!(kdz_journal=kdz_journal_open(kdz, jname, resume)))
+			fprintf(stderr, "%s: Continuing without a journal\n", argv[0]);
+
+		if(undoname&&!(mode&TEST)&&!(kdz_undo=undo_open(undoname))) {
+			fprintf(stderr,
+"%s: Unable to save old contents, abandoning operation!\n", argv[0]);
+			kdz_journal_close(kdz_journal, true);
+			kdz_journal=NULL;
+			ret=1;
+			goto abort;
+		}
+
+		if(!restore_kdzfiles(kdz, wflags)) {
+			fprintf(stderr,
+"%s: Failed while restoring, the device needs another attempt!\n", argv[0]);
+			ret=1;
+		}
+		kdz_journal_close(kdz_journal, !ret);
+		kdz_journal=NULL;
+
+		if(!undo_close(kdz_undo)) ret=1;
+		kdz_undo=NULL;
+
+		printf("Finished restore%s\n", mode&TEST?" (simulated)":"");
 		break;
 	case BOOTLOADER:
 	case BOOTLOADER|TEST:
@@ -281,7 +559,67 @@ int main(int argc, char **argv)
 			ret=8;
 			goto abort;
 		}
-		printf("Write bootloader (to be implemented)\n");
+
+		printf("Begining rewrite of bootloader%s\n", mode&TEST?" (simulated)":"");
+
+		if(undoname&&!(mode&TEST)&&!(kdz_undo=undo_open(undoname))) {
+			fprintf(stderr,
+"%s: Unable to save old contents, abandoning operation!\n", argv[0]);
+			ret=1;
+			goto abort;
+		}
+
+		if(!bootloader_kdzfiles(kdz, wflags)) {
+			fprintf(stderr,
+"%s: Failed while writing bootloader, DO NOT REBOOT until it is written!\n",
+argv[0]);
+			ret=1;
+		}
+
+		if(!undo_close(kdz_undo)) ret=1;
+		kdz_undo=NULL;
+
+		printf("Finished rewrite of bootloader%s\n", mode&TEST?" (simulated)":"");
+		break;
+	case PLANNED:
+	case PLANNED|TEST:
+		/* only a plan including system disturbs the modules */
+		if(savekmods) switch(exec_kdzplan_writes(kdz, planname, "system")) {
+		case -1:
+			ret=1;
+			goto abort;
+		case 0:
+			savekmods=0;
+		}
+		if(savekmods&&!(kmods=read_kmods(mode&TEST?1:0))) {
+			fprintf(stderr, "%s: Failed while reading kernel modules\n",
+argv[0]);
+			ret=64;
+			goto abort;
+		}
+
+		if(undoname&&!(mode&TEST)&&!(kdz_undo=undo_open(undoname))) {
+			fprintf(stderr,
+"%s: Unable to save old contents, abandoning operation!\n", argv[0]);
+			ret=1;
+			goto abort;
+		}
+
+		if(!exec_kdzplan(kdz, planname, wflags)) {
+			fprintf(stderr,
+"%s: Failed while executing plan \"%s\"\n", argv[0], planname);
+			ret=1;
+		}
+
+		if(!undo_close(kdz_undo)) ret=1;
+		kdz_undo=NULL;
+
+		if(savekmods&&!write_kmods(kmods, mode&TEST?1:0)) {
+			fprintf(stderr,
+"%s: Failed while restoring kernel modules, recommend kernel reinstall!\n",
+argv[0]);
+			ret=1;
+		}
 		break;
 	case SLICES:
 	case SLICES|TEST:
@@ -308,7 +646,7 @@ argv[0]);
 		break;
 	default:
 		if((mode&WRITE)==WRITE) {
-			if(test_kdzfile(kdz)<=0) {
+			if(!ntargets&&test_kdzfile(kdz)<=0) {
 				fprintf(stderr,
 "%s: This KDZ file does not appear to be applicable to this device,\n"
 "abandoning operation!\n", argv[0]);
@@ -317,49 +655,89 @@ argv[0]);
 			}
 
 			if(mode&SYSTEM&~SHAR_WRITE) {
-				printf("Begining rewrite of system area%s\n",
-mode&TEST?" (simulated)":"");
-				if(savekmods&&!(kmods=read_kmods(mode&TEST?1:0))) {
+				/* a plan writes nothing */
+				if(savekmods&&!planname&&!ntargets&&
+!(kmods=read_kmods(mode&TEST?1:0))) {
 					fprintf(stderr,
 "%s: Failed while reading kernel modules\n", argv[0]);
 					ret=64;
 					goto abort;
 				}
-				if(!write_kdzfile(kdz, "system", mode&TEST?1:0)) {
-					fprintf(stderr,
-"%s: Failed while writing /system, major problem, PANIC!\n", argv[0]);
-					ret=7;
-				}
-				if(savekmods&&!write_kmods(kmods, mode&TEST?1:0)) {
-					fprintf(stderr,
-"%s: Failed while restoring kernel modules, recommend kernel reinstall!\n",
-argv[0]);
+				slices[nslices++]="system";
+			}
+			if(mode&MODEM&~SHAR_WRITE) slices[nslices++]="modem";
+			if(mode&CUST&~SHAR_WRITE) slices[nslices++]="cust";
+			if(mode&OP&~SHAR_WRITE) {
+				printf("Write OP (to be implemented)\n");
+			}
+			if(mode&KERNEL&~SHAR_WRITE) slices[nslices++]="boot";
+
+			/* slices on different devices are written concurrently */
+			for(i=0; i<nslices; ++i) printf("Begining rewrite of %s area%s\n",
+slices[i], mode&TEST?" (simulated)":"");
+
+			if(planname) {
+				if(!plan_kdzfiles(kdz, slices, nslices, wflags, planname)) {
+					fprintf(stderr, "%s: Failed to make a plan\n", argv[0]);
 					ret=1;
 				}
-				printf("Finished rewrite of system area%s\n",
-mode&TEST?" (simulated)":"");
+				break;
 			}
-			if(mode&MODEM&~SHAR_WRITE) {
-				printf("Begining rewrite of modem area%s\n",
-mode&TEST?" (simulated)":"");
-				write_kdzfile(kdz, "modem", mode&TEST?1:0);
-				printf("Finished rewrite of modem area%s\n",
-mode&TEST?" (simulated)":"");
-			}
-			if(mode&CUST&~SHAR_WRITE) {
-				printf("Begining rewrite of cust area%s\n",
-mode&TEST?" (simulated)":"");
-				write_kdzfile(kdz, "cust", mode&TEST?1:0);
-				printf("Finished rewrite of cust area%s\n",
-mode&TEST?" (simulated)":"");
+
+			if(ntargets) {
+				if(!fanout_kdzfiles(kdz, slices, nslices, targets, tresults,
+ntargets, wflags)) ret=1;
+				for(i=0; i<ntargets; ++i) if(!tresults[i]) fprintf(stderr,
+"%s: Failed while writing to \"%s\"\n", argv[0], targets[i]);
+				break;
 			}
-			if(mode&OP&~SHAR_WRITE) {
-				printf("Write OP (to be implemented)\n");
+
+			/* with -J or -R finished chunks are journaled, so an interruption
+			** can resume */
+			if(jname&&!(mode&TEST)&&nslices&&
+!(kdz_journal=kdz_journal_open(kdz, jname, resume)))
+				fprintf(stderr, "%s: Continuing without a journal\n", argv[0]);
+
+			if(undoname&&!(mode&TEST)&&nslices&&
+!(kdz_undo=undo_open(undoname))) {
+				fprintf(stderr,
+"%s: Unable to save old contents, abandoning operation!\n", argv[0]);
+				kdz_journal_close(kdz_journal, true);
+				kdz_journal=NULL;
+				ret=1;
+				goto abort;
 			}
-			if(mode&KERNEL&~SHAR_WRITE) {
-				printf("Begining reinstall of stock kernel/boot%s\n", mode&TEST?" (simulated)":"");
-				write_kdzfile(kdz, "boot", mode&TEST?1:0);
-				printf("Finished reinstall of boot area%s\n",
+
+			/* the journal is only needed if something didn't finish */
+			kdz_journal_close(kdz_journal,
+write_kdzfiles(kdz, slices, results, nslices, wflags));
+			kdz_journal=NULL;
+
+			if(!undo_close(kdz_undo)) ret=1;
+			kdz_undo=NULL;
+
+			for(i=0; i<nslices; ++i) {
+				if(!strcmp(slices[i], "system")) {
+					if(!results[i]) {
+						fprintf(stderr,
+"%s: Failed while writing /system, major problem, PANIC!\n", argv[0]);
+						ret=7;
+					}
+					/* only once system is done */
+					if(savekmods&&!write_kmods(kmods, mode&TEST?1:0)) {
+						fprintf(stderr,
+"%s: Failed while restoring kernel modules, recommend kernel reinstall!\n",
+argv[0]);
+						ret=1;
+					}
+				} else if(!results[i]) {
+					fprintf(stderr, "%s: Failed while writing %s area\n",
+argv[0], slices[i]);
+					/* a system failure's status says more */
+					if(!ret) ret=1;
+				}
+
+				printf("Finished rewrite of %s area%s\n", slices[i],
 mode&TEST?" (simulated)":"");
 			}
 		} else {
@@ -371,12 +749,66 @@ mode&TEST?" (simulated)":"");
 abort:
 	if(kdz) close_kdzfile(kdz);
 
+	if(fpname) free(fpname);
+	free(jbuf);
+
 	md5_stop();
 
 	return ret;
 }
 
 
+static int rank_main(char *const names[], unsigned count)
+{
+	struct kdz_rank *cand;
+	char *fpname;
+	unsigned i, opened=0;
+	int ret=0;
+
+	if(!(cand=malloc(sizeof(cand[0])*count))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		return 1;
+	}
+
+	for(i=0; i<count; ++i) {
+		if(!(cand[opened].kdz=open_kdzfile(names[i]))) {
+			fprintf(stderr, "Failed to open KDZ file \"%s\", skipping\n",
+names[i]);
+			ret=1;
+			continue;
+		}
+		cand[opened].name=names[i];
+
+		if((fpname=malloc(strlen(names[i])+4))) {
+			strcpy(fpname, names[i]);
+			strcat(fpname, ".fp");
+			load_kdzfp(cand[opened].kdz, fpname);
+			free(fpname);
+		}
+
+		++opened;
+	}
+
+	if(!rank_kdzfiles(cand, opened)) ret=1;
+	else for(i=0; i<opened; ++i) {
+		const char *res;
+		if(cand[i].result==0) res="not applicable";
+		else if(cand[i].result==1) res="applicable";
+		else if(cand[i].result==2) res="applicable, matches original";
+		else res="failure while testing";
+
+		printf("%2u: %-28s %10llu mismatched blocks  %s\n", i+1, res,
+(unsigned long long)cand[i].mismatched, cand[i].name);
+	}
+
+	for(i=0; i<opened; ++i) close_kdzfile(cand[i].kdz);
+
+	free(cand);
+
+	return ret;
+}
+
+
 #ifndef BUILDTIME_LINK_LIBS
 /* wrap the libselinux symbols we need */
 static void *libselinux=NULL;
@@ -37,6 +37,7 @@
 #include <dlfcn.h>
 
 #include "gpt.h"
+#include "discard.h"
 
 
 #if defined(DEBUG)||defined(DISABLE_WRITES)
@@ -82,6 +83,8 @@ int main(int argc, char **argv)
 	const char *actstr;
 	char *buf=NULL;
 	char *secon=NULL;
+	uint64_t opstart, opend;
+	struct discard *dsc=NULL;
 
 	enum {
 		UNSPEC=0,
@@ -222,6 +225,10 @@ argv[0]);
 			goto abort;
 		}
 
+	/* the entry may be cleared below */
+	opstart=gpt->entry[OP].startLBA;
+	opend=gpt->entry[OP].endLBA;
+
 	data=0;
 	while(strcmp(gpt->entry[data].name, "userdata"))
 		if(++data>=gpt->head.entryCount)
@@ -331,7 +338,6 @@ argv[0]);
 
 	if(mode==MERGEDATA) {
 		int bufcnt, cur;
-		uint64_t range[2];
 
 		if(mkdir("/cust", 0777)<0) {
 			struct stat buf;
@@ -499,13 +505,6 @@ strerror(errno));
 
 		free(buf);
 		buf=NULL;
-
-
-		range[0]=0;
-		range[1]=(gpt->entry[OP].endLBA-gpt->entry[OP].startLBA)*gpt->blocksz;
-#if !defined(DISABLE_WRITES)&&!defined(DEBUG)
-		ioctl(dev, BLKDISCARD, range);
-#endif
 	}
 
 
@@ -519,6 +518,25 @@ strerror(errno));
 
 		ret=0;
 
+		/* the old OP area now belongs to userdata, its contents are
+		** garbage; not before the new GPT is written though, as the old
+		** one still maps it */
+#if !defined(DISABLE_WRITES)&&!defined(DEBUG)
+		if(mode==MERGEDATA) {
+			if(!(dsc=discard_open(dev))) {
+				uint64_t range[2]={opstart*gpt->blocksz,
+(opend-opstart+1)*gpt->blocksz};
+
+				ioctl(dev, BLKDISCARD, range);
+			} else discard_add(dsc, opstart*gpt->blocksz,
+(opend-opstart+1)*gpt->blocksz);
+		}
+#endif
+
+		if(!discard_close(dsc, "old OP area")) printf(
+"Discarding old OP area had failures, it may use more flash for a while\n");
+		dsc=NULL;
+
 		if(ioctl(dev, BLKRRPART, NULL))
 			printf(
 "\nAttempt to reload kernel table failed, kernel is still using old table.\n"
@@ -527,6 +545,8 @@ strerror(errno));
 
 
 abort:
+	discard_close(dsc, NULL);
+
 	umount("/cust");
 
 	if(buf) free(buf);
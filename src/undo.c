@@ -0,0 +1,559 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "undo.h"
+
+
+/* from the program */
+extern int verbose;
+
+/* data is split into pieces of this size, each compressed by itself */
+#define UNDO_PIECE (1<<20)
+/* most uncompressed bytes waiting for the threads before undo_add() waits */
+#define UNDO_QUEUED (64<<20)
+/* most compression threads */
+#define UNDO_THREADS 4
+
+const char undo_magic[UNDO_MAGIC_LEN]={'K', 'D', 'Z', 'u', 'n', 0x00, 0x0D,
+0x0A};
+
+struct undo_job {
+	struct undo_job *next;
+	struct undo_rec rec;	/* host byte order until written */
+	char data[];
+};
+
+struct undo {
+	int fd;
+	char *filename;
+	unsigned nthreads;
+	pthread_t threads[UNDO_THREADS];
+
+	pthread_mutex_t wlock;	/* appending to the file */
+
+	pthread_mutex_t lock;
+	pthread_cond_t more, room;
+
+	/* everything below is protected by lock */
+	struct undo_job *head, **tail;
+	size_t queued;
+	bool closing, failed;
+	uint64_t bytes, zbytes;
+	unsigned count;
+};
+
+
+static bool undo_write(int fd, const void *buf, size_t len)
+{
+	const char *p=buf;
+
+	while(len) {
+		const ssize_t r=write(fd, p, len);
+
+		if(r<0&&errno==EINTR) continue;
+		if(r<=0) return false;
+
+		p+=r;
+		len-=r;
+	}
+
+	return true;
+}
+
+/* compress a piece and append it */
+static void undo_compress(struct undo *u, struct undo_job *job)
+{
+	uLongf zlen=compressBound(job->rec.len);
+	struct undo_rec rec=job->rec;
+	char *zbuf;
+	bool ok=false;
+
+	if(!(zbuf=malloc(zlen))) fprintf(stderr, "Memory allocation failure\n");
+	else if(compress2((Bytef *)zbuf, &zlen, (Bytef *)job->data, job->rec.len,
+Z_BEST_SPEED)!=Z_OK) fprintf(stderr, "Compression failed for undo log\n");
+	else {
+		rec.off=htole64(rec.off);
+		rec.len=htole32(rec.len);
+		rec.zlen=htole32(zlen);
+		rec.crc32=htole32(crc32(crc32(0, Z_NULL, 0), (Bytef *)job->data,
+job->rec.len));
+
+		pthread_mutex_lock(&u->wlock);
+		if(!(ok=undo_write(u->fd, &rec, sizeof(rec))&&
+undo_write(u->fd, zbuf, zlen))) fprintf(stderr,
+"Failed while writing \"%s\": %s\n", u->filename, strerror(errno));
+		pthread_mutex_unlock(&u->wlock);
+	}
+
+	free(zbuf);
+
+	pthread_mutex_lock(&u->lock);
+	if(ok) {
+		u->bytes+=job->rec.len;
+		u->zbytes+=sizeof(rec)+zlen;
+		++u->count;
+	} else u->failed=true;
+	pthread_mutex_unlock(&u->lock);
+}
+
+static void *undo_thread(void *opaque)
+{
+	struct undo *const u=opaque;
+
+	pthread_mutex_lock(&u->lock);
+	for(;;) {
+		struct undo_job *job;
+
+		while(!u->head&&!u->closing) pthread_cond_wait(&u->more, &u->lock);
+		if(!(job=u->head)) break;
+
+		if(!(u->head=job->next)) u->tail=&u->head;
+		pthread_mutex_unlock(&u->lock);
+
+		undo_compress(u, job);
+
+		pthread_mutex_lock(&u->lock);
+		u->queued-=job->rec.len;
+		pthread_cond_broadcast(&u->room);
+		free(job);
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return NULL;
+}
+
+/* is the rest of the file zeros, as a crash can leave it? */
+static bool undo_zeros(int fd, char *buf)
+{
+	ssize_t r, i;
+
+	while((r=read(fd, buf, UNDO_PIECE))>0)
+		for(i=0; i<r; ++i) if(buf[i]) return false;
+
+	return !r;
+}
+
+/* read and check the next record, 0 at the end, -1 if corrupt; a crash
+** while appending leaves a bad record reaching the end of the file, which
+** is taken to be the end as well */
+static int undo_next(int fd, struct undo_rec *rec, char *zbuf, char *buf)
+{
+	const off64_t at=lseek(fd, 0, SEEK_CUR);
+	ssize_t r;
+	uLongf len=UNDO_PIECE;
+	off64_t end;
+
+	if(!(r=read(fd, rec, sizeof(*rec)))) return 0;
+	if(r!=sizeof(*rec)) goto torn;
+
+	rec->off=le64toh(rec->off);
+	rec->len=le32toh(rec->len);
+	rec->zlen=le32toh(rec->zlen);
+	rec->crc32=le32toh(rec->crc32);
+
+	if(!rec->len||rec->len>UNDO_PIECE||rec->zlen>compressBound(UNDO_PIECE)||
+memchr(rec->slice_name, '\0', sizeof(rec->slice_name))==NULL||
+strchr(rec->slice_name, '/')||!rec->slice_name[0]) {
+		if(lseek(fd, at, SEEK_SET)==at&&undo_zeros(fd, buf)) goto torn;
+		return -1;
+	}
+
+	if(read(fd, zbuf, rec->zlen)!=rec->zlen||
+uncompress((Bytef *)buf, &len, (Bytef *)zbuf, rec->zlen)!=Z_OK||
+len!=rec->len||crc32(crc32(0, Z_NULL, 0), (Bytef *)buf, len)!=rec->crc32) {
+		if((end=lseek(fd, 0, SEEK_END))<0||
+at+(off64_t)sizeof(*rec)+rec->zlen<end) return -1;
+		goto torn;
+	}
+
+	return 1;
+
+torn:
+	if((end=lseek(fd, 0, SEEK_END))<0||lseek(fd, at, SEEK_SET)!=at)
+		return -1;
+
+	/* the position is left at the end of the good records */
+	if(verbose>=0) fprintf(stderr,
+"Ignoring %lld bytes of a torn record at the end of the undo log\n",
+(long long)(end-at));
+
+	return 0;
+}
+
+/* check an existing log, *end gets where its last good record ends */
+static bool undo_check(int fd, off64_t *end)
+{
+	struct undo_head head;
+	struct undo_rec rec;
+	char *zbuf, *buf=NULL;
+	int r=-1;
+
+	if(lseek(fd, 0, SEEK_SET)!=0||read(fd, &head, sizeof(head))!=sizeof(head)||
+memcmp(head.magic, undo_magic, UNDO_MAGIC_LEN)||le32toh(head.version)!=1)
+		return false;
+
+	if(!(zbuf=malloc(compressBound(UNDO_PIECE)))||!(buf=malloc(UNDO_PIECE))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		goto abort;
+	}
+
+	while((r=undo_next(fd, &rec, zbuf, buf))>0);
+
+	*end=lseek(fd, 0, SEEK_CUR);
+
+abort:
+	free(zbuf);
+	free(buf);
+
+	return !r&&*end>=0;
+}
+
+struct undo *undo_open(const char *filename)
+{
+	struct undo *u;
+	struct undo_head head;
+	off64_t end;
+	long cpus;
+
+	if(!(u=calloc(1, sizeof(*u)))||!(u->filename=strdup(filename))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		free(u);
+		return NULL;
+	}
+
+	if((u->fd=open(filename, O_RDWR|O_CREAT|O_LARGEFILE, 0600))<0) {
+		fprintf(stderr, "Failed to create \"%s\": %s\n", filename,
+strerror(errno));
+		free(u->filename);
+		free(u);
+		return NULL;
+	}
+
+	if((end=lseek(u->fd, 0, SEEK_END))<0) goto abort_io;
+
+	/* a resumed write adds to the interrupted one's log, which holds the
+	** only copy of what that run overwrote */
+	if(end>0) {
+		if(!undo_check(u->fd, &end)) {
+			fprintf(stderr,
+"\"%s\" isn't a usable undo log, refusing to replace it\n", filename);
+			goto abort;
+		}
+
+		if(ftruncate(u->fd, end)<0||lseek(u->fd, end, SEEK_SET)!=end)
+			goto abort_io;
+
+		if(verbose>=0) printf("Adding to the existing undo log \"%s\"\n",
+filename);
+	} else {
+		memcpy(head.magic, undo_magic, UNDO_MAGIC_LEN);
+		head.version=htole32(1);
+		if(!undo_write(u->fd, &head, sizeof(head))) {
+			fprintf(stderr, "Failed while writing \"%s\": %s\n", filename,
+strerror(errno));
+			close(u->fd);
+			unlink(filename);
+			free(u->filename);
+			free(u);
+			return NULL;
+		}
+	}
+
+	u->tail=&u->head;
+	pthread_mutex_init(&u->wlock, NULL);
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->more, NULL);
+	pthread_cond_init(&u->room, NULL);
+
+	if((cpus=sysconf(_SC_NPROCESSORS_ONLN))<1) cpus=1;
+	if(cpus>UNDO_THREADS) cpus=UNDO_THREADS;
+
+	/* without any threads undo_add() compresses by itself */
+	for(; u->nthreads<cpus; ++u->nthreads) if(pthread_create(
+u->threads+u->nthreads, NULL, undo_thread, u)) break;
+
+	if(!u->nthreads&&verbose>=1) fprintf(stderr,
+"Unable to compress the undo log in the background\n");
+
+	return u;
+
+abort_io:
+	fprintf(stderr, "Failed while opening \"%s\": %s\n", filename,
+strerror(errno));
+abort:
+	close(u->fd);
+	free(u->filename);
+	free(u);
+	return NULL;
+}
+
+bool undo_add(struct undo *u, const char *slice_name, uint64_t off,
+const void *buf, size_t len)
+{
+	const char *p=buf;
+
+	while(len) {
+		const size_t n=len>UNDO_PIECE?UNDO_PIECE:len;
+		struct undo_job *job;
+
+		if(!(job=malloc(sizeof(*job)+n))) {
+			fprintf(stderr, "Memory allocation failure\n");
+			pthread_mutex_lock(&u->lock);
+			u->failed=true;
+			pthread_mutex_unlock(&u->lock);
+			return false;
+		}
+
+		job->next=NULL;
+		memset(&job->rec, 0, sizeof(job->rec));
+		strncpy(job->rec.slice_name, slice_name,
+sizeof(job->rec.slice_name)-1);
+		job->rec.off=off;
+		job->rec.len=n;
+		memcpy(job->data, p, n);
+
+		if(!u->nthreads) {
+			undo_compress(u, job);
+			free(job);
+		} else {
+			pthread_mutex_lock(&u->lock);
+			while(u->queued&&u->queued+n>UNDO_QUEUED)
+				pthread_cond_wait(&u->room, &u->lock);
+			*u->tail=job;
+			u->tail=&job->next;
+			u->queued+=n;
+			pthread_cond_signal(&u->more);
+			pthread_mutex_unlock(&u->lock);
+		}
+
+		p+=n;
+		off+=n;
+		len-=n;
+	}
+
+	return !u->failed;
+}
+
+bool undo_sync(struct undo *u)
+{
+	bool ret;
+
+	if(!u) return true;
+
+	pthread_mutex_lock(&u->lock);
+	while(u->queued) pthread_cond_wait(&u->room, &u->lock);
+	pthread_mutex_unlock(&u->lock);
+
+	pthread_mutex_lock(&u->wlock);
+	if(!(ret=fsync(u->fd)>=0)) fprintf(stderr,
+"Failed while writing \"%s\": %s\n", u->filename, strerror(errno));
+	pthread_mutex_unlock(&u->wlock);
+
+	pthread_mutex_lock(&u->lock);
+	if(!ret) u->failed=true;
+	ret=!u->failed;
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+bool undo_close(struct undo *u)
+{
+	unsigned i;
+	bool ret;
+
+	if(!u) return true;
+
+	pthread_mutex_lock(&u->lock);
+	u->closing=true;
+	pthread_cond_broadcast(&u->more);
+	pthread_mutex_unlock(&u->lock);
+
+	for(i=0; i<u->nthreads; ++i) pthread_join(u->threads[i], NULL);
+
+	if(fsync(u->fd)<0||close(u->fd)<0) {
+		fprintf(stderr, "Failed while writing \"%s\": %s\n", u->filename,
+strerror(errno));
+		u->failed=true;
+	}
+
+	if(u->failed) fprintf(stderr, "Undo log \"%s\" is incomplete!\n",
+u->filename);
+	else if(verbose>=1) printf(
+"Saved %llu bytes of old contents in %u pieces to \"%s\" (%llu bytes)\n",
+(unsigned long long)u->bytes, u->count, u->filename,
+(unsigned long long)u->zbytes);
+
+	ret=!u->failed;
+
+	pthread_mutex_destroy(&u->wlock);
+	pthread_mutex_destroy(&u->lock);
+	pthread_cond_destroy(&u->more);
+	pthread_cond_destroy(&u->room);
+	free(u->filename);
+	free(u);
+
+	return ret;
+}
+
+
+bool undo_rollback(const char *filename, bool simulate,
+undo_openfunc open_slice)
+{
+	struct undo_head head;
+	struct undo_rec rec;
+	char *zbuf=NULL, *buf=NULL;
+	struct {
+		char name[32];
+		int fd;
+		off64_t base;
+	} *slices=NULL;
+	off64_t *pos=NULL;
+	unsigned nslices=0, npos=0, count=0, i, k;
+	uint64_t bytes=0;
+	int fd, r;
+	bool ret=false;
+
+	if((fd=open(filename, O_RDONLY|O_LARGEFILE))<0) {
+		fprintf(stderr, "Unable to open undo log \"%s\": %s\n", filename,
+strerror(errno));
+		return false;
+	}
+
+	if(read(fd, &head, sizeof(head))!=sizeof(head)||
+memcmp(head.magic, undo_magic, UNDO_MAGIC_LEN)||le32toh(head.version)!=1) {
+		fprintf(stderr, "\"%s\" is not a usable undo log\n", filename);
+		goto abort;
+	}
+
+	if(!(zbuf=malloc(compressBound(UNDO_PIECE)))||!(buf=malloc(UNDO_PIECE))) {
+		fprintf(stderr, "Memory allocation failure\n");
+		goto abort;
+	}
+
+	/* a half-done rollback would be worse than none, so check everything
+	** and note where each record is first */
+	for(;;) {
+		off64_t at;
+		void *tmp;
+
+		if((at=lseek(fd, 0, SEEK_CUR))<0) goto abort_io;
+		if((r=undo_next(fd, &rec, zbuf, buf))<=0) break;
+
+		if(!(tmp=realloc(pos, sizeof(pos[0])*(npos+1)))) {
+			fprintf(stderr, "Memory allocation failure\n");
+			goto abort;
+		}
+		pos=tmp;
+		pos[npos++]=at;
+	}
+
+	if(r<0) {
+		fprintf(stderr, "Undo log \"%s\" is corrupt, nothing written\n",
+filename);
+		goto abort;
+	}
+
+	/* a resumed run appends, its records may cover blocks an earlier run
+	** already saved; newest first leaves the oldest contents in place */
+	for(k=npos; k-->0; ) {
+		ssize_t w;
+		int sfd;
+
+		if(lseek(fd, pos[k], SEEK_SET)!=pos[k]) goto abort_io;
+		if(undo_next(fd, &rec, zbuf, buf)<=0) {
+			fprintf(stderr, "Undo log \"%s\" changed while in use!\n",
+filename);
+			goto abort;
+		}
+
+		for(i=0; i<nslices; ++i)
+			if(!strcmp(slices[i].name, rec.slice_name)) break;
+
+		if(i==nslices) {
+			void *tmp;
+
+			if(!(tmp=realloc(slices, sizeof(slices[0])*(nslices+1)))) {
+				fprintf(stderr, "Memory allocation failure\n");
+				goto abort;
+			}
+			slices=tmp;
+
+			if((slices[i].fd=open_slice(rec.slice_name, simulate,
+&slices[i].base))<0) goto abort;
+			strcpy(slices[i].name, rec.slice_name);
+			++nslices;
+
+			if(verbose>=0) printf("Rolling back %s%s\n", rec.slice_name,
+simulate?" (simulated)":"");
+		}
+		sfd=slices[i].fd;
+
+		if(verbose>=3) fprintf(stderr,
+"DEBUG: restoring %u bytes at %llu of %s\n", rec.len,
+(unsigned long long)rec.off, rec.slice_name);
+
+		if(!simulate&&(w=pwrite64(sfd, buf, rec.len,
+slices[i].base+rec.off))!=rec.len) {
+			fprintf(stderr, "Write to \"%s\" failed: %s\n",
+rec.slice_name, w<0?strerror(errno):"short write");
+			goto abort;
+		}
+
+		bytes+=rec.len;
+		++count;
+	}
+
+	for(i=0; i<nslices; ++i) if(!simulate&&fsync(slices[i].fd)<0) {
+		fprintf(stderr, "Flushing \"%s\" failed: %s\n", slices[i].name,
+strerror(errno));
+		goto abort;
+	}
+
+	if(verbose>=0) printf("Restored %llu bytes in %u pieces%s\n",
+(unsigned long long)bytes, count, simulate?" (simulated)":"");
+
+	ret=true;
+	goto abort;
+
+abort_io:
+	fprintf(stderr, "Failed while reading \"%s\": %s\n", filename,
+strerror(errno));
+abort:
+	for(i=0; i<nslices; ++i) close(slices[i].fd);
+	free(slices);
+	free(pos);
+	free(zbuf);
+	free(buf);
+	close(fd);
+
+	return ret;
+}
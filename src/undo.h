@@ -0,0 +1,79 @@
+/* **********************************************************************
+* Copyright (C) 2018 Elliott Mitchell					*
+*									*
+*	This program is free software: you can redistribute it and/or	*
+*	modify it under the terms of the GNU General Public License as	*
+*	published by the Free Software Foundation, either version 3 of	*
+*	the License, or (at your option) any later version.		*
+*									*
+*	This program is distributed in the hope that it will be useful,	*
+*	but WITHOUT ANY WARRANTY; without even the implied warranty of	*
+*	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the	*
+*	GNU General Public License for more details.			*
+*									*
+*	You should have received a copy of the GNU General Public	*
+*	License along with this program.  If not, see			*
+*	<http://www.gnu.org/licenses/>.					*
+************************************************************************/
+
+#ifndef __UNDO_H__
+#define __UNDO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+/* Log of the old contents of blocks about to be overwritten, so a write can
+** be rolled back.  Data is compressed by background threads and appended in
+** whatever order it finishes; one run's records never overlap, so order is
+** moot.  A resumed run appends to the log, its records can overlap earlier
+** ones, so rollback goes newest first. */
+struct undo;
+
+#define UNDO_MAGIC_LEN 8
+
+extern const char undo_magic[UNDO_MAGIC_LEN];
+
+/* undo log header, all values are little-endian */
+struct undo_head {
+	char magic[UNDO_MAGIC_LEN];
+	uint32_t version;	/* format version */
+};
+
+/* precedes each piece's compressed data */
+struct undo_rec {
+	char slice_name[32];	/* slice ("partition") the data belongs to */
+	uint64_t off;		/* byte offset in the slice */
+	uint32_t len;		/* bytes of data */
+	uint32_t zlen;		/* bytes of compressed data following */
+	uint32_t crc32;		/* CRC32 of the data */
+	uint32_t pad;		/* zero, so the size doesn't depend on the compiler */
+};
+
+/* create the log, or add to an existing one */
+extern struct undo *undo_open(const char *filename);
+
+/* save len bytes of slice_name at off, copied before returning */
+extern bool undo_add(struct undo *, const char *slice_name, uint64_t off,
+const void *buf, size_t len);
+
+/* wait for everything added so far to reach the disk, before flushing
+** what it protects; false if anything failed */
+extern bool undo_sync(struct undo *);
+
+/* wait for everything added and flush the log; false if anything failed,
+** in which case the log is incomplete */
+extern bool undo_close(struct undo *);
+
+/* open a slice to write back to (read when simulating), *base gets the
+** slice's offset in what was opened; -1 on failure, already reported */
+typedef int (*undo_openfunc)(const char *slice_name, bool simulate,
+off64_t *base);
+
+/* write the logged blocks back, everything is checked before any writes */
+extern bool undo_rollback(const char *filename, bool simulate, undo_openfunc);
+
+#endif
+